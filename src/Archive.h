@@ -1,63 +1,782 @@
 #ifndef ARCHIVE_H
 #define ARCHIVE_H
 
-#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 #include "MESSAGE.h"
 
-template <typename AR, typename T>
-class serializer
+//  把结构体直接序列化到 MESSAGE::payload 中
+//
+//  每个结构体只需要描述一次字段列表(按声明顺序, 决定编码布局):
+//
+//      struct WeHello {
+//          uint32_t seq;
+//          std::string str;
+//      };
+//      template <>
+//      struct archive_fields<WeHello> : field_list<ARCHIVE_FIELD(WeHello, seq), ARCHIVE_FIELD(WeHello, str)> {
+//      };
+//
+//  编码格式(小端):
+//  - payload 由定长部分和变长部分组成, 定长部分按字段顺序存放每个字段的槽, 变长数据依次追加在后面
+//  - 标量(整数、枚举、浮点、bool)的槽就是它本身, 定长数组和嵌套结构体的槽是其所有元素/字段的槽
+//  - std::string 和 std::vector 的槽是 8 字节 {uint32_t 偏移, uint32_t 长度}, 偏移相对于 payload 起始位置,
+//    长度对字符串是字节数、对数组是元素个数; 数组元素的槽连续存放在偏移处, 元素自己的变长数据继续追加在后面
+//
+//  因此每个字段在定长部分中的位置在编译期就确定了, 编码后的总长度由一次很便宜的预计算得到(只含定长字段时是常量),
+//  分配器只需要按准确的大小分配一次, 字段直接写入 payload, 没有中间缓冲区
+
+
+//  小端读写, 不要求地址对齐
+template <typename T>
+inline void wire_store(uint8_t* p, T val)
 {
-public:
-    void load(AR& ar, T& val)
+    std::memcpy(p, &val, sizeof(T));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    for (size_t i = 0; i < sizeof(T) / 2; i++) {
+        uint8_t tmp = p[i];
+        p[i] = p[sizeof(T) - 1 - i];
+        p[sizeof(T) - 1 - i] = tmp;
+    }
+#endif
+}
+
+template <typename T>
+inline T wire_load(const uint8_t* p)
+{
+    T val;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    uint8_t tmp[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); i++) {
+        tmp[i] = p[sizeof(T) - 1 - i];
+    }
+    std::memcpy(&val, tmp, sizeof(T));
+#else
+    std::memcpy(&val, p, sizeof(T));
+#endif
+    return val;
+}
+
+
+//  描述结构体 C 的一个字段
+template <typename C, typename M, M C::*PTR>
+struct archive_field {
+    typedef M member_type;
+
+    static inline const M& get(const C& obj)
     {
-        std::printf("serializer::load\n");
+        return obj.*PTR;
     }
-    void save(AR& ar, const T& val)
+
+    static inline M& get(C& obj)
     {
-        std::printf("serializer::save\n");
+        return obj.*PTR;
     }
 };
 
+#define ARCHIVE_FIELD(C, name) archive_field<C, decltype(C::name), &C::name>
+
+template <typename... FIELDS>
+struct field_list {
+    enum { declared = 1 };
+};
+
+//  没有特化的类型不能序列化
+template <typename T>
+struct archive_fields {
+    enum { declared = 0 };
+};
+
+
+//  写: 调用者保证 payload 的空间足够(大小由 ArchiveSize 预先算出)
 class message_oarchive
 {
 public:
-    static constexpr bool is_load = false;
-    static constexpr bool is_save = true;
-    message_oarchive(MESSAGE* message)
+    message_oarchive(MESSAGE* message, uint32_t fixed) : base(message->payload), tail(fixed)
     {
     }
+
+    inline uint8_t* at(uint32_t pos)
+    {
+        return base + pos;
+    }
+
+    //  在变长部分中占用 n 字节, 返回其偏移
+    inline uint32_t alloc(uint32_t n)
+    {
+        uint32_t pos = tail;
+        tail += n;
+        return pos;
+    }
+
+    inline uint32_t length() const
+    {
+        return tail;
+    }
+
+private:
+    uint8_t* base;
+    uint32_t tail;  //  变长部分的结束位置
 };
 
+//  读: 所有偏移和长度都先对照 PayloadLength 检查, 越界时读取失败.
+//  偏移可以被伪造成互相重叠, 为避免嵌套数组反复指向同一段数据放大解码的工作量,
+//  访问的含变长数据的数组元素总数不能超过 payload 的字节数(正常编码的每个元素至少占 1 字节)
 class message_iarchive
 {
-    static constexpr bool is_load = true;
-    static constexpr bool is_save = false;
+public:
+    message_iarchive(const MESSAGE* message)
+        : base(message->payload), size(uint32_t(message->PayloadLength() > 0 ? message->PayloadLength() : 0))
+    {
+        budget = size;
+    }
+
+    message_iarchive(const uint8_t* data, uint32_t length) : base(data), size(length)
+    {
+        budget = size;
+    }
+
+    inline bool check(uint64_t pos, uint64_t n) const
+    {
+        return (pos + n) <= size;
+    }
+
+    inline bool spend(uint32_t n)
+    {
+        if (n > budget) {
+            return false;
+        }
+        budget -= n;
+        return true;
+    }
+
+    inline const uint8_t* at(uint32_t pos) const
+    {
+        return base + pos;
+    }
+
+    inline uint32_t length() const
+    {
+        return size;
+    }
+
+private:
+    const uint8_t* base;
+    uint32_t size;
+    uint32_t budget;  //  还可以访问的数组元素个数
+};
+
+
+//  每种可序列化类型的编码规则:
+//  slot 是在定长部分(或者数组中)的槽大小, fixed 表示没有变长数据;
+//  tail 计算变长数据的字节数, save/load 在 pos 处的槽中读写;
+//  check 只检查 pos 处的槽引用的变长数据都在 payload 之内(槽本身由上一层检查), 供 ArchiveView 使用
+template <typename T, typename Enable = void>
+struct serializer;
+
+//  标量
+template <typename T>
+struct serializer<T, typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value>::type> {
+    enum : uint32_t { slot = sizeof(T) };
+    enum { fixed = 1 };
+
+    static inline uint32_t tail(const T&)
+    {
+        return 0;
+    }
+
+    static inline void save(message_oarchive& ar, uint32_t pos, const T& val)
+    {
+        wire_store<T>(ar.at(pos), val);
+    }
+
+    static inline bool load(message_iarchive& ar, uint32_t pos, T& val)
+    {
+        val = wire_load<T>(ar.at(pos));
+        return true;
+    }
+
+    static inline bool check(message_iarchive&, uint32_t)
+    {
+        return true;
+    }
+};
+
+template <>
+struct serializer<bool> {
+    enum : uint32_t { slot = 1 };
+    enum { fixed = 1 };
+
+    static inline uint32_t tail(const bool&)
+    {
+        return 0;
+    }
+
+    static inline void save(message_oarchive& ar, uint32_t pos, const bool& val)
+    {
+        *ar.at(pos) = val ? 1 : 0;
+    }
+
+    static inline bool load(message_iarchive& ar, uint32_t pos, bool& val)
+    {
+        val = (0 != *ar.at(pos));
+        return true;
+    }
+
+    static inline bool check(message_iarchive&, uint32_t)
+    {
+        return true;
+    }
+};
+
+//  变长数据的槽: {偏移, 长度}
+struct archive_span {
+    enum : uint32_t { slot = 8 };
+
+    static inline void save(message_oarchive& ar, uint32_t pos, uint32_t off, uint32_t len)
+    {
+        wire_store<uint32_t>(ar.at(pos), off);
+        wire_store<uint32_t>(ar.at(pos + 4), len);
+    }
+
+    //  读出并检查 [off, off + len * elem) 在 payload 之内
+    static inline bool load(message_iarchive& ar, uint32_t pos, uint32_t elem, uint32_t* off, uint32_t* len)
+    {
+        *off = wire_load<uint32_t>(ar.at(pos));
+        *len = wire_load<uint32_t>(ar.at(pos + 4));
+        return ar.check(*off, uint64_t(*len) * elem);
+    }
+};
+
+template <>
+struct serializer<std::string> {
+    enum : uint32_t { slot = archive_span::slot };
+    enum { fixed = 0 };
+
+    static inline uint32_t tail(const std::string& val)
+    {
+        return uint32_t(val.size());
+    }
+
+    static inline void save(message_oarchive& ar, uint32_t pos, const std::string& val)
+    {
+        uint32_t off = ar.alloc(uint32_t(val.size()));
+        archive_span::save(ar, pos, off, uint32_t(val.size()));
+        if (!val.empty()) {
+            std::memcpy(ar.at(off), val.data(), val.size());
+        }
+    }
+
+    static inline bool load(message_iarchive& ar, uint32_t pos, std::string& val)
+    {
+        uint32_t off = 0;
+        uint32_t len = 0;
+        if (!archive_span::load(ar, pos, 1, &off, &len)) {
+            return false;
+        }
+        val.assign((const char*)ar.at(off), len);
+        return true;
+    }
+
+    static inline bool check(message_iarchive& ar, uint32_t pos)
+    {
+        uint32_t off = 0;
+        uint32_t len = 0;
+        return archive_span::load(ar, pos, 1, &off, &len);
+    }
+};
+
+//  连续存放的 count 个元素的槽
+template <typename E, bool BULK = false>
+struct archive_elems {
+    static inline void save(message_oarchive& ar, uint32_t pos, const E* data, uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; i++) {
+            serializer<E>::save(ar, pos + i * serializer<E>::slot, data[i]);
+        }
+    }
+
+    static inline bool load(message_iarchive& ar, uint32_t pos, E* data, uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; i++) {
+            if (!serializer<E>::load(ar, pos + i * serializer<E>::slot, data[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static inline bool check(message_iarchive& ar, uint32_t pos, uint32_t count)
+    {
+        if (serializer<E>::fixed) {
+            return true;
+        }
+        if (!ar.spend(count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (!serializer<E>::check(ar, pos + i * serializer<E>::slot)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+//  小端主机上标量数组的编码就是内存布局, 可以整体拷贝
+template <typename E>
+struct archive_elems<E, true> {
+    static inline void save(message_oarchive& ar, uint32_t pos, const E* data, uint32_t count)
+    {
+        if (count > 0) {
+            std::memcpy(ar.at(pos), data, count * sizeof(E));
+        }
+    }
+
+    static inline bool load(message_iarchive& ar, uint32_t pos, E* data, uint32_t count)
+    {
+        if (count > 0) {
+            std::memcpy(data, ar.at(pos), count * sizeof(E));
+        }
+        return true;
+    }
+
+    static inline bool check(message_iarchive&, uint32_t, uint32_t)
+    {
+        return true;
+    }
+};
+
+template <typename E>
+struct archive_bulk {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    enum { value = 0 };
+#else
+    enum { value = (std::is_arithmetic<E>::value && !std::is_same<E, bool>::value) };
+#endif
+};
+
+template <typename E>
+struct serializer<std::vector<E>> {
+    static_assert((serializer<E>::slot > 0), "empty element");
+    enum : uint32_t { slot = archive_span::slot };
+    enum { fixed = 0 };
+
+    static inline uint32_t tail(const std::vector<E>& val)
+    {
+        uint32_t n = uint32_t(val.size()) * serializer<E>::slot;
+        if (!serializer<E>::fixed) {
+            for (const auto& elem : val) {
+                n += serializer<E>::tail(elem);
+            }
+        }
+        return n;
+    }
+
+    static inline void save(message_oarchive& ar, uint32_t pos, const std::vector<E>& val)
+    {
+        uint32_t count = uint32_t(val.size());
+        uint32_t off = ar.alloc(count * serializer<E>::slot);
+        archive_span::save(ar, pos, off, count);
+        archive_elems<E, archive_bulk<E>::value>::save(ar, off, val.data(), count);
+    }
+
+    static inline bool load(message_iarchive& ar, uint32_t pos, std::vector<E>& val)
+    {
+        uint32_t off = 0;
+        uint32_t count = 0;
+        if (!archive_span::load(ar, pos, serializer<E>::slot, &off, &count)) {
+            return false;
+        }
+
+        if (!serializer<E>::fixed && !ar.spend(count)) {
+            return false;
+        }
+        val.resize(count);
+        return archive_elems<E, archive_bulk<E>::value>::load(ar, off, val.data(), count);
+    }
+
+    static inline bool check(message_iarchive& ar, uint32_t pos)
+    {
+        uint32_t off = 0;
+        uint32_t count = 0;
+        if (!archive_span::load(ar, pos, serializer<E>::slot, &off, &count)) {
+            return false;
+        }
+        return archive_elems<E, archive_bulk<E>::value>::check(ar, off, count);
+    }
+};
+
+//  定长数组: 元素的槽直接放在定长部分中
+template <typename E, size_t N>
+struct serializer<E[N]> {
+    enum : uint32_t { slot = N * serializer<E>::slot };
+    enum { fixed = serializer<E>::fixed };
+
+    static inline uint32_t tail(const E (&val)[N])
+    {
+        uint32_t n = 0;
+        if (!fixed) {
+            for (size_t i = 0; i < N; i++) {
+                n += serializer<E>::tail(val[i]);
+            }
+        }
+        return n;
+    }
+
+    static inline void save(message_oarchive& ar, uint32_t pos, const E (&val)[N])
+    {
+        archive_elems<E, archive_bulk<E>::value>::save(ar, pos, val, N);
+    }
+
+    static inline bool load(message_iarchive& ar, uint32_t pos, E (&val)[N])
+    {
+        return archive_elems<E, archive_bulk<E>::value>::load(ar, pos, val, N);
+    }
+
+    static inline bool check(message_iarchive& ar, uint32_t pos)
+    {
+        return archive_elems<E, archive_bulk<E>::value>::check(ar, pos, N);
+    }
+};
+
+
+//  按字段列表递归: OFFSET 是当前字段在结构体槽中的偏移(编译期常量)
+template <typename C, uint32_t OFFSET, typename... FIELDS>
+struct record_walker;
+
+template <typename C, uint32_t OFFSET>
+struct record_walker<C, OFFSET> {
+    enum : uint32_t { slot = 0 };
+    enum { fixed = 1 };
+
+    static inline uint32_t tail(const C&)
+    {
+        return 0;
+    }
+
+    static inline void save(message_oarchive&, uint32_t, const C&)
+    {
+    }
+
+    static inline bool load(message_iarchive&, uint32_t, C&)
+    {
+        return true;
+    }
+
+    static inline bool check(message_iarchive&, uint32_t)
+    {
+        return true;
+    }
+};
+
+template <typename C, uint32_t OFFSET, typename F, typename... REST>
+struct record_walker<C, OFFSET, F, REST...> {
+    typedef serializer<typename F::member_type> head;
+    typedef record_walker<C, OFFSET + head::slot, REST...> next;
+
+    enum : uint32_t { slot = head::slot + next::slot };
+    enum { fixed = (head::fixed && next::fixed) };
+
+    static inline uint32_t tail(const C& obj)
+    {
+        return head::tail(F::get(obj)) + next::tail(obj);
+    }
+
+    static inline void save(message_oarchive& ar, uint32_t pos, const C& obj)
+    {
+        head::save(ar, pos + OFFSET, F::get(obj));
+        next::save(ar, pos, obj);
+    }
+
+    static inline bool load(message_iarchive& ar, uint32_t pos, C& obj)
+    {
+        return head::load(ar, pos + OFFSET, F::get(obj)) && next::load(ar, pos, obj);
+    }
+
+    static inline bool check(message_iarchive& ar, uint32_t pos)
+    {
+        return head::check(ar, pos + OFFSET) && next::check(ar, pos);
+    }
+};
+
+//  字段 G 在结构体槽中的偏移(编译期常量)
+template <typename G, uint32_t OFFSET, typename... FIELDS>
+struct field_offset;
+
+template <typename G, uint32_t OFFSET, typename F, typename... REST>
+struct field_offset<G, OFFSET, F, REST...>
+    : public std::conditional<std::is_same<G, F>::value, std::integral_constant<uint32_t, OFFSET>,
+                              field_offset<G, OFFSET + serializer<typename F::member_type>::slot, REST...>>::type {
 };
 
-template <typename AR, typename T>
-void serialize(AR&, T& val)
+template <typename G, uint32_t OFFSET>
+struct field_offset<G, OFFSET> {
+    static_assert(!std::is_same<G, G>::value, "field is not in archive_fields");
+};
+
+template <typename C, typename LIST>
+struct record_of;
+
+template <typename C, typename... FIELDS>
+struct record_of<C, field_list<FIELDS...>> {
+    typedef record_walker<C, 0, FIELDS...> type;
+
+    template <typename G>
+    struct offset_of : public field_offset<G, 0, FIELDS...> {
+    };
+};
+
+//  声明了字段列表的结构体
+template <typename T>
+struct serializer<T, typename std::enable_if<archive_fields<T>::declared>::type>
+    : public record_of<T, typename archive_fields<T>::field_list>::type {
+};
+
+
+//  编码后 payload 的准确长度
+template <typename T>
+inline uint32_t ArchiveSize(const T& val)
 {
-    std::printf("serialize(T& val)\n");
+    return serializer<T>::slot + serializer<T>::tail(val);
+}
+
+//  把 val 编码到 msg 的 payload 中并设置 PayloadLength, 空间不足时返回 -1
+template <typename T>
+inline int Serialize(const T& val, MESSAGE* msg)
+{
+    Q_ASSERT(nullptr != msg);
+    uint32_t size = ArchiveSize(val);
+    if ((uint64_t(size) + sizeof(MESSAGE) > uint64_t(msg->Cap())) || (uint64_t(size) + sizeof(MESSAGE) > MESSAGE::TOTAL_LENGTH_LARGE)) {
+        return -1;
+    }
+
+    message_oarchive ar(msg, serializer<T>::slot);
+    serializer<T>::save(ar, 0, val);
+    Q_ASSERT(ar.length() == size);
+    msg->PayloadLength(size);
+    return 0;
+}
+
+//  按准确的大小分配一个用户消息并把 val 编码进去, 分配失败或者超过最大长度时返回空
+template <typename ALLOCATOR, typename T>
+inline MESSAGE* SerializeMessage(ALLOCATOR* alloc, const T& val)
+{
+    uint32_t size = ArchiveSize(val);
+    if (uint64_t(size) + sizeof(MESSAGE) > MESSAGE::TOTAL_LENGTH_LARGE) {
+        return nullptr;
+    }
+
+    MESSAGE* msg = alloc->Alloc(int32_t(size));
+    if (nullptr == msg) {
+        return nullptr;
+    }
+    msg->Type(MESSAGE::TYPE_USER);
+    message_oarchive ar(msg, serializer<T>::slot);
+    serializer<T>::save(ar, 0, val);
+    msg->PayloadLength(size);
+    return msg;
+}
+
+//  从 msg 的 payload 中解码, payload 不完整或者偏移越界时返回 -1
+template <typename T>
+inline int Deserialize(const MESSAGE* msg, T& val)
+{
+    Q_ASSERT(nullptr != msg);
+    message_iarchive ar(msg);
+    if (!ar.check(0, serializer<T>::slot)) {
+        return -1;
+    }
+    return serializer<T>::load(ar, 0, val) ? 0 : -1;
+}
+
+
+
+//  不解码、直接读取接收到的 payload:
+//  ArchiveView::Bind 对照 PayloadLength 检查一次所有的偏移和长度, 之后读取任何字段都是 O(1) 的, 不再检查.
+//  视图只引用消息中的数据, 消息释放后视图随之失效
+//
+//      ArchiveView<WeHello> hello;
+//      if (0 == hello.Bind(msg)) {
+//          uint32_t seq = ARCHIVE_GET(hello, WeHello, seq);
+//          ArchiveString str = ARCHIVE_GET(hello, WeHello, str);
+//      }
+
+template <typename T>
+class ArchiveView;
+
+template <typename E>
+class ArchiveArray;
+
+//  字符串字段的视图
+class ArchiveString
+{
+public:
+    ArchiveString(const uint8_t* data, uint32_t size) : data((const char*)data), size(size)
+    {
+    }
+
+    inline const char* Data() const
+    {
+        return data;
+    }
+
+    inline uint32_t Size() const
+    {
+        return size;
+    }
+
+    inline std::string ToString() const
+    {
+        return std::string(data, size);
+    }
+
+private:
+    const char* data;
+    uint32_t size;
 };
 
+//  读取 pos 处的槽: 标量返回值, 字符串/数组/结构体返回视图
+template <typename T, typename Enable = void>
+struct archive_reader {
+    typedef ArchiveView<T> type;
 
-////////////////////////////////////////////////////////////////////////////////////
+    static inline type read(const uint8_t* base, uint32_t pos)
+    {
+        return type(base, pos);
+    }
+};
 
+template <typename T>
+struct archive_reader<T, typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value>::type> {
+    typedef T type;
 
-struct Test {
-    int a;
-    int b;
+    static inline type read(const uint8_t* base, uint32_t pos)
+    {
+        return wire_load<T>(base + pos);
+    }
+};
+
+template <>
+struct archive_reader<bool> {
+    typedef bool type;
+
+    static inline type read(const uint8_t* base, uint32_t pos)
+    {
+        return (0 != base[pos]);
+    }
+};
+
+template <>
+struct archive_reader<std::string> {
+    typedef ArchiveString type;
+
+    static inline type read(const uint8_t* base, uint32_t pos)
+    {
+        return type(base + wire_load<uint32_t>(base + pos), wire_load<uint32_t>(base + pos + 4));
+    }
+};
+
+template <typename E>
+struct archive_reader<std::vector<E>> {
+    typedef ArchiveArray<E> type;
+
+    static inline type read(const uint8_t* base, uint32_t pos)
+    {
+        return type(base, wire_load<uint32_t>(base + pos), wire_load<uint32_t>(base + pos + 4));
+    }
 };
 
-template <typename AR>
-class serializer<AR, Test>
+template <typename E, size_t N>
+struct archive_reader<E[N]> {
+    typedef ArchiveArray<E> type;
+
+    static inline type read(const uint8_t* base, uint32_t pos)
+    {
+        return type(base, pos, N);
+    }
+};
+
+//  数组字段(std::vector 或者定长数组)的视图, 下标访问不检查范围
+template <typename E>
+class ArchiveArray
+{
+public:
+    typedef typename archive_reader<E>::type value_type;
+
+    ArchiveArray(const uint8_t* base, uint32_t pos, uint32_t count) : base(base), pos(pos), count(count)
+    {
+    }
+
+    inline uint32_t Size() const
+    {
+        return count;
+    }
+
+    inline value_type operator[](uint32_t index) const
+    {
+        Q_ASSERT(index < count);
+        return archive_reader<E>::read(base, pos + index * serializer<E>::slot);
+    }
+
+private:
+    const uint8_t* base;  //  payload 起始位置
+    uint32_t pos;         //  第一个元素的槽的位置
+    uint32_t count;
+};
+
+//  结构体的视图
+template <typename T>
+class ArchiveView
 {
+private:
+    typedef record_of<T, typename archive_fields<T>::field_list> record;
+
 public:
-    void invoke(AR& ar, Test& val)
+    ArchiveView() : base(nullptr), pos(0)
+    {
+    }
+
+    ArchiveView(const uint8_t* base, uint32_t pos) : base(base), pos(pos)
+    {
+    }
+
+    //  检查 msg 的 payload 是一个完整的 T, 成功时返回 0
+    int Bind(const MESSAGE* msg)
     {
-        std::printf("serializer<AR, Test&>\n");
+        Q_ASSERT(nullptr != msg);
+        base = nullptr;
+        message_iarchive ar(msg);
+        if (!ar.check(0, serializer<T>::slot) || !serializer<T>::check(ar, 0)) {
+            return -1;
+        }
+        base = msg->payload;
+        pos = 0;
+        return 0;
     }
+
+    inline bool Valid() const
+    {
+        return (nullptr != base);
+    }
+
+    //  读取字段 F(ARCHIVE_FIELD 描述), 一般通过 ARCHIVE_GET 调用
+    template <typename F>
+    inline typename archive_reader<typename F::member_type>::type Get() const
+    {
+        Q_ASSERT(Valid());
+        return archive_reader<typename F::member_type>::read(base, pos + record::template offset_of<F>::value);
+    }
+
+private:
+    const uint8_t* base;  //  payload 起始位置, 为空表示没有绑定
+    uint32_t pos;         //  结构体的槽的位置
 };
 
+#define ARCHIVE_GET(view, C, name) ((view).template Get<ARCHIVE_FIELD(C, name)>())
+
 #endif  // ARCHIVE_H
@@ -0,0 +1,228 @@
+#ifndef LZCODEC_H
+#define LZCODEC_H
+
+#include <cstdint>
+#include <cstring>
+
+//  LZ77 类的快速块压缩, 块格式与 LZ4 的 block 格式相同:
+//
+//      token(高4位字面量长度, 低4位匹配长度-4) [字面量长度扩展] 字面量 offset(2字节小端) [匹配长度扩展]
+//
+//  长度为 15 时后面跟扩展字节, 每个扩展字节累加 0~255, 直到遇到不是 255 的字节; 最后一个序列只有字面量.
+//  压缩时用 4 字节哈希查找最近一次出现的位置(贪心匹配), 不可压缩的数据上查找步长逐渐增大;
+//  解压时所有长度和偏移都做边界检查, 可以直接处理从网络收到的数据
+class LzCodec
+{
+public:
+    enum : int32_t {
+        MIN_MATCH = 4,
+        LAST_LITERALS = 5,      //  最后 5 个字节总是字面量
+        MF_LIMIT = 12,          //  距离结尾不足 12 字节时不再查找匹配
+        MAX_OFFSET = 65535,
+        HASH_LOG = 12,
+        EXPAND_MAX = 255,       //  解压结果最多是压缩数据长度的 255 倍(每个扩展字节最多表示 255 字节)
+    };
+
+    //  最坏情况下压缩结果的长度
+    static inline int32_t Bound(int32_t srcLen)
+    {
+        return srcLen + srcLen / 255 + 16;
+    }
+
+    //  压缩 src, 结果超过 dstCap 时返回 -1, 否则返回压缩后的长度.
+    //  dstCap 可以小于 Bound, 用于在结果不够小时提前放弃
+    static int32_t Compress(const uint8_t* src, int32_t srcLen, uint8_t* dst, int32_t dstCap)
+    {
+        uint32_t table[1 << HASH_LOG];
+        std::memset(table, 0, sizeof(table));
+
+        int32_t ip = 0;
+        int32_t anchor = 0;
+        int32_t op = 0;
+        if (srcLen >= MF_LIMIT) {
+            int32_t limit = srcLen - MF_LIMIT;
+            int32_t matchLimit = srcLen - LAST_LITERALS;
+            while (ip <= limit) {
+                uint32_t seq = Load32(src + ip);
+                uint32_t h = Hash(seq);
+                int32_t ref = int32_t(table[h]);
+                table[h] = uint32_t(ip);
+                if ((ref >= ip) || (ip - ref > MAX_OFFSET) || (Load32(src + ref) != seq)) {
+                    //  连续找不到匹配时加大步长, 不可压缩的数据很快扫过去
+                    ip += 1 + ((ip - anchor) >> 6);
+                    continue;
+                }
+
+                int32_t mlen = MIN_MATCH + MatchLength(src + ref + MIN_MATCH, src + ip + MIN_MATCH, src + matchLimit);
+                op = Emit(src + anchor, ip - anchor, ip - ref, mlen, dst, op, dstCap);
+                if (op < 0) {
+                    return -1;
+                }
+
+                ip += mlen;
+                anchor = ip;
+                if (ip - 2 <= limit) {
+                    table[Hash(Load32(src + ip - 2))] = uint32_t(ip - 2);
+                }
+            }
+        }
+
+        return Emit(src + anchor, srcLen - anchor, 0, 0, dst, op, dstCap);
+    }
+
+    //  解压到 dst, 结果必须正好是 dstLen 字节; 数据损坏或者长度不符时返回 -1, 否则返回 dstLen
+    static int32_t Decompress(const uint8_t* src, int32_t srcLen, uint8_t* dst, int32_t dstLen)
+    {
+        const uint8_t* ip = src;
+        const uint8_t* iend = src + srcLen;
+        uint8_t* op = dst;
+        uint8_t* oend = dst + dstLen;
+
+        while (ip < iend) {
+            uint8_t token = *ip++;
+            uint64_t lit = token >> 4;
+            if ((15 == lit) && !ReadLength(&ip, iend, &lit)) {
+                return -1;
+            }
+            if ((lit > uint64_t(iend - ip)) || (lit > uint64_t(oend - op))) {
+                return -1;
+            }
+            if (lit > 0) {
+                std::memcpy(op, ip, size_t(lit));
+            }
+            ip += lit;
+            op += lit;
+
+            //  最后一个序列只有字面量
+            if (ip == iend) {
+                break;
+            }
+
+            if (iend - ip < 2) {
+                return -1;
+            }
+            uint32_t offset = uint32_t(ip[0]) | (uint32_t(ip[1]) << 8);
+            ip += 2;
+            if ((0 == offset) || (offset > uint32_t(op - dst))) {
+                return -1;
+            }
+
+            uint64_t mlen = token & 15;
+            if ((15 == mlen) && !ReadLength(&ip, iend, &mlen)) {
+                return -1;
+            }
+            mlen += MIN_MATCH;
+            if (mlen > uint64_t(oend - op)) {
+                return -1;
+            }
+
+            const uint8_t* ref = op - offset;
+            if (offset >= mlen) {
+                std::memcpy(op, ref, size_t(mlen));
+                op += mlen;
+            } else {
+                //  与输出重叠(重复的短模式): ref 之后的数据以 offset 为周期,
+                //  每次复制已经生成的整段周期, 复制的长度逐次翻倍
+                while (mlen > 0) {
+                    size_t n = (mlen < uint64_t(op - ref)) ? size_t(mlen) : size_t(op - ref);
+                    std::memcpy(op, ref, n);
+                    op += n;
+                    mlen -= n;
+                }
+            }
+        }
+
+        return (op == oend) ? dstLen : -1;
+    }
+
+private:
+    static inline uint32_t Load32(const uint8_t* p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static inline uint32_t Hash(uint32_t seq)
+    {
+        return (seq * 2654435761U) >> (32 - HASH_LOG);
+    }
+
+    //  从 a/b 开始还有多少字节相同(b 不超过 bend)
+    static inline int32_t MatchLength(const uint8_t* a, const uint8_t* b, const uint8_t* bend)
+    {
+        const uint8_t* start = b;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+        while (b + 8 <= bend) {
+            uint64_t x;
+            uint64_t y;
+            std::memcpy(&x, a, 8);
+            std::memcpy(&y, b, 8);
+            if (x != y) {
+                return int32_t(b - start) + (__builtin_ctzll(x ^ y) >> 3);
+            }
+            a += 8;
+            b += 8;
+        }
+#endif
+        while ((b < bend) && (*a == *b)) {
+            a++;
+            b++;
+        }
+        return int32_t(b - start);
+    }
+
+    static inline bool ReadLength(const uint8_t** ip, const uint8_t* iend, uint64_t* len)
+    {
+        uint8_t byte = 0;
+        do {
+            if (*ip >= iend) {
+                return false;
+            }
+            byte = *(*ip)++;
+            *len += byte;
+        } while (255 == byte);
+        return true;
+    }
+
+    static inline int32_t WriteLength(uint8_t* dst, int32_t op, int32_t len)
+    {
+        for (; len >= 255; len -= 255) {
+            dst[op++] = 255;
+        }
+        dst[op++] = uint8_t(len);
+        return op;
+    }
+
+    //  输出一个序列, mlen 为 0 表示最后一个只有字面量的序列; 超过 cap 时返回 -1
+    static inline int32_t Emit(const uint8_t* lit, int32_t litLen, int32_t offset, int32_t mlen, uint8_t* dst,
+                               int32_t op, int32_t cap)
+    {
+        int64_t need = int64_t(op) + 1 + litLen + (litLen / 255 + 1) + ((mlen > 0) ? (2 + (mlen / 255 + 1)) : 0);
+        if (need > cap) {
+            return -1;
+        }
+
+        int32_t token = op++;
+        int32_t mcode = (mlen > 0) ? (mlen - MIN_MATCH) : 0;
+        dst[token] = uint8_t(((litLen >= 15) ? 15 : litLen) << 4) | uint8_t((mcode >= 15) ? 15 : mcode);
+        if (litLen >= 15) {
+            op = WriteLength(dst, op, litLen - 15);
+        }
+        if (litLen > 0) {
+            std::memcpy(dst + op, lit, litLen);
+        }
+        op += litLen;
+
+        if (mlen > 0) {
+            dst[op++] = uint8_t(offset & 0xFF);
+            dst[op++] = uint8_t((offset >> 8) & 0xFF);
+            if (mcode >= 15) {
+                op = WriteLength(dst, op, mcode - 15);
+            }
+        }
+        return op;
+    }
+};
+
+#endif  // LZCODEC_H
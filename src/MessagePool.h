@@ -0,0 +1,425 @@
+#ifndef MESSAGEPOOL_H
+#define MESSAGEPOOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "MESSAGE.h"
+
+//  按2的幂分级的消息内存池, 可以直接作为 SMQTransport 的 ALLOCATOR 模板参数使用
+//
+//  - 每一级的块大小为 (BUFFER + MESSAGE + payload) 向上取整到2的幂, 从 64B 到 1MB;
+//    超出最大级别的请求直接走 malloc/free
+//  - 每一级从 slab(大块内存) 中一次切出多个块, slab 只在内存池析构时才归还系统
+//  - 每个线程对每个级别持有一个无锁的本地空闲链表缓存, Alloc/Free 在命中缓存时不加锁
+//  - 线程缓存不足时批量从全局仓库(depot)补充, 超出上限时批量归还到仓库;
+//    因此一个线程分配、另一个线程释放(例如 IO 线程收消息, 业务线程释放)的块,
+//    会经由仓库回到分配方线程, 这就是跨线程的归还通道
+class MessageAllocatorPool : public MessageAllocator
+{
+public:
+    enum : int32_t {
+        CLASS_SHIFT_MIN = 6,   //  最小块: 64B
+        CLASS_SHIFT_MAX = 20,  //  最大块: 1MB
+        CLASS_COUNT = CLASS_SHIFT_MAX - CLASS_SHIFT_MIN + 1,
+    };
+
+    enum : int32_t {
+        SLAB_SIZE_DEF = 256 * 1024,  //  每次切分的 slab 大小
+        CACHE_DEPTH_DEF = 64,        //  线程缓存每一级最多保留的块数
+    };
+
+    struct ClassStats {
+        int32_t blockSize;   //  块大小(含 BUFFER 头)
+        uint64_t hits;       //  从线程缓存直接分配成功的次数
+        uint64_t misses;     //  线程缓存为空, 需要访问仓库的次数
+        uint64_t slabs;      //  已切分的 slab 数
+        uint64_t highWater;  //  已切分出来的块数, 即同时在用(含缓存)的块数峰值
+    };
+
+    struct Stats {
+        ClassStats classes[CLASS_COUNT];
+        uint64_t oversize;           //  超出最大级别, 直接 malloc 的次数
+        uint64_t oversizeHighWater;  //  超大块同时在用的峰值
+        uint64_t failures;           //  内存不足导致分配失败的次数
+    };
+
+public:
+    MessageAllocatorPool(int32_t slabSize = SLAB_SIZE_DEF, int32_t cacheDepth = CACHE_DEPTH_DEF)
+    {
+        static std::atomic<uint64_t> idgen(0);
+        id = ++idgen;
+        this->slabSize = slabSize;
+        this->cacheDepth = (cacheDepth < 2) ? 2 : cacheDepth;
+        for (int32_t i = 0; i < CLASS_COUNT; i++) {
+            depot[i].head = nullptr;
+            depot[i].count = 0;
+            depot[i].slabs = 0;
+            depot[i].carved = 0;
+        }
+        oversizeLive = 0;
+        oversizeCount = 0;
+        oversizeHighWater = 0;
+        failures = 0;
+    }
+
+    virtual ~MessageAllocatorPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(Registry());
+            //  线程缓存由各自线程在退出时释放, 这里只是断开它们和内存池的联系
+            for (auto cache : caches) {
+                cache->pool = nullptr;
+            }
+            caches.clear();
+        }
+
+        for (auto slab : slabs) {
+            free(slab);
+        }
+    }
+
+    virtual MESSAGE* Alloc(int32_t payloadSize)
+    {
+        int32_t total = sizeof(BUFFER) + sizeof(MESSAGE) + payloadSize;
+        int32_t cls = ClassOf(total);
+        if (cls >= CLASS_COUNT) {
+            return AllocOversize(total);
+        }
+
+        cache_t* cache = LocalCache();
+        BUFFER* buf = (BUFFER*)(cache->heads[cls]);
+        if (nullptr != buf) {
+            cache->heads[cls] = buf->next;
+            cache->counts[cls]--;
+            Bump(cache->hits[cls]);
+        } else {
+            Bump(cache->misses[cls]);
+            buf = Refill(cache, cls);
+            if (nullptr == buf) {
+                failures++;
+                return nullptr;
+            }
+        }
+
+        buf->owner = nullptr;
+        buf->cap = BlockSize(cls) - sizeof(BUFFER);
+
+        MESSAGE* msg = MessageOf(buf);
+        msg->Reset();
+        return msg;
+    }
+
+    virtual void Free(MESSAGE* msg)
+    {
+        Q_ASSERT(nullptr != msg);
+        BUFFER* buf = BufferOf(msg);
+        if (nullptr != buf->owner) {
+            buf->owner->Release(buf);
+            return;
+        }
+
+        int32_t total = buf->cap + sizeof(BUFFER);
+        if (total > BlockSize(CLASS_COUNT - 1)) {
+            oversizeLive--;
+            free(buf);
+            return;
+        }
+
+        int32_t cls = ClassOf(total);
+        Q_ASSERT(BlockSize(cls) == total);
+
+        cache_t* cache = LocalCache();
+        buf->next = cache->heads[cls];
+        cache->heads[cls] = buf;
+        if (++cache->counts[cls] > cacheDepth) {
+            Flush(cache, cls, cacheDepth / 2);
+        }
+    }
+
+    //  预先切分出足够容纳 count 个 payloadSize 大小消息的块, 放入仓库
+    int Reserve(int32_t payloadSize, int32_t count)
+    {
+        int32_t cls = ClassOf(sizeof(BUFFER) + sizeof(MESSAGE) + payloadSize);
+        if (cls >= CLASS_COUNT) {
+            return -1;
+        }
+
+        std::lock_guard<std::mutex> lock(depot[cls].mutex);
+        while (depot[cls].count < count) {
+            if (0 != Carve(cls)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    Stats GetStats()
+    {
+        Stats stats;
+        for (int32_t i = 0; i < CLASS_COUNT; i++) {
+            ClassStats& cs = stats.classes[i];
+            cs.blockSize = BlockSize(i);
+
+            std::lock_guard<std::mutex> lock(depot[i].mutex);
+            cs.slabs = depot[i].slabs;
+            cs.highWater = depot[i].carved;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(Registry());
+            for (int32_t i = 0; i < CLASS_COUNT; i++) {
+                stats.classes[i].hits = retiredHits[i];
+                stats.classes[i].misses = retiredMisses[i];
+            }
+            for (auto cache : caches) {
+                for (int32_t i = 0; i < CLASS_COUNT; i++) {
+                    stats.classes[i].hits += cache->hits[i].load(std::memory_order_relaxed);
+                    stats.classes[i].misses += cache->misses[i].load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        stats.oversize = oversizeCount;
+        stats.oversizeHighWater = oversizeHighWater;
+        stats.failures = failures;
+        return stats;
+    }
+
+private:
+    //  线程本地缓存, 只有所属线程会修改, 计数器用 relaxed 原子量以便其他线程读取统计
+    struct cache_t {
+        uint64_t id;                  //  所属内存池的编号, 编号不会复用
+        MessageAllocatorPool* pool;   //  所属内存池, 内存池析构后为 nullptr
+        NODE* heads[CLASS_COUNT];     //  空闲块单链表(通过 NODE::next 串联)
+        int32_t counts[CLASS_COUNT];  //  空闲块数量
+        std::atomic<uint64_t> hits[CLASS_COUNT];
+        std::atomic<uint64_t> misses[CLASS_COUNT];
+
+        cache_t(MessageAllocatorPool* p) : id(p->id), pool(p)
+        {
+            for (int32_t i = 0; i < CLASS_COUNT; i++) {
+                heads[i] = nullptr;
+                counts[i] = 0;
+                hits[i] = 0;
+                misses[i] = 0;
+            }
+        }
+    };
+
+    //  每个线程持有的所有缓存, 线程退出时将缓存中的块归还给仍然存活的内存池
+    struct thread_caches_t {
+        cache_t* last;
+        std::vector<cache_t*> caches;
+
+        thread_caches_t() : last(nullptr)
+        {
+        }
+
+        ~thread_caches_t()
+        {
+            std::lock_guard<std::mutex> lock(Registry());
+            for (auto cache : caches) {
+                if (nullptr != cache->pool) {
+                    cache->pool->Retire(cache);
+                }
+                delete cache;
+            }
+        }
+    };
+
+    struct depot_t {
+        std::mutex mutex;
+        NODE* head;       //  空闲块单链表
+        int32_t count;    //  空闲块数量
+        uint64_t slabs;   //  已切分的 slab 数
+        uint64_t carved;  //  已切分的块数
+    };
+
+    static std::mutex& Registry()
+    {
+        static std::mutex registry;
+        return registry;
+    }
+
+    static inline void Bump(std::atomic<uint64_t>& counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static inline int32_t BlockSize(int32_t cls)
+    {
+        return (int32_t(1) << (cls + CLASS_SHIFT_MIN));
+    }
+
+    static inline int32_t ClassOf(int32_t total)
+    {
+        if (total <= BlockSize(0)) {
+            return 0;
+        }
+        return (32 - __builtin_clz(uint32_t(total - 1))) - CLASS_SHIFT_MIN;
+    }
+
+    cache_t* LocalCache()
+    {
+        static thread_local thread_caches_t local;
+        if ((nullptr != local.last) && (local.last->id == id)) {
+            return local.last;
+        }
+
+        for (auto cache : local.caches) {
+            if (cache->id == id) {
+                local.last = cache;
+                return cache;
+            }
+        }
+
+        cache_t* cache = new cache_t(this);
+        {
+            std::lock_guard<std::mutex> lock(Registry());
+            caches.push_back(cache);
+        }
+        local.caches.push_back(cache);
+        local.last = cache;
+        return cache;
+    }
+
+    //  从仓库补充线程缓存(仓库为空时切分新的 slab), 返回其中一个块
+    BUFFER* Refill(cache_t* cache, int32_t cls)
+    {
+        depot_t& d = depot[cls];
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if (nullptr == d.head) {
+            if (0 != Carve(cls)) {
+                return nullptr;
+            }
+        }
+
+        BUFFER* buf = (BUFFER*)(d.head);
+        d.head = buf->next;
+        d.count--;
+
+        int32_t batch = cacheDepth / 2;
+        while ((batch-- > 0) && (nullptr != d.head)) {
+            NODE* node = d.head;
+            d.head = node->next;
+            d.count--;
+            node->next = cache->heads[cls];
+            cache->heads[cls] = node;
+            cache->counts[cls]++;
+        }
+
+        return buf;
+    }
+
+    //  将线程缓存中的 count 个块归还到仓库
+    void Flush(cache_t* cache, int32_t cls, int32_t count)
+    {
+        NODE* first = cache->heads[cls];
+        NODE* last = first;
+        int32_t n = 1;
+        while ((n < count) && (nullptr != last->next)) {
+            last = last->next;
+            n++;
+        }
+
+        cache->heads[cls] = last->next;
+        cache->counts[cls] -= n;
+
+        depot_t& d = depot[cls];
+        std::lock_guard<std::mutex> lock(d.mutex);
+        last->next = d.head;
+        d.head = first;
+        d.count += n;
+    }
+
+    //  切分一个新的 slab 到仓库, 调用者需持有仓库锁
+    int Carve(int32_t cls)
+    {
+        int32_t blockSize = BlockSize(cls);
+        int32_t blocks = slabSize / blockSize;
+        if (blocks < 1) {
+            blocks = 1;
+        }
+
+        uint8_t* slab = (uint8_t*)malloc(size_t(blockSize) * blocks);
+        if (nullptr == slab) {
+            return -1;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(slabsMutex);
+            slabs.push_back(slab);
+        }
+
+        depot_t& d = depot[cls];
+        for (int32_t i = blocks - 1; i >= 0; i--) {
+            NODE* node = (NODE*)(slab + size_t(i) * blockSize);
+            node->next = d.head;
+            d.head = node;
+        }
+        d.count += blocks;
+        d.slabs++;
+        d.carved += blocks;
+        return 0;
+    }
+
+    //  线程退出时回收它的缓存, 调用者需持有 Registry 锁
+    void Retire(cache_t* cache)
+    {
+        for (int32_t i = 0; i < CLASS_COUNT; i++) {
+            if (cache->counts[i] > 0) {
+                Flush(cache, i, cache->counts[i]);
+            }
+            retiredHits[i] += cache->hits[i].load(std::memory_order_relaxed);
+            retiredMisses[i] += cache->misses[i].load(std::memory_order_relaxed);
+        }
+
+        for (auto itr = caches.begin(); itr != caches.end(); ++itr) {
+            if (*itr == cache) {
+                caches.erase(itr);
+                break;
+            }
+        }
+    }
+
+    MESSAGE* AllocOversize(int32_t total)
+    {
+        BUFFER* buf = (BUFFER*)malloc(total);
+        if (nullptr == buf) {
+            failures++;
+            return nullptr;
+        }
+        buf->owner = nullptr;
+        buf->cap = total - sizeof(BUFFER);
+
+        oversizeCount++;
+        uint64_t live = ++oversizeLive;
+        uint64_t peak = oversizeHighWater.load(std::memory_order_relaxed);
+        while ((live > peak) && !oversizeHighWater.compare_exchange_weak(peak, live)) {
+        }
+
+        MESSAGE* msg = MessageOf(buf);
+        msg->Reset();
+        return msg;
+    }
+
+private:
+    uint64_t id;                                    //  内存池编号, 用于在线程缓存中查找
+    int32_t slabSize;                               //  slab 大小
+    int32_t cacheDepth;                             //  线程缓存深度
+    depot_t depot[CLASS_COUNT];                     //  各级别的全局仓库
+    std::mutex slabsMutex;                          //  保护 slabs
+    std::vector<void*> slabs;                       //  所有已分配的 slab
+    std::vector<cache_t*> caches;                   //  所有线程缓存(受 Registry 锁保护)
+    uint64_t retiredHits[CLASS_COUNT] = {0};        //  已退出线程的命中计数(受 Registry 锁保护)
+    uint64_t retiredMisses[CLASS_COUNT] = {0};      //  已退出线程的未命中计数(受 Registry 锁保护)
+    std::atomic<uint64_t> oversizeLive;             //  超大块当前在用数量
+    std::atomic<uint64_t> oversizeCount;            //  超大块分配次数
+    std::atomic<uint64_t> oversizeHighWater;        //  超大块在用峰值
+    std::atomic<uint64_t> failures;                 //  分配失败次数
+};
+
+#endif  // MESSAGEPOOL_H
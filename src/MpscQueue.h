@@ -0,0 +1,63 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "MESSAGE.h"
+
+//  多生产者单消费者的无锁队列, 元素是侵入式的 NODE(入队期间借用 NODE::next 串联)
+//
+//  生产者用 CAS 压栈, 消费者一次性摘下整条链表并翻转回入队顺序.
+//  Push 返回入队前队列是否为空: 只有把队列从空变为非空的生产者才需要唤醒消费者,
+//  因此消费者处理一批消息之前到达的所有消息只会触发一次唤醒
+class MpscQueue
+{
+public:
+    MpscQueue() : head(nullptr)
+    {
+    }
+
+    //  任意线程调用
+    inline bool Push(NODE* node)
+    {
+        NODE* old = head.load(std::memory_order_relaxed);
+        do {
+            node->next = old;
+        } while (!head.compare_exchange_weak(old, node, std::memory_order_release, std::memory_order_relaxed));
+        return (nullptr == old);
+    }
+
+    //  只能由消费者线程调用: 按入队顺序把所有元素追加到 list 尾部, 返回元素个数
+    inline int32_t PopAll(NODE* list)
+    {
+        NODE* node = head.exchange(nullptr, std::memory_order_acquire);
+
+        NODE* reversed = nullptr;
+        int32_t count = 0;
+        while (nullptr != node) {
+            NODE* next = node->next;
+            node->next = reversed;
+            reversed = node;
+            node = next;
+            count++;
+        }
+
+        while (nullptr != reversed) {
+            NODE* next = reversed->next;
+            list->push_back(reversed);
+            reversed = next;
+        }
+        return count;
+    }
+
+    inline bool empty() const
+    {
+        return (nullptr == head.load(std::memory_order_relaxed));
+    }
+
+private:
+    std::atomic<NODE*> head;
+};
+
+#endif  // MPSCQUEUE_H
@@ -0,0 +1,87 @@
+#ifndef PAGEDTABLE_H
+#define PAGEDTABLE_H
+
+#include <atomic>
+#include <cstdint>
+
+//  以 16 位地址为下标的两级分页表: 高 8 位选页, 低 8 位选页内的项.
+//  页在第一次写入其中的项时才分配(之后不再释放), 没有用到的地址段只占顶层的一个空指针.
+//  查找是两次不加锁的读取; 分配页用 CAS, 可以在任意线程中并发进行. 项本身的并发访问由使用者负责
+template <typename T>
+class PagedTable
+{
+public:
+    enum : uint32_t {
+        PAGE_BITS = 8,
+        PAGE_SIZE = 1 << PAGE_BITS,
+        PAGES = 65536 >> PAGE_BITS,
+    };
+
+    explicit PagedTable(const T& fill = T()) : fill(fill)
+    {
+        for (uint32_t i = 0; i < PAGES; i++) {
+            pages[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~PagedTable()
+    {
+        for (uint32_t i = 0; i < PAGES; i++) {
+            delete[] pages[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    PagedTable(const PagedTable&) = delete;
+    PagedTable& operator=(const PagedTable&) = delete;
+
+    //  key 对应的项, 所在的页还没有分配时返回空
+    inline T* Find(uint16_t key) const
+    {
+        T* page = pages[key >> PAGE_BITS].load(std::memory_order_acquire);
+        return (nullptr == page) ? nullptr : &(page[key & (PAGE_SIZE - 1)]);
+    }
+
+    //  key 对应的项, 所在的页还没有分配时先分配(新页的所有项都是 fill)
+    T* Slot(uint16_t key)
+    {
+        T* item = Find(key);
+        if (nullptr != item) {
+            return item;
+        }
+
+        T* page = new T[PAGE_SIZE];
+        for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+            page[i] = fill;
+        }
+
+        T* expected = nullptr;
+        if (!pages[key >> PAGE_BITS].compare_exchange_strong(expected, page, std::memory_order_acq_rel,
+                                                              std::memory_order_acquire)) {
+            //  其他线程已经分配了这一页
+            delete[] page;
+            page = expected;
+        }
+        return &(page[key & (PAGE_SIZE - 1)]);
+    }
+
+    //  按地址顺序对已经分配的页中的每一项执行 fn(key, item)
+    template <typename F>
+    void ForEach(F fn) const
+    {
+        for (uint32_t i = 0; i < PAGES; i++) {
+            T* page = pages[i].load(std::memory_order_acquire);
+            if (nullptr == page) {
+                continue;
+            }
+            for (uint32_t j = 0; j < PAGE_SIZE; j++) {
+                fn(uint16_t((i << PAGE_BITS) | j), &(page[j]));
+            }
+        }
+    }
+
+private:
+    std::atomic<T*> pages[PAGES];
+    T fill;  //  新分配的页中每一项的初值
+};
+
+#endif  // PAGEDTABLE_H
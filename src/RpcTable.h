@@ -0,0 +1,144 @@
+#ifndef RPCTABLE_H
+#define RPCTABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "MESSAGE.h"
+
+//  RPC 调用的完成状态, 与 POST_XXX 不重叠, 以便 CallWait 用一个返回值同时表示投递失败
+enum : int32_t {
+    RPC_OK = 0,
+    RPC_TIMEOUT = -16,   //  超时前没有收到回复
+    RPC_CANCELED = -17,  //  传输层停止时还没有完成
+};
+
+//  调用完成时执行一次: status 为 RPC_OK 时 reply 是回复消息(归回调所有, 用完后释放), 否则 reply 为空
+typedef std::function<void(int32_t status, MESSAGE* reply)> RpcCallback;
+
+//  等待回复的 RPC 调用表: 定长的槽数组, 所有操作都不加锁, 可以在任意线程中并发调用
+//
+//  - session 的低 16 位是槽号, 高 16 位是槽的使用代数, 因此过期的回复不会匹配到复用后的槽; session 总是非 0
+//  - 空闲的槽串成一个无锁栈(栈顶带版本号防止 ABA), 最近释放的槽最先复用, 扫描超时只需要检查到 used 为止
+//  - 槽的 state 在等待期间等于 session, 回复和超时都用 CAS 把它清零, 成功的一方执行回调
+class RpcTable
+{
+public:
+    enum : uint32_t {
+        SLOTS_MAX = 65536,
+        INDEX_MASK = 0xFFFF,
+    };
+
+    explicit RpcTable(uint32_t count) : slots(((count > 0) && (count <= SLOTS_MAX)) ? count : SLOTS_MAX), used(0)
+    {
+        for (uint32_t i = 0; i < slots.size(); i++) {
+            slots[i].state.store(0, std::memory_order_relaxed);
+            slots[i].next.store(i + 1, std::memory_order_relaxed);
+            slots[i].gen = 0;
+            slots[i].deadline.store(0, std::memory_order_relaxed);
+        }
+        idle.store(0, std::memory_order_relaxed);
+    }
+
+    //  占用一个槽, 返回 session; 没有空闲的槽时返回 0
+    uint32_t Acquire(int64_t deadline, RpcCallback&& callback)
+    {
+        uint64_t head = idle.load(std::memory_order_acquire);
+        uint32_t index = 0;
+        do {
+            index = uint32_t(head);
+            if (index >= slots.size()) {
+                return 0;
+            }
+            uint64_t next = ((head >> 32) + 1) << 32 | slots[index].next.load(std::memory_order_relaxed);
+            if (idle.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                break;
+            }
+        } while (true);
+
+        slot_t* slot = &(slots[index]);
+        slot->gen = (slot->gen % 0xFFFF) + 1;
+        slot->deadline.store(deadline, std::memory_order_relaxed);
+        slot->callback = std::move(callback);
+
+        uint32_t mark = used.load(std::memory_order_relaxed);
+        while ((index + 1 > mark) && !used.compare_exchange_weak(mark, index + 1, std::memory_order_relaxed)) {
+        }
+
+        uint32_t session = (slot->gen << 16) | index;
+        slot->state.store(session, std::memory_order_release);
+        return session;
+    }
+
+    //  结束 session 对应的调用: 只有第一个结束它的线程得到回调(通过 callback 返回)并返回 true;
+    //  调用已经结束(或者 session 不存在)时返回 false
+    bool Finish(uint32_t session, RpcCallback* callback)
+    {
+        uint32_t index = session & INDEX_MASK;
+        if ((0 == session) || (index >= slots.size())) {
+            return false;
+        }
+
+        slot_t* slot = &(slots[index]);
+        uint32_t expected = session;
+        if (!slot->state.compare_exchange_strong(expected, 0, std::memory_order_acq_rel)) {
+            return false;
+        }
+
+        *callback = std::move(slot->callback);
+        slot->callback = nullptr;
+        Release(index);
+        return true;
+    }
+
+    //  找出 deadline 不晚于 now 的调用, 逐个结束并把回调追加到 expired 中.
+    //  now 为 INT64_MAX 时结束所有调用
+    void Expire(int64_t now, std::vector<RpcCallback>* expired)
+    {
+        uint32_t mark = used.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < mark; i++) {
+            uint32_t session = slots[i].state.load(std::memory_order_acquire);
+            if ((0 == session) || (slots[i].deadline.load(std::memory_order_relaxed) > now)) {
+                continue;
+            }
+
+            //  读到的 deadline 可能属于复用后的调用, 这时 CAS 会失败
+            RpcCallback callback;
+            if (Finish(session, &callback)) {
+                expired->push_back(std::move(callback));
+            }
+        }
+    }
+
+    //  正在等待回复的调用数的上限
+    inline uint32_t Size() const
+    {
+        return uint32_t(slots.size());
+    }
+
+private:
+    void Release(uint32_t index)
+    {
+        uint64_t head = idle.load(std::memory_order_relaxed);
+        do {
+            slots[index].next.store(uint32_t(head), std::memory_order_relaxed);
+        } while (!idle.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | index, std::memory_order_acq_rel,
+                                             std::memory_order_relaxed));
+    }
+
+    struct slot_t {
+        std::atomic<uint32_t> state;  //  等待回复时等于 session, 否则为 0
+        std::atomic<uint32_t> next;   //  空闲栈中的下一个槽
+        uint32_t gen;                 //  使用代数, 1~65535, 只由占用槽的线程访问
+        std::atomic<int64_t> deadline;  //  超时时间(steady_clock 纳秒)
+        RpcCallback callback;
+    };
+
+    std::vector<slot_t> slots;
+    std::atomic<uint64_t> idle;   //  空闲栈: 高 32 位是版本号, 低 32 位是栈顶的槽号(等于槽数时为空)
+    std::atomic<uint32_t> used;   //  曾经使用过的最大槽号加一
+};
+
+#endif  // RPCTABLE_H
@@ -0,0 +1,496 @@
+#ifndef SMQCORO_H
+#define SMQCORO_H
+
+//  SMQTransport 的 C++20 协程接口
+//
+//  - CoroTask<T> 是惰性启动的协程, 被 co_await 时才开始执行; CoroSpawn 启动一个不需要等待结果的协程
+//  - CoroMailbox 作为 SMQTransport 的 DISPATCHER, 按来源地址缓存收到的消息, 交给等待 Recv 的协程
+//  - SMQCoro 提供 co_await 的 Send/Recv/Call; 协程在被唤醒的事件循环线程中继续执行
+//  - 协程帧可以从 MessageAllocator(例如 MessageAllocatorPool)中分配, 稳态下不调用 malloc
+//
+//  只在编译器支持协程(-std=c++20)时可用; 按 C++11 编译时本文件不提供任何内容. 用法示例见 WeCoro.cpp(we-coro.pro)
+
+#if defined(__cpp_impl_coroutine) && (__cpp_impl_coroutine >= 201902L)
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "SMQTransport.h"
+
+//  协程帧的分配: 设置了分配器时帧放在消息的 payload 中, 否则使用 operator new.
+//  每个帧前面记录来源, 因此中途更换分配器不影响已经分配的帧; 分配器必须比所有协程帧活得更久
+class CoroFrames
+{
+public:
+    enum : size_t {
+        HEAD = 2 * sizeof(void*) > alignof(std::max_align_t) ? 2 * sizeof(void*) : alignof(std::max_align_t),
+    };
+
+    static void Use(MessageAllocator* alloc)
+    {
+        Allocator() = alloc;
+    }
+
+    static void* Alloc(size_t size)
+    {
+        MessageAllocator* alloc = Allocator();
+        uint8_t* origin = nullptr;
+        uint8_t* frame = nullptr;
+        if (nullptr != alloc) {
+            MESSAGE* msg = alloc->Alloc(int32_t(size + HEAD + alignof(std::max_align_t)));
+            if (nullptr == msg) {
+                throw std::bad_alloc();
+            }
+            origin = (uint8_t*)msg;
+            uintptr_t at = uintptr_t(msg->payload) + HEAD;
+            frame = (uint8_t*)((at + alignof(std::max_align_t) - 1) & ~uintptr_t(alignof(std::max_align_t) - 1));
+        } else {
+            origin = (uint8_t*)::operator new(size + HEAD);
+            frame = origin + HEAD;
+        }
+
+        void** head = (void**)(frame - 2 * sizeof(void*));
+        head[0] = alloc;
+        head[1] = origin;
+        return frame;
+    }
+
+    static void Free(void* frame)
+    {
+        void** head = (void**)((uint8_t*)frame - 2 * sizeof(void*));
+        MessageAllocator* alloc = (MessageAllocator*)head[0];
+        if (nullptr != alloc) {
+            alloc->Free((MESSAGE*)head[1]);
+            return;
+        }
+        ::operator delete(head[1]);
+    }
+
+private:
+    static MessageAllocator*& Allocator()
+    {
+        static MessageAllocator* alloc = nullptr;
+        return alloc;
+    }
+};
+
+template <typename T>
+class CoroTask;
+
+template <typename T>
+struct CoroPromiseBase {
+    std::coroutine_handle<> continuation;  //  等待本协程结束的协程
+    std::exception_ptr error;
+
+    struct final_awaiter_t {
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        template <typename PROMISE>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<PROMISE> h) noexcept
+        {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    final_awaiter_t final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception()
+    {
+        error = std::current_exception();
+    }
+
+    static void* operator new(size_t size)
+    {
+        return CoroFrames::Alloc(size);
+    }
+
+    static void operator delete(void* frame)
+    {
+        CoroFrames::Free(frame);
+    }
+};
+
+template <typename T>
+struct CoroPromise : public CoroPromiseBase<T> {
+    T value;
+
+    CoroTask<T> get_return_object();
+
+    void return_value(T v)
+    {
+        value = std::move(v);
+    }
+
+    T take()
+    {
+        if (this->error) {
+            std::rethrow_exception(this->error);
+        }
+        return std::move(value);
+    }
+};
+
+template <>
+struct CoroPromise<void> : public CoroPromiseBase<void> {
+    CoroTask<void> get_return_object();
+
+    void return_void()
+    {
+    }
+
+    void take()
+    {
+        if (this->error) {
+            std::rethrow_exception(this->error);
+        }
+    }
+};
+
+//  惰性启动的协程: co_await 时开始执行, 结束后唤醒等待者并返回 co_return 的值. T 需要可以默认构造
+template <typename T = void>
+class CoroTask
+{
+public:
+    typedef CoroPromise<T> promise_type;
+
+    explicit CoroTask(std::coroutine_handle<promise_type> h) : handle(h)
+    {
+    }
+
+    CoroTask(CoroTask&& other) noexcept : handle(other.handle)
+    {
+        other.handle = nullptr;
+    }
+
+    CoroTask(const CoroTask&) = delete;
+    CoroTask& operator=(const CoroTask&) = delete;
+
+    ~CoroTask()
+    {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+
+    T await_resume()
+    {
+        return handle.promise().take();
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+inline CoroTask<T> CoroPromise<T>::get_return_object()
+{
+    return CoroTask<T>(std::coroutine_handle<CoroPromise<T>>::from_promise(*this));
+}
+
+inline CoroTask<void> CoroPromise<void>::get_return_object()
+{
+    return CoroTask<void>(std::coroutine_handle<CoroPromise<void>>::from_promise(*this));
+}
+
+//  立即开始执行、结束时自动释放的协程, 只用于 CoroSpawn
+struct CoroDetached {
+    struct promise_type {
+        CoroDetached get_return_object() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+
+        static void* operator new(size_t size)
+        {
+            return CoroFrames::Alloc(size);
+        }
+
+        static void operator delete(void* frame)
+        {
+            CoroFrames::Free(frame);
+        }
+    };
+};
+
+//  在当前线程中开始执行 task, 不等待它结束; task 中未捕获的异常终止进程
+inline CoroDetached CoroSpawn(CoroTask<void> task)
+{
+    co_await std::move(task);
+}
+
+//  按来源地址缓存收到的消息, 作为 SMQTransport 的 DISPATCHER 使用.
+//  来自同一个来源的消息(包括经过转发的消息)总是在该来源所属的事件循环中处理, 所以每个来源的信箱只在一个线程中
+//  访问, 不加锁; 每个信箱记录第一次访问它的线程, 之后在其他线程中访问时断言失败.
+//  没有协程等待的消息一直缓存到被 Recv 取走, 地址超出 count 的消息直接释放
+class CoroMailbox
+{
+public:
+    CoroMailbox(MessageAllocator* alloc, uint32_t count) : allocator(alloc), boxes(count)
+    {
+    }
+
+    ~CoroMailbox()
+    {
+        for (auto& box : boxes) {
+            while (!box.queue.empty()) {
+                allocator->Free(MessageOf((BUFFER*)box.queue.pop_front()));
+            }
+        }
+    }
+
+    virtual int32_t HandleMessage(void* stream, MESSAGE* msg)
+    {
+        uint16_t source = msg->Source();
+        if (source >= boxes.size()) {
+            allocator->Free(msg);
+            return ACTION_NONE;
+        }
+
+        box_t& box = boxes[source];
+        CheckOwner(box);
+        if (!box.waiter) {
+            box.queue.push_back(BufferOf(msg));
+            return ACTION_NONE;
+        }
+
+        std::coroutine_handle<> waiter = box.waiter;
+        box.waiter = nullptr;
+        *(box.slot) = msg;
+        waiter.resume();
+        return ACTION_NONE;
+    }
+
+    //  只能在 source 所属的事件循环中调用: 有缓存的消息时立即唤醒 waiter, 否则等待下一条消息.
+    //  每个来源同时只能有一个协程等待
+    void Wait(uint16_t source, MESSAGE** slot, std::coroutine_handle<> waiter)
+    {
+        Q_ASSERT(source < boxes.size());
+        box_t& box = boxes[source];
+        CheckOwner(box);
+        Q_ASSERT(!box.waiter);
+        if (!box.queue.empty()) {
+            *slot = MessageOf((BUFFER*)box.queue.pop_front());
+            waiter.resume();
+            return;
+        }
+        box.waiter = waiter;
+        box.slot = slot;
+    }
+
+private:
+    struct box_t {
+        NODE queue;                     //  没有被取走的消息(通过 BUFFER 串联)
+        std::coroutine_handle<> waiter;  //  正在等待的协程
+        MESSAGE** slot;                 //  等待的协程接收消息的位置
+        std::thread::id owner;          //  来源所属的事件循环的线程
+
+        box_t() : slot(nullptr)
+        {
+        }
+    };
+
+    static inline void CheckOwner(box_t& box)
+    {
+        std::thread::id self = std::this_thread::get_id();
+        if (std::thread::id() == box.owner) {
+            box.owner = self;
+        }
+        Q_ASSERT(box.owner == self);
+    }
+
+    MessageAllocator* allocator;
+    std::vector<box_t> boxes;
+};
+
+//  co_await SMQCoro::Call 的结果: status 为 RPC_OK 时 reply 是回复消息(归协程所有);
+//  投递失败时 status 为 POST_ERROR/POST_WOULDBLOCK, 请求仍归协程所有
+struct CoroReply {
+    int32_t status;
+    MESSAGE* reply;
+};
+
+//  SMQTransport 的 co_await 接口, TRANSPORT 的 DISPATCHER 必须是 CoroMailbox
+template <typename TRANSPORT>
+class SMQCoro
+{
+public:
+    enum : int32_t {
+        SEND_RETRY_MS = 1,  //  发送队列已满时重试的间隔
+    };
+
+    SMQCoro(TRANSPORT* t, CoroMailbox* m) : transport(t), mailbox(m)
+    {
+    }
+
+    //  co_await 的结果同 Post, 但发送队列已满时不返回 POST_WOULDBLOCK, 而是挂起协程,
+    //  在目的地址所属的事件循环中每 SEND_RETRY_MS 重试, 投递后在该事件循环中继续执行
+    struct send_t {
+        SMQCoro* coro;
+        MESSAGE* msg;
+        uint16_t target;
+        int ret;
+        std::coroutine_handle<> waiter;
+        TIMER retry;
+
+        bool await_ready()
+        {
+            ret = coro->transport->Post(msg);
+            return (POST_WOULDBLOCK != ret);
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            waiter = h;
+            retry.callback = [this]() { Retry(); };
+            coro->transport->Execute(target, [this]() { Retry(); });
+        }
+
+        int await_resume() const noexcept
+        {
+            return ret;
+        }
+
+        void Retry()
+        {
+            ret = coro->transport->Post(msg);
+            if (POST_WOULDBLOCK == ret) {
+                coro->transport->StartTimer(target, &retry, SEND_RETRY_MS);
+                return;
+            }
+            waiter.resume();
+        }
+    };
+
+    send_t Send(MESSAGE* msg)
+    {
+        return send_t{this, msg, msg->Target(), POST_OK, nullptr, TIMER()};
+    }
+
+    //  co_await 的结果是来自 source 的下一条消息(归协程所有), 协程在 source 所属的事件循环中继续执行
+    struct recv_t {
+        SMQCoro* coro;
+        uint16_t source;
+        MESSAGE* msg;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            recv_t* self = this;
+            coro->transport->Execute(source, [self, h]() { self->coro->mailbox->Wait(self->source, &(self->msg), h); });
+        }
+
+        MESSAGE* await_resume() const noexcept
+        {
+            return msg;
+        }
+    };
+
+    recv_t Recv(uint16_t source)
+    {
+        return recv_t{this, source, nullptr};
+    }
+
+    //  RPC 调用(见 SMQTransport::Call), co_await 的结果见 CoroReply.
+    //  收到回复时在收到回复的事件循环中继续执行, 超时时在第一个事件循环中继续执行
+    struct call_t {
+        SMQCoro* coro;
+        MESSAGE* req;
+        int32_t timeoutMs;
+        CoroReply result;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            call_t* self = this;
+            int ret = coro->transport->Call(req, timeoutMs, [self, h](int32_t status, MESSAGE* reply) {
+                self->result.status = status;
+                self->result.reply = reply;
+                h.resume();
+            });
+            //  投递成功后回调可能已经在其他线程中唤醒了协程, 不能再访问 this
+            if (POST_OK == ret) {
+                return true;
+            }
+            result.status = ret;
+            result.reply = nullptr;
+            return false;
+        }
+
+        CoroReply await_resume() const noexcept
+        {
+            return result;
+        }
+    };
+
+    call_t Call(MESSAGE* req, int32_t timeoutMs)
+    {
+        return call_t{this, req, timeoutMs, CoroReply{RPC_OK, nullptr}};
+    }
+
+private:
+    TRANSPORT* transport;
+    CoroMailbox* mailbox;
+};
+
+#endif  // __cpp_impl_coroutine
+
+#endif  // SMQCORO_H
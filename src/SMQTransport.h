@@ -4,13 +4,35 @@
 #define BOOST_ASIO_NO_DEPRECATED
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <future>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 using namespace boost;
 
 #include "MESSAGE.h"
+#include "LzCodec.h"
+#include "MpscQueue.h"
+#include "PagedTable.h"
+#include "RpcTable.h"
+#include "SeqCounter.h"
+#include "TimerWheel.h"
+#include "Trace.h"
+#include "UringQueue.h"
+#include "ShmRing.h"
 
 enum EndpointType {
     TYPE_CLIENT = 0,  //
@@ -51,14 +73,63 @@ enum : int32_t {
     ACTION_DISCONNECT,  //  执行断链
     ACTION_RECONNECT,   //  执行重连
     ACTION_REFUSE,      //  不接受新连接
+    ACTION_MIGRATE,     //  流需要先迁移到通道所属的事件循环, 迁移后重新处理当前消息
 };
 
+//  Post/PostWait 的返回值
+enum : int32_t {
+    POST_OK = 0,
+    POST_ERROR = -1,       //  目的地址非法
+    POST_WOULDBLOCK = -2,  //  通道发送队列已满(或等待超时), 消息仍归调用者所有
+};
+
+//  通道计数器
+enum {
+    CHAN_MSGS_OUT,      //  从发送队列中取出并交给流(或者共享内存环)的消息数
+    CHAN_BYTES_OUT,     //  同上, 字节数
+    CHAN_MSGS_IN,       //  收到的消息数
+    CHAN_BYTES_IN,      //  收到的字节数
+    CHAN_QUEUE_DEPTH,   //  发送队列当前长度
+    CHAN_QUEUE_HIGH,    //  发送队列长度的最高水位
+    CHAN_QUEUE_BYTES,   //  已投递但还没有交给流(或者共享内存环)的字节数
+    CHAN_COUNTER_MAX,
+};
+
+//  流计数器
+enum {
+    STREAM_TARGET,           //  流的目的地址(认证之前为 ADDRESS_INVALID)
+    STREAM_STATUS,           //  当前状态
+    STREAM_BYTES_OUT,        //  写出的字节数
+    STREAM_WRITES,           //  完成的写操作次数
+    STREAM_WRITE_NANOS,      //  写操作从发起到完成的总耗时(纳秒)
+    STREAM_WRITE_MAX_NANOS,  //  单次写操作的最长耗时(纳秒)
+    STREAM_BYTES_IN,         //  读入的字节数
+    STREAM_READS,            //  完成的读操作次数
+    STREAM_RECONNECTS,       //  重连次数
+    STREAM_ALLOC_FAILURES,   //  接收消息时分配失败的次数
+    STREAM_HEARTBEATS,       //  发送的心跳次数
+    STREAM_PEER_TIMEOUTS,    //  对端长时间没有数据被判定失效的次数
+    STREAM_ROUTED,           //  收到后直接转发给下一跳的消息数
+    STREAM_ROUTE_DROPS,      //  收到后无法转发而丢弃的消息数
+    STREAM_COUNTER_MAX,
+};
+
+struct SMQChanStats {
+    uint16_t target;
+    uint64_t counters[CHAN_COUNTER_MAX];
+};
+
+struct SMQStreamStats {
+    const void* stream;
+    uint64_t counters[STREAM_COUNTER_MAX];
+};
 
 struct SMQStream {
     virtual void update_status(uint16_t mask, uint16_t val) = 0;
     virtual uint16_t current_status(uint16_t mask) const = 0;
     virtual uint16_t get_attr(uint16_t mask) const = 0;
     virtual uint16_t get_target() const = 0;
+    virtual uint16_t get_stripe() const = 0;
     virtual void try_reconnect() = 0;
     virtual void disconnect() = 0;
 };
@@ -79,6 +150,34 @@ static inline asio::ip::tcp::endpoint addr_of(const std::string& str)
     return asio::ip::tcp::endpoint(asio::ip::make_address(host), port);
 }
 
+//  解析 "host:port" 格式的地址, host 可以是域名, 没有端口时使用 9090
+//  解析 "host:port"(没有端口时为 9090), 地址非法或者无法解析时在 ec 中返回错误, 不抛出异常
+static inline asio::ip::tcp::resolver::results_type resolve_of(asio::io_context& context, const std::string& str,
+                                                               system::error_code& ec)
+{
+    std::string host = str;
+    std::string port = "9090";
+    size_t pos = str.find_last_of(":");
+    if (std::string::npos != pos) {
+        host = str.substr(0, pos);
+        port = str.substr(pos + 1);
+    }
+
+    asio::ip::tcp::resolver resolver(context);
+    return resolver.resolve(host, port, ec);
+}
+
+//  DISPATCHER 可以选择实现 void HandleWatermark(uint16_t target, bool high), 没有实现时不通知
+template <typename T>
+struct HasHandleWatermark {
+    template <typename U>
+    static auto check(U* u) -> decltype(u->HandleWatermark(uint16_t(0), true), std::true_type());
+    template <typename U>
+    static std::false_type check(...);
+
+    enum { value = decltype(check<T>(nullptr))::value };
+};
+
 static inline std::string str_of(const asio::ip::tcp::endpoint& ep)
 {
     char buf[10] = {0};
@@ -93,18 +192,35 @@ protected:
     enum {
         CONNAUTH = 1,
         CONNAUTHACK = 2,
+        CONNSHM = 3,      //  对端在本机时, 发起方请求建立共享内存通道
+        CONNSHMACK = 4,   //  共享内存通道建立结果
+        CONNSHMKICK = 5,  //  共享内存环中有新消息, 或者释放出了空间
+        CONNPING = 6,     //  心跳: 一段时间没有收到对端的数据时发送
+        CONNPONG = 7,     //  心跳应答, 总是立即回复
     };
     struct CONNHEAD {
         uint16_t code;  //  type & length
     };
     struct CONNAUTHMsg : public CONNHEAD {
         uint16_t source;
+        uint16_t stripe;  //  发起方在通道中的第几个流(见 SetStripes), 0 是第一个流
     };
 
     struct CONNAUTHACKMsg : public CONNHEAD {
         uint16_t source;
     };
 
+    struct CONNSHMMsg : public CONNHEAD {
+        uint16_t source;
+        int32_t slots;  //  每个方向的环的槽数
+        char name[48];  //  共享内存的名字
+    };
+
+    struct CONNSHMACKMsg : public CONNHEAD {
+        uint16_t source;
+        int32_t status;  //  0 表示对端已经映射了共享内存
+    };
+
     void PostAuth(void* s)
     {
         SMQStream* stream = (SMQStream*)s;
@@ -114,6 +230,7 @@ protected:
         CONNAUTHMsg* auth = PayloadOf<CONNAUTHMsg*>(msg);
         auth->code = CONNAUTH;
         auth->source = source;
+        auth->stripe = stream->get_stripe();
         msg->TotalLength(sizeof(MESSAGE) + sizeof(CONNAUTHMsg));
         msg->Type(MESSAGE::TYPE_CONN);
 
@@ -140,6 +257,57 @@ protected:
         ((TRANSPORT*)this)->async_write(stream, msg);
     }
 
+    void PostShm(void* s, int32_t slots, const std::string& name)
+    {
+        MESSAGE* msg = allocator->Alloc(sizeof(CONNSHMMsg));
+        Q_ASSERT(nullptr != msg);
+        CONNSHMMsg* req = PayloadOf<CONNSHMMsg*>(msg);
+        std::memset(req, 0, sizeof(CONNSHMMsg));
+        req->code = CONNSHM;
+        req->source = source;
+        req->slots = slots;
+        std::strncpy(req->name, name.c_str(), sizeof(req->name) - 1);
+        msg->PayloadLength(sizeof(CONNSHMMsg));
+        msg->Type(MESSAGE::TYPE_CONN);
+        ((TRANSPORT*)this)->async_write(s, msg);
+    }
+
+    void PostShmAck(void* s, int32_t status)
+    {
+        MESSAGE* msg = allocator->Alloc(sizeof(CONNSHMACKMsg));
+        Q_ASSERT(nullptr != msg);
+        CONNSHMACKMsg* ack = PayloadOf<CONNSHMACKMsg*>(msg);
+        ack->code = CONNSHMACK;
+        ack->source = source;
+        ack->status = status;
+        msg->PayloadLength(sizeof(CONNSHMACKMsg));
+        msg->Type(MESSAGE::TYPE_CONN);
+        ((TRANSPORT*)this)->async_write(s, msg);
+    }
+
+    void PostShmKick(void* s)
+    {
+        MESSAGE* msg = allocator->Alloc(sizeof(CONNHEAD));
+        Q_ASSERT(nullptr != msg);
+        CONNHEAD* kick = PayloadOf<CONNHEAD*>(msg);
+        kick->code = CONNSHMKICK;
+        msg->PayloadLength(sizeof(CONNHEAD));
+        msg->Type(MESSAGE::TYPE_CONN);
+        ((TRANSPORT*)this)->async_write(s, msg);
+    }
+
+    //  code 为 CONNPING 或者 CONNPONG
+    void PostHeartbeat(void* s, uint16_t code)
+    {
+        MESSAGE* msg = allocator->Alloc(sizeof(CONNHEAD));
+        Q_ASSERT(nullptr != msg);
+        CONNHEAD* head = PayloadOf<CONNHEAD*>(msg);
+        head->code = code;
+        msg->PayloadLength(sizeof(CONNHEAD));
+        msg->Type(MESSAGE::TYPE_CONN);
+        ((TRANSPORT*)this)->async_write(s, msg);
+    }
+
     int32_t HandleConnMessage(void* s, MESSAGE* msg)
     {
         SMQStream* stream = (SMQStream*)s;
@@ -148,10 +316,16 @@ protected:
         switch (head->code) {
             case CONNAUTH: {
                 //                ((TRANSPORT*)this)->debug(stream, "Receive Auth");
-                Q_ASSERT(msg->TotalLength() >= (sizeof(MESSAGE) + sizeof(CONNAUTHMsg)));
+                Q_ASSERT(msg->TotalLength() >= (sizeof(MESSAGE) + sizeof(CONNHEAD) + sizeof(uint16_t)));
                 CONNAUTHMsg* req = PayloadOf<CONNAUTHMsg*>(msg);
                 Q_ASSERT(MESSAGE::ADDRESS_INVALID != req->source);
-                int ret = ((TRANSPORT*)this)->BindStreamChan(stream, req->source);
+                if (!((TRANSPORT*)this)->CheckHomeLoop(stream, req->source)) {
+                    return ACTION_MIGRATE;
+                }
+
+                //  不支持多个流的对端发送的认证消息中没有 stripe
+                uint16_t stripe = (msg->TotalLength() >= (sizeof(MESSAGE) + sizeof(CONNAUTHMsg))) ? req->stripe : 0;
+                int ret = ((TRANSPORT*)this)->BindStreamChan(stream, req->source, stripe);
                 if (0 != ret) {
                     // stream->disconnect();
                     return ACTION_DISCONNECT;
@@ -166,13 +340,50 @@ protected:
                 Q_ASSERT(msg->TotalLength() >= (sizeof(MESSAGE) + sizeof(CONNAUTHACKMsg)));
                 CONNAUTHACKMsg* ack = PayloadOf<CONNAUTHACKMsg*>(msg);
                 Q_ASSERT(MESSAGE::ADDRESS_INVALID != ack->source);
-                int ret = ((TRANSPORT*)this)->BindStreamChan(stream, ack->source);
+                if (!((TRANSPORT*)this)->CheckHomeLoop(stream, ack->source)) {
+                    return ACTION_MIGRATE;
+                }
+
+                int ret = ((TRANSPORT*)this)->BindStreamChan(stream, ack->source, stream->get_stripe());
                 if (0 != ret) {
                     // stream->disconnect();
                     return ACTION_DISCONNECT;
                 }
 
                 stream->update_status(STATUS_PROTOCOL_MASK, STATUS_PROTOCOL_READY);
+
+                //  认证完成之前投递的消息已经在通道发送队列中等待
+                ((TRANSPORT*)this)->async_write(stream, nullptr);
+
+                //  对端在本机时尝试建立共享内存通道
+                ((TRANSPORT*)this)->OfferShm(stream);
+                return ACTION_NONE;
+            } break;
+            case CONNSHM: {
+                Q_ASSERT(msg->TotalLength() >= (sizeof(MESSAGE) + sizeof(CONNSHMMsg)));
+                CONNSHMMsg* req = PayloadOf<CONNSHMMsg*>(msg);
+                req->name[sizeof(req->name) - 1] = '\0';
+                int32_t status = ((TRANSPORT*)this)->AcceptShm(stream, req->name, req->slots);
+                PostShmAck(stream, status);
+                ((TRANSPORT*)this)->EnableShm(stream, status);
+                return ACTION_NONE;
+            } break;
+            case CONNSHMACK: {
+                Q_ASSERT(msg->TotalLength() >= (sizeof(MESSAGE) + sizeof(CONNSHMACKMsg)));
+                CONNSHMACKMsg* ack = PayloadOf<CONNSHMACKMsg*>(msg);
+                ((TRANSPORT*)this)->EnableShm(stream, ack->status);
+                return ACTION_NONE;
+            } break;
+            case CONNSHMKICK: {
+                ((TRANSPORT*)this)->HandleShmKick(stream);
+                return ACTION_NONE;
+            } break;
+            case CONNPING: {
+                PostHeartbeat(stream, CONNPONG);
+                return ACTION_NONE;
+            } break;
+            case CONNPONG: {
+                //  收到数据本身就说明对端还在
                 return ACTION_NONE;
             } break;
             default: {
@@ -182,6 +393,42 @@ protected:
         }
     }
 
+    //  解压收到的消息: 返回解压后的新消息(原消息已释放), 失败时丢弃消息并返回空.
+    //  解压后的长度由对端给出, 超过接收长度限制(见 SMQTransport::SetMaxMessage)或者超过压缩格式
+    //  可能的最大解压长度时不分配, 直接丢弃
+    MESSAGE* Inflate(SMQStream* stream, MESSAGE* msg)
+    {
+        uint32_t length = 0;
+        MESSAGE* out = nullptr;
+        if (msg->PayloadLength() >= int32_t(sizeof(length))) {
+            std::memcpy(&length, msg->payload, sizeof(length));
+            uint64_t packed = uint64_t(msg->PayloadLength()) - sizeof(length);
+            uint64_t limit = uint64_t(((TRANSPORT*)this)->GetMaxMessage());
+            if ((uint64_t(length) + sizeof(MESSAGE) <= limit) && (uint64_t(length) <= packed * LzCodec::EXPAND_MAX)) {
+                out = allocator->Alloc(int32_t(length));
+            }
+        }
+
+        if ((nullptr == out) ||
+            (int32_t(length) != LzCodec::Decompress(msg->payload + sizeof(length), msg->PayloadLength() - sizeof(length),
+                                                    out->payload, int32_t(length)))) {
+            TRACE_ERROR(TRACE_INFLATE_FAILED, stream, (nullptr != stream) ? stream->get_target() : MESSAGE::ADDRESS_INVALID,
+                        msg->PayloadLength());
+            if (nullptr != out) {
+                allocator->Free(out);
+            }
+            allocator->Free(msg);
+            return nullptr;
+        }
+
+        out->Type(msg->Type());
+        out->Flags(msg->Flags() & ~MESSAGE::FLAGS_COMPRESSED);
+        out->session = msg->session;
+        out->PayloadLength(length);
+        allocator->Free(msg);
+        return out;
+    }
+
     int Init(uint16_t selfid, DISPATCHER* disp, ALLOCATOR* alloc)
     {
         source = selfid;
@@ -192,7 +439,7 @@ protected:
 
     virtual int32_t HandleEvent(void* s, uint16_t event, uintptr_t param1, uintptr_t param2)
     {
-        std::printf("HandleEvent: event=%d, [%llu, %llu]\n", event, param1, param2);
+        TRACE_INFO(TRACE_EVENT, s, event, param1, param2);
         SMQStream* stream = (SMQStream*)s;
         if (EVENT_CONN_INITED == event) {
             stream->update_status(STATUS_PROTOCOL_MASK, STATUS_PROTOCOL_IDLE);
@@ -213,7 +460,7 @@ protected:
                 stream->update_status(STATUS_PROTOCOL_MASK, STATUS_PROTOCOL_IDLE);
                 if (ATTR_STREAM_TYPE_ACTIVATE == stream->get_attr(ATTR_STREAM_TYPE_MASK)) {
                     // stream->try_reconnect();
-                    std::printf("Disconnected, try reconnect\n");
+                    TRACE_INFO(TRACE_RECONNECT, s);
                     return ACTION_RECONNECT;
                 } else {
                     // stream->disconnect();
@@ -230,12 +477,22 @@ protected:
     {
         SMQStream* stream = (SMQStream*)(s);
         switch (msg->Type()) {
-            case MESSAGE::TYPE_CONN:
-                return HandleConnMessage(stream, msg);
-            case MESSAGE::TYPE_USER:
-                msg->Source(stream->get_target());
-                msg->Target(source);
-                return dispatcher->HandleMessage(stream, msg);
+            case MESSAGE::TYPE_CONN: {
+                int32_t action = HandleConnMessage(stream, msg);
+                if (ACTION_MIGRATE != action) {
+                    allocator->Free(msg);
+                }
+                return action;
+            }
+            case MESSAGE::TYPE_USER: {
+                //  经过转发的消息: 不是发给本节点的由传输层直接转给下一跳, 否则去掉路由尾部, 得到原始的源地址
+                //  (原始的源地址属于另一个事件循环时由传输层转到那里处理)
+                uint16_t from = stream->get_target();
+                if ((0 != (msg->Flags() & MESSAGE::FLAGS_ROUTED)) && !((TRANSPORT*)this)->Unroute(stream, msg, &from)) {
+                    return ACTION_NONE;
+                }
+                return HandleUser(stream, msg, from);
+            }
             default:
                 //  未被处理时,直接释放掉
                 Q_ASSERT(false);
@@ -245,6 +502,24 @@ protected:
     }
 
 protected:
+    //  把来自 from 的用户消息交给 DISPATCHER(RPC 回复交给发起调用的回调), 在 from 所属的事件循环中调用.
+    //  stream 是本事件循环中的流; 经过转发的消息转到其他事件循环处理时是 from 的通道的流, 没有时为空
+    int32_t HandleUser(SMQStream* stream, MESSAGE* msg, uint16_t from)
+    {
+        if (0 != (msg->Flags() & MESSAGE::FLAGS_COMPRESSED)) {
+            msg = Inflate(stream, msg);
+            if (nullptr == msg) {
+                return ACTION_NONE;
+            }
+        }
+        msg->Source(from);
+        msg->Target(source);
+        if (0 != (msg->Flags() & MESSAGE::FLAGS_REPLY)) {
+            return ((TRANSPORT*)this)->HandleReply(stream, msg);
+        }
+        return dispatcher->HandleMessage(stream, msg);
+    }
+
     uint16_t source;
     DISPATCHER* dispatcher;
     ALLOCATOR* allocator;
@@ -255,42 +530,197 @@ template <typename DISPATCHER, typename ALLOCATOR>
 class SMQTransport : public SMQProtocol<SMQTransport<DISPATCHER, ALLOCATOR>, DISPATCHER, ALLOCATOR>
 {
 private:
+    //  事件循环: 每个事件循环独占一个 io_context 和一个线程.
+    //  通道按目的地址固定归属于某个事件循环, 流在认证完成后迁移到其通道所属的事件循环,
+    //  因此同一个流/通道的所有状态只会在一个线程中被访问
+    struct loop_t {
+        asio::io_context context;
+        asio::executor_work_guard<asio::io_context::executor_type> work;
+        std::thread thread;
+        int32_t index;                     //  事件循环编号
+        int32_t core;                      //  绑定的CPU核, 小于0表示不绑定
+        MpscQueue qsubmit;                 //  其他线程提交给本事件循环的消息
+        NODE kicks;                        //  提交的消息处理完后需要重启写操作的通道
+        std::atomic<uint64_t> wakeups;     //  为处理提交队列唤醒事件循环的次数
+        TimerWheel wheel;                  //  本事件循环的所有定时器, tick 为 1 毫秒
+        asio::deadline_timer ticker;       //  在时间轮下一次需要推进时唤醒事件循环
+        uint64_t tickAt;                   //  ticker 等待到的 tick, UINT64_MAX 表示没有等待
+        UringQueue* uring;                 //  IO_URING 时本事件循环的 io_uring, 第一次收发时创建
+        asio::posix::stream_descriptor* unotify;  //  uring 产生完成事件时可读的 eventfd
+        bool uflush;                       //  是否已经安排了提交 uring 中准备好的请求
+        bool ufailed;                      //  创建 uring 失败, 本事件循环仍然使用 asio 收发
+        std::atomic<bool> spinning;        //  正在忙轮询, 会自己检查提交队列, 提交消息后不需要唤醒
+
+        loop_t(int32_t index, int32_t core)
+            : work(asio::make_work_guard(context)), index(index), core(core), wheel(NowMillis()), ticker(context),
+              tickAt(UINT64_MAX), uring(nullptr), unotify(nullptr), uflush(false), ufailed(false)
+        {
+            wakeups = 0;
+            spinning = false;
+        }
+
+        ~loop_t()
+        {
+            delete unotify;
+            delete uring;
+        }
+    };
+
+    //  大消息的分片: TYPE_FRAG 消息的 payload 是 FRAGHEAD, 之后是原消息(含消息头)从 offset 开始的一段.
+    //  发送方每个优先级占一个 slot, 流自己的大消息队列(wlarge)另占一个, 同一个 slot 中的分片按顺序发送,
+    //  不同 slot 的分片可以交错; 接收方每个 slot 重组一个消息
+    struct FRAGHEAD {
+        uint32_t total;   //  原消息的总长度
+        uint32_t offset;  //  本分片在原消息中的偏移
+        uint8_t slot;
+        uint8_t reserved[3];
+    };
+
+    enum : int32_t {
+        FRAG_SLOT_LARGE = MESSAGE::PRIORITY_COUNT,  //  wlarge 中的大消息使用的 slot
+        FRAG_SLOTS = MESSAGE::PRIORITY_COUNT + 1,
+        FRAG_HEAD = sizeof(MESSAGE) + sizeof(FRAGHEAD),
+        STRIPES_MAX = 8,  //  每个通道最多的流数
+    };
+
+    //  路由尾部: 发往不直接连接的目的地址的消息在 payload(压缩时是压缩后的 payload)之后追加, 并设置 FLAGS_ROUTED.
+    //  放在尾部而不是头部, 追加和去掉时都不需要移动 payload, 中间节点原地修改 hops 后转发
+    struct ROUTETAIL {
+        uint16_t source;  //  原始的源地址
+        uint16_t target;  //  最终的目的地址
+        uint8_t hops;     //  还可以转发的次数, 用完时丢弃, 防止路由配置错误形成环路
+        uint8_t prio;     //  发送优先级, 中间节点按它排队
+        uint8_t reserved[2];
+    };
+
+    enum : int32_t {
+        ROUTE_TAIL = sizeof(ROUTETAIL),
+        ROUTE_HOPS_MAX = 16,
+    };
+
     struct chan_t;
     struct stream_t : public NODE, public SMQStream {
         asio::ip::tcp::socket socket;
         SMQTransport* transport;
+        loop_t* loop;     //  流当前所在的事件循环
+        loop_t* rehome;   //  流需要迁移到的事件循环
+        MESSAGE* rpend;   //  迁移完成后需要重新处理的消息
         chan_t* chan;     //  绑定到哪个通道
-        BUFFER* wcur;     //  当前正在发送的消息(当wcur为null时,表示需要重启)
-        MESSAGE* rcur;    //  当前还未收取完成的消息
-        MESSAGE rbuf;     //  消息头缓冲区
-        int8_t rhead;     //  是否正在读取消息头
+        NODE wctrl;       //  待发送的协议消息(认证等), 优先于通道发送队列
+        NODE wlarge;      //  共享内存通道放不下的通道消息, 通过流发送
+        NODE wsent;       //  当前正在发送的一批消息
+        std::vector<asio::const_buffer> wbufs;  //  当前正在发送的一批消息的缓冲区列表
+        uint8_t* rring;   //  接收缓冲区, 一次读取尽可能多的数据, 从中解析出所有完整的消息
+        int32_t rsize;    //  接收缓冲区大小
+        int32_t rbegin;   //  接收缓冲区中未解析数据的起始位置
+        int32_t rend;     //  接收缓冲区中未解析数据的结束位置
+        MESSAGE* rcur;    //  超出接收缓冲区大小的消息, 剩余部分直接读入该消息
+        int32_t rcurLen;  //  rcur 已经收取的字节数
+        MESSAGE* rfrag[FRAG_SLOTS];      //  正在重组的大消息
+        int32_t rfragTotal[FRAG_SLOTS];  //  rfrag 的总长度
+        int32_t rfragNext[FRAG_SLOTS];   //  rfrag 下一个分片的偏移
+        uint8_t* rdst;    //  超出接收缓冲区大小的分片, 剩余数据直接读入重组的消息
+        int32_t rdstLen;  //  rdst 还需要收取的字节数
+        int32_t rslot;    //  最近一个分片的 slot
+        uint64_t conn;    //  连接编号, 每次建立连接时重新分配; 分片的发送进度只对同一个连接有效
+        int32_t wfrag;    //  wlarge 队首的大消息已经发送的字节数
         uint8_t wloss;    //  是否处于写丢失状态
         uint16_t attr;    //  属性
         uint16_t target;  //  流的目的地址
         uint16_t status;  //  当前状态
+        uint16_t stripe;  //  在通道中的第几个流: 发起方创建时指定, 接收方从认证消息中得到
         std::string targetAddr;
-        asio::deadline_timer* timer;
+        TIMER retry;      //  连接失败后定时重连
+        TIMER heartbeat;  //  认证完成后定时检查对端是否还在
+        uint32_t ridle;   //  连续多少次心跳检查期间没有读到数据
         int32_t action;
-
-        stream_t(SMQTransport* t, asio::ip::tcp::socket sock, const std::string& addr, uint16_t attr = 0)
+        uint64_t wstart;  //  当前写操作的发起时间
+        uint32_t uread;   //  io_uring 上还没有完成的读操作数, 大于 1 时较早的是重新连接之前发起的
+        uint8_t* ubuf;    //  io_uring 读操作的缓冲区
+        int32_t ulen;     //  ubuf 的大小
+        int32_t ugot;     //  读满 ubuf 时已经读到的字节数
+        bool uall;        //  是否需要读满 ubuf(对应 asio::async_read), 否则读到一些就完成
+        std::vector<struct iovec> uiov;  //  io_uring 写操作的缓冲区列表, 与 wbufs 对应
+        struct msghdr umsg;              //  io_uring 写操作, 部分写出后指向剩余的部分
+        size_t usent;                    //  io_uring 写操作已经写出的字节数
+        SeqCounter<STREAM_COUNTER_MAX> stats;
+
+        stream_t(SMQTransport* t, loop_t* l, asio::ip::tcp::socket sock, const std::string& addr, uint16_t attr = 0)
             : socket(std::move(sock)), attr(attr)
         {
             transport = t;
+            loop = l;
+            rehome = nullptr;
+            rpend = nullptr;
             chan = nullptr;
+            rsize = t->readBytes;
+            rring = (uint8_t*)malloc(rsize);
+            Q_ASSERT(nullptr != rring);
+            rbegin = 0;
+            rend = 0;
             rcur = nullptr;
-            wcur = nullptr;
+            rcurLen = 0;
+            for (int32_t i = 0; i < FRAG_SLOTS; i++) {
+                rfrag[i] = nullptr;
+                rfragTotal[i] = 0;
+                rfragNext[i] = 0;
+            }
+            rdst = nullptr;
+            rdstLen = 0;
+            rslot = 0;
+            conn = ++(t->connSeq);
+            wfrag = 0;
             target = MESSAGE::ADDRESS_INVALID;
             status = STATUS_CONN_IDLE;
-            rhead = true;
+            stripe = 0;
             wloss = true;
             targetAddr = addr;
-            timer = nullptr;
+            retry.callback = [this]() {
+                TRACE_INFO(TRACE_CONNECT_RETRY, this);
+                transport->async_connect(this);
+            };
+            heartbeat.callback = [this]() { transport->CheckHeartbeat(this); };
+            ridle = 0;
             action = ACTION_NONE;
+            wstart = 0;
+            uread = 0;
+            ubuf = nullptr;
+            ulen = 0;
+            ugot = 0;
+            uall = false;
+            std::memset(&umsg, 0, sizeof(umsg));
+            usent = 0;
+            {
+                SeqCounter<STREAM_COUNTER_MAX>::Update u(stats);
+                u.Set(STREAM_TARGET, target);
+                u.Set(STREAM_STATUS, status);
+            }
+            transport->AddStream(this);
+        }
+
+        ~stream_t()
+        {
+            transport->RemoveStream(this);
+            if (nullptr != rcur) {
+                transport->allocator->Free(rcur);
+            }
+            if (nullptr != rpend) {
+                transport->allocator->Free(rpend);
+            }
+            for (int32_t i = 0; i < FRAG_SLOTS; i++) {
+                if (nullptr != rfrag[i]) {
+                    transport->allocator->Free(rfrag[i]);
+                }
+            }
+            free(rring);
         }
 
         virtual void update_status(uint16_t mask, uint16_t val) override
         {
             status = (status & ~mask) | (val & mask);
+
+            SeqCounter<STREAM_COUNTER_MAX>::Update u(stats);
+            u.Set(STREAM_STATUS, status);
         }
 
         virtual uint16_t current_status(uint16_t mask) const override
@@ -308,6 +738,11 @@ private:
             return target;
         }
 
+        virtual uint16_t get_stripe() const
+        {
+            return stripe;
+        }
+
         virtual void try_reconnect()
         {
             action = ACTION_RECONNECT;
@@ -319,15 +754,99 @@ private:
         }
     };
 
+    //  共享内存通道: 两个方向各一个环, 映射一旦建立就不再解除,
+    //  因为接收方可能仍然持有环中的消息
+    struct shm_t {
+        ShmRing::Region region;
+        ShmRing tx;        //  本端发送的环
+        ShmRing rx;        //  本端接收的环
+        std::string name;  //  共享内存的名字(由发起方创建)
+    };
+
+    //  发送队列的容量: qmsgs/qbytes 在 Post 时(任意线程)原子地增加, 消息从发送队列交给流或者共享内存环时减少,
+    //  因此还在提交队列中的消息也计算在内. 其余字段只在通道所属的事件循环中访问(上限除外).
+    //  发送队列按消息的优先级分为多个子队列, 取消息的顺序见 NextSend
     struct chan_t : public NODE {
-        stream_t* stream;
-        NODE qsend;    //  发送队列
-        int32_t size;  //  发送队列长度
+        uint16_t target;  //  通道的目的地址
+        stream_t* stream;  //  第一个流, 共享内存通道的通知以及 STRIPE_ORDERED 时发送队列中的消息都通过它发送
+        stream_t* stripes[STRIPES_MAX - 1];  //  其他已经认证的流, 见 SetStripes
+        int32_t nstripes;  //  stripes 中的流数, 不为 0 时 stream 一定不为空
+        NODE qsend[MESSAGE::PRIORITY_COUNT];     //  每个优先级一个发送队列
+        int32_t deficit[MESSAGE::PRIORITY_COUNT];  //  按权重轮转的队列本轮还可以发送的字节数
+        int32_t drr;      //  按权重轮转当前轮到的队列
+        int32_t credited;  //  drr 本轮是否已经加过配额
+        int32_t fsent[MESSAGE::PRIORITY_COUNT];   //  队首的大消息已经发送的字节数
+        uint64_t fconn[MESSAGE::PRIORITY_COUNT];  //  fsent 所属的连接编号
+        int32_t size;     //  发送队列长度(所有优先级)
+        int32_t qmsgs;    //  已投递还没有交给流的消息数
+        int64_t qbytes;   //  已投递还没有交给流的字节数
+        int32_t maxMsgs;  //  qmsgs 的上限, 0 表示不限制
+        int64_t maxBytes;   //  qbytes 的上限, 0 表示不限制
+        int64_t highBytes;  //  qbytes 达到高水位时通知 DISPATCHER, 0 表示不通知
+        int64_t lowBytes;   //  超过高水位后回落到低水位时再次通知
+        int32_t above;      //  是否处于高水位之上
+        int32_t waiters;    //  在 PostWait 中等待该通道的线程数
+        int32_t zmin;       //  payload 不小于该长度的用户消息在投递时压缩, 0 表示不压缩
+        int32_t zratio;     //  压缩后不超过原长度的该百分比才使用压缩结果
+        int32_t zavg;       //  最近压缩率(百分比)的滑动平均, 任意线程更新, 不要求精确
+        int32_t zprobe;     //  滑动平均超过 zratio 时只抽样压缩, 用于发现数据重新变得可压缩
+        shm_t* shm;       //  共享内存通道
+        ShmRing* shmtx;   //  共享内存通道建立后用于发送的环, 为空时通过 stream 发送
+        int32_t shmbusy;  //  发送队列中有等待拷贝进环的消息, 此时业务线程不直接在环中预留
+        int32_t shmusers;  //  正在读取 shmtx 并在环中预留的业务线程数, 不为 0 时不能解除映射
+        std::vector<shm_t*> shmRetired;  //  已经断开、环中的消息还可能被引用着的共享内存通道
+        TIMER shmSweep;                  //  定时检查 shmRetired, 不再被引用的解除映射
+        SeqCounter<CHAN_COUNTER_MAX> stats;
 
         chan_t()
         {
+            target = MESSAGE::ADDRESS_INVALID;
             stream = nullptr;
+            nstripes = 0;
+            for (int32_t i = 0; i < MESSAGE::PRIORITY_COUNT; i++) {
+                deficit[i] = 0;
+                fsent[i] = 0;
+                fconn[i] = 0;
+            }
+            drr = 0;
+            credited = 0;
             size = 0;
+            qmsgs = 0;
+            qbytes = 0;
+            maxMsgs = 0;
+            maxBytes = 0;
+            highBytes = 0;
+            lowBytes = 0;
+            above = 0;
+            waiters = 0;
+            zmin = 0;
+            zratio = ZRATIO_DEF;
+            zavg = 0;
+            zprobe = 0;
+            shm = nullptr;
+            shmtx = nullptr;
+            shmbusy = 0;
+            shmusers = 0;
+        }
+    };
+
+    //  组播: 一个共享的消息被多个通道引用. 每个通道的发送队列中放的是一个很小的引用节点
+    //  (owner 为 mcastOwner, payload 中是 mcast_t*), 发送时写的是共享的消息;
+    //  引用节点按普通消息释放时回到 mcastOwner, 最后一个引用释放时释放共享的消息
+    struct mcast_t {
+        std::atomic<int32_t> refs;
+        MESSAGE* msg;
+    };
+
+    struct mcast_owner_t : public BufferOwner {
+        SMQTransport* transport;
+
+        virtual void Release(BUFFER* buf) override
+        {
+            mcast_t* shared = *PayloadOf<mcast_t**>(MessageOf(buf));
+            buf->owner = nullptr;
+            transport->allocator->Free(MessageOf(buf));
+            transport->Unref(shared);
         }
     };
 
@@ -335,16 +854,134 @@ private:
 
 
 public:
-    SMQTransport()
+    enum : int32_t {
+        WRITE_BYTES_DEF = 256 * 1024,  //  单次聚合写的默认字节数上限
+        WRITE_IOVECS_DEF = 64,         //  单次聚合写的默认缓冲区个数上限
+        READ_BYTES_DEF = 64 * 1024,    //  每个流接收缓冲区的默认大小
+        MESSAGE_BYTES_DEF = 64 * 1024 * 1024,  //  默认接收的消息(包括重组的大消息)的最大总长度
+        SHM_BYTES_DEF = 4 * 1024 * 1024,  //  共享内存通道每个方向的默认大小
+        SHM_DRAIN_MAX = 1024,             //  每次最多从共享内存环中处理的消息数
+        SHM_SLOTS_MAX = 1 << 25,          //  对端请求映射的共享内存每个方向最多的槽数(2GB)
+        SHM_RETIRE_MS = 1000,             //  断开的共享内存通道检查是否已经不再被引用的间隔
+        ZRATIO_DEF = 90,                  //  压缩结果不超过原长度的 90% 时才使用
+        ZPROBE_INTERVAL = 16,             //  压缩效果差时每 16 个消息抽样压缩一次
+        QUANTUM_NORMAL_DEF = 64 * 1024,   //  PRIORITY_NORMAL 每轮的默认配额
+        QUANTUM_BULK_DEF = 16 * 1024,     //  PRIORITY_BULK 每轮的默认配额
+        FRAG_BYTES_DEF = 256 * 1024 - 64,  //  默认的分片大小, 一个分片正好是一次默认大小的写
+        FRAG_BYTES_MIN = 1024,
+        FRAG_BYTES_MAX = MESSAGE::TOTAL_LENGTH_MAX - 64,
+        RPC_SLOTS_DEF = 4096,             //  默认最多同时等待回复的 RPC 调用数
+        RPC_TICK_MS = 10,                 //  检查 RPC 调用超时的间隔
+        RECONNECT_MS = 5000,              //  连接失败后重连的间隔
+        HEARTBEAT_DEAD_MIN = 2,           //  判定对端失效至少需要的心跳间隔数
+        STRIPE_SPREAD = 0,                //  通道的消息由空闲的流发送, 见 SetStripes
+        STRIPE_ORDERED = 1,               //  同一 session 的消息固定由一个流发送, 见 SetStripes
+        IO_ASIO = 0,                      //  套接字收发使用 asio(epoll), 见 Init
+        IO_URING = 1,                     //  套接字收发使用 io_uring, 见 Init
+        URING_ENTRIES = 256,              //  每个事件循环的 io_uring 提交队列大小
+        LOOP_BLOCK = 0,                   //  事件循环空闲时在 epoll 中等待, 见 SetPolling
+        LOOP_SPIN = -1,                   //  事件循环一直忙轮询, 从不睡眠, 见 SetPolling
+    };
+
+    SMQTransport() : routes(uint16_t(MESSAGE::ADDRESS_INVALID))
+    {
+        loops.push_back(new loop_t(0, -1));
+        acceptor = nullptr;
+        writeBytes = WRITE_BYTES_DEF;
+        writeIovecs = WRITE_IOVECS_DEF;
+        readBytes = READ_BYTES_DEF;
+        maxMessage = MESSAGE_BYTES_DEF;
+        shmSlots = SlotsOfShm(SHM_BYTES_DEF);
+        shmSeq = 0;
+        connSeq = 0;
+        fragBytes = FRAG_BYTES_DEF;
+        rpc = new RpcTable(RPC_SLOTS_DEF);
+        rpcTick.callback = [this]() { SweepRpc(); };
+        hbInterval = 0;
+        hbTimeout = 0;
+        stripeCount = 1;
+        stripeMode = STRIPE_SPREAD;
+        ioBackend = IO_ASIO;
+        spinMicros = LOOP_BLOCK;
+        busyPollMicros = 0;
+        defaultRoute = MESSAGE::ADDRESS_INVALID;
+        addrLimit = 0;
+        rpcSweep = false;
+        mcastOwner.transport = this;
+        quantum[MESSAGE::PRIORITY_CONTROL] = 0;
+        quantum[MESSAGE::PRIORITY_HIGH] = 0;
+        quantum[MESSAGE::PRIORITY_NORMAL] = QUANTUM_NORMAL_DEF;
+        quantum[MESSAGE::PRIORITY_BULK] = QUANTUM_BULK_DEF;
+    }
+
+    //  停止并等待所有事件循环结束, 然后释放流、连接器、通道和事件循环.
+    //  析构时不能再有其他线程调用本对象
+    ~SMQTransport()
     {
+        Stop();
+        for (auto loop : loops) {
+            if (loop->thread.joinable()) {
+                loop->thread.join();
+            }
+            //  先关闭 io_uring, 内核不再向流的接收缓冲区写入
+            delete loop->unotify;
+            loop->unotify = nullptr;
+            delete loop->uring;
+            loop->uring = nullptr;
+        }
+
+        //  套接字必须在所属的 io_context 之前释放
+        std::vector<stream_t*> all;
+        {
+            std::lock_guard<std::mutex> guard(streamsLock);
+            all = streams;
+        }
+        for (auto stream : all) {
+            delete stream;
+        }
+        delete acceptor;
         acceptor = nullptr;
+
+        chans.ForEach([this](uint16_t, chan_t** slot) {
+            chan_t* chan = *slot;
+            if (nullptr == chan) {
+                return;
+            }
+            if (nullptr != chan->shm) {
+                FreeShm(chan->shm);
+            }
+            for (auto shm : chan->shmRetired) {
+                FreeShm(shm);
+            }
+            delete chan;
+        });
+        delete rpc;
+
+        for (auto loop : loops) {
+            delete loop;
+        }
+        loops.clear();
     }
 
-    int Init(uint16_t selfid, DISPATCHER* disp, ALLOCATOR* alloc, int maxConn)
+    //  maxConn 是目的地址的范围(地址小于 maxConn), 0 表示整个 16 位地址空间(ADDRESS_INVALID 除外).
+    //  通道在第一次用到时才创建, 没有用到的地址几乎不占内存.
+    //  backend 选择套接字收发的方式: IO_URING 时每个事件循环使用一个 io_uring 读写套接字
+    //  (连接、定时器和跨线程提交仍然由 asio 处理), Post/HandleMessage 的语义不变; 内核不支持时返回 -1
+    int Init(uint16_t selfid, DISPATCHER* disp, ALLOCATOR* alloc, int maxConn, int32_t backend = IO_ASIO)
     {
         Q_ASSERT(nullptr != disp);
         Q_ASSERT(nullptr != alloc);
 
+        if (IO_URING == backend) {
+            UringQueue probe;
+            if (0 != probe.Init(URING_ENTRIES)) {
+                return -1;
+            }
+        } else if (IO_ASIO != backend) {
+            return -1;
+        }
+        ioBackend = backend;
+
         int ret = PARENT::Init(selfid, disp, alloc);
         if (0 != ret) {
             return -1;
@@ -354,341 +991,2731 @@ public:
         allocator = alloc;
         //        source = selfid;
 
-        chans.resize(maxConn);
-
+        addrLimit = ((maxConn > 0) && (maxConn < MESSAGE::ADDRESS_INVALID)) ? uint32_t(maxConn)
+                                                                             : uint32_t(MESSAGE::ADDRESS_INVALID);
         return 0;
     }
 
-    int SetupConnect(const std::string& saddr)
+    //  设置发往 target 的发送队列的上限(消息数/字节数, 0 表示不限制), target 为 ADDRESS_INVALID 时设置所有通道.
+    //  超过上限时 Post 返回 POST_WOULDBLOCK; 队列为空时总是接受一个消息, 因此超过字节上限的单个大消息仍然可以发送.
+    //  PRIORITY_CONTROL 的消息不受上限限制.
+    //  可以在任意线程中调用
+    int SetSendLimit(uint16_t target, int32_t msgs, int64_t bytes)
     {
-        // asio::ip::tcp::socket;
-        auto stream = new stream_t(this, std::move(asio::ip::tcp::socket(context)), saddr, ATTR_STREAM_TYPE_ACTIVATE);
+        return ForChans(target, [=](chan_t* chan) {
+            __atomic_store_n(&(chan->maxMsgs), (msgs > 0) ? msgs : 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&(chan->maxBytes), (bytes > 0) ? bytes : int64_t(0), __ATOMIC_RELAXED);
+        });
+    }
 
-        asio::ip::tcp::resolver resolver(context);
-        auto endpoints = resolver.resolve(std::string("localhost"), std::string("9090"));
-        padding.push_back(stream);
-        this->HandleEvent(stream, EVENT_CONN_INITED, 0, 0);
+    //  设置发往 target 的消息的压缩: payload 不小于 minBytes 的用户消息在 Post 时压缩(在调用 Post 的线程中),
+    //  压缩后不超过原长度的 ratio% 才发送压缩结果; 最近的压缩效果差时只抽样压缩. minBytes 为 0 表示不压缩.
+    //  通过共享内存通道发送和已经在共享内存环中构造的消息不压缩. target 为 ADDRESS_INVALID 时设置所有通道.
+    //  可以在任意线程中调用
+    int SetCompression(uint16_t target, int32_t minBytes, int32_t ratio = ZRATIO_DEF)
+    {
+        if ((ratio <= 0) || (ratio > 100)) {
+            return -1;
+        }
 
-        UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_CONNECTING);
+        return ForChans(target, [=](chan_t* chan) {
+            __atomic_store_n(&(chan->zratio), ratio, __ATOMIC_RELAXED);
+            __atomic_store_n(&(chan->zavg), 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&(chan->zmin), (minBytes > 0) ? minBytes : 0, __ATOMIC_RELAXED);
+        });
+    }
 
-        asio::async_connect(stream->socket, endpoints,
-                            [this, stream](const system::error_code& ec, asio::ip::tcp::endpoint ep) {
-                                HandleConnectResult(stream, ec, ep);
-                            });
+    //  设置优先级 prio 的调度方式: bytes 为 0 表示严格优先(只要队列不空就先于所有按权重调度的队列发送),
+    //  否则与其他按权重调度的队列轮转, 每轮最多发送 bytes 字节(一个消息超过配额时累积到下一轮).
+    //  严格优先的队列之间按优先级顺序发送. 默认 CONTROL/HIGH 严格优先, NORMAL 与 BULK 按 4:1 轮转.
+    //  同一优先级的消息按投递顺序发送, 不同优先级的消息之间不保证顺序. 必须在开始发送之前调用
+    int SetPriorityQuantum(uint8_t prio, int32_t bytes)
+    {
+        if ((prio >= MESSAGE::PRIORITY_COUNT) || (bytes < 0)) {
+            return -1;
+        }
+        quantum[prio] = bytes;
         return 0;
     }
 
-    int SetupAcceptor(const std::string& saddr)
+    //  设置发往 target 的发送队列的高/低水位(字节数), target 为 ADDRESS_INVALID 时设置所有通道.
+    //  排队的字节数达到 high 时调用 DISPATCHER::HandleWatermark(target, true), 之后回落到 low 时调用
+    //  HandleWatermark(target, false); 回调在通道所属的事件循环中执行. high 为 0 表示不通知.
+    //  必须在开始发送之前调用
+    int SetSendWatermark(uint16_t target, int64_t high, int64_t low)
     {
-        asio::ip::tcp::resolver resolver(context);
-        auto endpoints = resolver.resolve(std::string("localhost"), std::string("9090"));
-
-        //        auto endpoints = addr_of(saddr);
-
-        Q_ASSERT(nullptr == acceptor);
-        asio::ip::tcp::acceptor* accept = nullptr;
-        try {
-            accept = new asio::ip::tcp::acceptor(context, *endpoints.begin());
-        } catch (system::system_error err) {
-            std::printf("Listen port '%s' failed: %s\n", saddr.c_str(), err.what());
+        if ((high > 0) && ((low < 0) || (low >= high))) {
             return -1;
         }
 
-        acceptor = accept;
-
-        accept->async_accept([this, accept](const system::error_code& ec, asio::ip::tcp::socket sock) {
-            HandleAcceptResult(accept, ec, std::move(sock));
+        return ForChans(target, [=](chan_t* chan) {
+            chan->highBytes = (high > 0) ? high : 0;
+            chan->lowBytes = (high > 0) ? low : 0;
         });
-        return 0;
     }
 
-    uint16_t get_attr(void* s, uint16_t mask)
+    //  设置单次聚合写的预算: 一次写操作最多合并多少字节/多少个消息
+    //  (超过字节预算的单个消息仍然会被单独发送)
+    void SetWriteBudget(int32_t bytes, int32_t iovecs)
     {
-        stream_t* stream = (stream_t*)s;
-        return (stream->attr & mask);
+        writeBytes = (bytes > 0) ? bytes : WRITE_BYTES_DEF;
+        writeIovecs = (iovecs > 0) ? iovecs : WRITE_IOVECS_DEF;
     }
 
-    int Post(MESSAGE* msg)
+    //  设置事件循环的个数, 以及每个事件循环绑定的CPU核(cores 为空或者不足时对应的事件循环不绑定);
+    //  必须在 SetupAcceptor/SetupConnect 之前调用.
+    //  多个事件循环时 DISPATCHER::HandleMessage 会在多个线程中被并发调用
+    int SetLoops(int32_t count, const std::vector<int32_t>& cores = std::vector<int32_t>())
     {
-        std::printf("Post external message\n");
+        Q_ASSERT(nullptr == acceptor);
+        Q_ASSERT(padding.empty());
+        if (count < 1) {
+            return -1;
+        }
 
-        Q_ASSERT(msg != nullptr);
+        for (auto loop : loops) {
+            delete loop;
+        }
+        loops.clear();
 
-        BUFFER* buf = BufferOf(msg);
-        //        Q_ASSERT(buf->source < chans.size());
-        Q_ASSERT(buf->target < chans.size());
+        for (int32_t i = 0; i < count; i++) {
+            loops.push_back(new loop_t(i, (i < int32_t(cores.size())) ? cores[i] : -1));
+        }
+        return 0;
+    }
 
-        chan_t* chan = ChanOf(buf->target);
-        if (nullptr == chan) {
+    //  事件循环空闲时的行为, 必须在 Loop 之前调用:
+    //  - spinMicros 为 LOOP_BLOCK(默认)时在 epoll 中睡眠等待事件
+    //  - 为 LOOP_SPIN 时一直忙轮询(asio 事件、提交队列、io_uring 完成队列), 其他线程 Post 时不需要唤醒,
+    //    每个事件循环占满一个核, 通常与 SetLoops 的 cores 一起使用, 让每个事件循环独占一个核
+    //  - 大于 0 时连续空闲 spinMicros 微秒之后退回到睡眠, 有事件时重新开始忙轮询
+    //  busyPollMicros 大于 0 时对之后建立的 TCP 连接设置 SO_BUSY_POLL, 接收时在驱动中忙等这么久
+    //  (需要网卡支持, 超过 net.core.busy_read 时需要 CAP_NET_ADMIN)
+    int SetPolling(int32_t spinMicros, int32_t busyPollMicros = 0)
+    {
+        if ((spinMicros < LOOP_SPIN) || (busyPollMicros < 0)) {
             return -1;
         }
+        this->spinMicros = spinMicros;
+        this->busyPollMicros = busyPollMicros;
+        return 0;
+    }
 
-        chan->qsend.push_back(BufferOf(msg));
-
-        if (nullptr != chan->stream) {
-            auto stream = chan->stream;
+    //  设置本机对端之间共享内存通道每个方向的大小, 0 表示不使用共享内存通道
+    void SetSharedMemory(int32_t bytes)
+    {
+        shmSlots = SlotsOfShm(bytes);
+    }
 
-            //  如果当前处于写丢失状态,那么重启写操作
-            if (stream->wloss) {
-                stream->wcur = (BUFFER*)(chan->qsend.pop_front());
-                async_write(stream, MessageOf(stream->wcur));
+    //  分配发往 target 的消息: 与 target 之间的共享内存通道已经建立时直接在共享内存环中构造消息,
+    //  之后通过 Post 发送时没有任何拷贝. 可以在任意线程中调用.
+    //  这样预留的消息最多占用环的一半, 另一半留给事件循环拷贝进环的消息
+    MESSAGE* Alloc(uint16_t target, int32_t payloadSize)
+    {
+        chan_t* chan = FindChan(target);
+        if (nullptr != chan) {
+            //  先登记再读取 shmtx: SweepShm 看到登记数为 0 之后, 不会再有线程使用已经断开的环.
+            //  预留成功的消息由环自己记录(见 ShmRing::Drained), 所以预留之后就可以注销
+            __atomic_add_fetch(&(chan->shmusers), 1, __ATOMIC_SEQ_CST);
+            ShmRing* ring = __atomic_load_n(&(chan->shmtx), __ATOMIC_SEQ_CST);
+            MESSAGE* msg = nullptr;
+            if ((nullptr != ring) && (0 == __atomic_load_n(&(chan->shmbusy), __ATOMIC_RELAXED))) {
+                msg = ring->Reserve(payloadSize, ring->Slots() / 2);
+            }
+            __atomic_sub_fetch(&(chan->shmusers), 1, __ATOMIC_RELEASE);
+            if (nullptr != msg) {
+                msg->Target(target);
+                return msg;
             }
         }
-        return 0;
+
+        MESSAGE* msg = allocator->Alloc(payloadSize);
+        if (nullptr != msg) {
+            msg->Target(target);
+        }
+        return msg;
     }
 
-    void Loop()
+    //  设置分片的大小: 总长度超过 bytes 的消息通过 TCP 发送时拆成多个分片, 与其他消息交错发送, 接收方重组后
+    //  再交给 DISPATCHER, 大消息对其他消息的延迟影响不超过一次写. 总长度超过 TOTAL_LENGTH_MAX 的消息必须分片,
+    //  bytes 为 0 表示只拆分这样的消息. 两端都需要支持分片. 必须在开始发送之前调用
+    int SetFragmentBytes(int32_t bytes)
     {
-        context.run();
+        if ((bytes < 0) || ((bytes > 0) && (bytes < FRAG_BYTES_MIN))) {
+            return -1;
+        }
+        fragBytes = ((0 == bytes) || (bytes > FRAG_BYTES_MAX)) ? int32_t(FRAG_BYTES_MAX) : bytes;
+        return 0;
     }
 
-public:
-    void HandleConnectResult(stream_t* stream, const system::error_code& err, asio::ip::tcp::endpoint ep)
+    //  设置最多同时等待回复的 RPC 调用数(不超过 RpcTable::SLOTS_MAX), 必须在第一次 Call 之前调用
+    int SetRpcSlots(int32_t count)
     {
-        if (err) {
-            debug(stream, "%p:HandleConnect failed:%d: %s", stream, err.value(),
-                  err.message().c_str());  // TODO 错误码是啥
-            if (nullptr == stream->timer) {
-                // stream->timer = new asio::deadline_timer(context, posix_time::seconds(5));
-                stream->timer = new asio::deadline_timer(context);
-            }
-
-            stream->timer->expires_from_now(posix_time::seconds(5));
-            stream->timer->async_wait([this, stream](system::error_code err) {
-                std::printf("timeout - try reconnnect\n");
-                stream->timer->cancel();
-                this->async_connect(stream);
-            });
-            return;
+        if ((count <= 0) || (count > int32_t(RpcTable::SLOTS_MAX))) {
+            return -1;
         }
-        debug(stream, "HandleConnect success: %s", ep.address().to_string().c_str());
+        delete rpc;
+        rpc = new RpcTable(uint32_t(count));
+        return 0;
+    }
 
-        if (nullptr != stream->timer) {
-            asio::deadline_timer* timer = stream->timer;
-            // stream->timer = nullptr;
-            timer->cancel();
-            // delete timer;
+    //  设置心跳: 流认证完成后每 intervalMs 毫秒检查一次, 上一个间隔内没有读到对端的任何数据时发送心跳
+    //  (对端总是立即应答), 连续 timeoutMs 毫秒没有读到数据时判定对端失效, 关闭连接, 之后按连接断开处理
+    //  (主动连接的一端重连). 判定的精度为一个间隔, timeoutMs 至少是 intervalMs 的 HEARTBEAT_DEAD_MIN 倍.
+    //  intervalMs 为 0 表示不使用心跳(默认). 两端都需要支持心跳应答. 只影响之后完成认证的流
+    int SetHeartbeat(int32_t intervalMs, int32_t timeoutMs)
+    {
+        if (0 == intervalMs) {
+            hbInterval = 0;
+            hbTimeout = 0;
+            return 0;
         }
+        if ((intervalMs < 0) || (timeoutMs < intervalMs * int32_t(HEARTBEAT_DEAD_MIN))) {
+            return -1;
+        }
+        hbInterval = intervalMs;
+        hbTimeout = timeoutMs;
+        return 0;
+    }
 
-        UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_CONNECTED);
+    //  设置发起连接时每个通道建立的流数(1~STRIPES_MAX)和消息在这些流之间的分配方式, 必须在 SetupConnect 之前调用.
+    //  接收连接的一端接受对端建立的所有流(最多 STRIPES_MAX 个), 按自己设置的 mode 发送.
+    //  STRIPE_SPREAD: 所有流都从通道的发送队列中取消息, 哪个流的上一次写完成了就由哪个流继续取, 因此一个流写不动
+    //      (拥塞、丢包重传)时自然由其他流承担, 卡住的只有它已经取走的消息. 同一个通道的消息之间不再保证顺序,
+    //      一个大消息的所有分片总是在同一个流上发送.
+    //  STRIPE_ORDERED: session 非 0 的用户消息按 session 固定分配到一个流, 同一 session 的消息保持投递顺序
+    //      (不再按优先级调度), 其他消息都由第一个流按优先级发送; 流断开或者重新建立时分配会改变, 这时不保证顺序.
+    //  共享内存通道建立后所有消息都通过共享内存环发送. 两端都需要支持多个流
+    int SetStripes(int32_t count, int32_t mode = STRIPE_SPREAD)
+    {
+        if ((count < 1) || (count > int32_t(STRIPES_MAX)) || ((STRIPE_SPREAD != mode) && (STRIPE_ORDERED != mode))) {
+            return -1;
+        }
+        stripeCount = count;
+        stripeMode = mode;
+        return 0;
+    }
 
-        stream->rhead = true;
-        async_read(stream);
-        padding.push_back(stream);
+    //  设置每个流接收缓冲区的大小, 只影响之后新建的流
+    void SetReadBuffer(int32_t bytes)
+    {
+        readBytes = (bytes >= int32_t(sizeof(MESSAGE))) ? bytes : READ_BYTES_DEF;
     }
 
-    void HandleAcceptResult(asio::ip::tcp::acceptor* a, const system::error_code& err, asio::ip::tcp::socket sock)
+    //  设置从套接字接收的消息(包括由分片重组的大消息)的最大总长度(含消息头, 不超过 MESSAGE::TOTAL_LENGTH_LARGE).
+    //  对端发送更大的消息时按协议错误处理, 关闭连接, 避免按对端声明的长度分配过大的内存
+    int SetMaxMessage(int32_t bytes)
     {
-        if (err) {
-            debug(nullptr, "HandleAcceptResult failed:%d: %s", err.value(), err.message().c_str());  // TODO 错误码是啥
-            return;
+        if ((bytes < int32_t(sizeof(MESSAGE))) || (bytes > int32_t(MESSAGE::TOTAL_LENGTH_LARGE))) {
+            return -1;
         }
-        std::printf("HandleAccept success\n");
+        maxMessage = bytes;
+        return 0;
+    }
 
-        std::string saddr;
+    int32_t GetMaxMessage() const
+    {
+        return maxMessage;
+    }
+
+    //  连接 saddr, 地址非法或者无法解析时返回 -1
+    int SetupConnect(const std::string& saddr)
+    {
+        // asio::ip::tcp::socket;
+        loop_t* loop = loops[0];
         system::error_code ec;
-        auto endpoint = sock.remote_endpoint(ec);
+        auto endpoints = resolve_of(loop->context, saddr, ec);
         if (ec) {
-            std::printf("HandleAccept : can not get the remote endpoint:%d:  %s\n", ec.value(), ec.message().c_str());
-            saddr = str_of(endpoint);
+            TRACE_ERROR(TRACE_CONNECT_FAILED, nullptr, ec.value());
+            std::fprintf(stderr, "Resolve '%s' failed: %s\n", saddr.c_str(), ec.message().c_str());
+            return -1;
         }
+        for (int32_t i = 0; i < stripeCount; i++) {
+            auto stream = new stream_t(this, loop, std::move(asio::ip::tcp::socket(loop->context)), saddr,
+                                       ATTR_STREAM_TYPE_ACTIVATE);
+            stream->stripe = uint16_t(i);
 
-        auto stream = new stream_t(this, std::move(sock), saddr, ATTR_STREAM_TYPE_PASSIVES);
+            padding.push_back(stream);
+            this->HandleEvent(stream, EVENT_CONN_INITED, 0, 0);
 
-        padding.push_back(stream);
-        this->HandleEvent(stream, EVENT_CONN_INITED, 0, 0);
+            UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_CONNECTING);
 
-        stream->rhead = true;
-        async_read(stream);
+            asio::async_connect(stream->socket, endpoints,
+                                [this, stream](const system::error_code& ec, asio::ip::tcp::endpoint ep) {
+                                    HandleConnectResult(stream, ec, ep);
+                                });
+        }
+        return 0;
+    }
 
-        //  accept others connections
+    int SetupAcceptor(const std::string& saddr)
+    {
+        Q_ASSERT(nullptr == acceptor);
+        asio::ip::tcp::acceptor* accept = nullptr;
+        try {
+            system::error_code ec;
+            auto endpoints = resolve_of(loops[0]->context, saddr, ec);
+            if (ec) {
+                throw system::system_error(ec);
+            }
+            accept = new asio::ip::tcp::acceptor(loops[0]->context, *endpoints.begin());
+        } catch (system::system_error err) {
+            TRACE_ERROR(TRACE_LISTEN_FAILED, err.code().value());
+            std::fprintf(stderr, "Listen port '%s' failed: %s\n", saddr.c_str(), err.what());
+            return -1;
+        }
+
+        acceptor = accept;
+
+        accept->async_accept([this, accept](const system::error_code& ec, asio::ip::tcp::socket sock) {
+            HandleAcceptResult(accept, ec, std::move(sock));
+        });
+        return 0;
+    }
+
+    uint16_t get_attr(void* s, uint16_t mask)
+    {
+        stream_t* stream = (stream_t*)s;
+        return (stream->attr & mask);
+    }
+
+    //  可以在任意线程中调用: 其他线程提交的消息先进入事件循环的无锁提交队列,
+    //  一批消息只唤醒一次事件循环.
+    //  返回 POST_OK 时消息归传输层所有; 否则(发送队列已满时返回 POST_WOULDBLOCK)消息仍归调用者所有
+    int Post(MESSAGE* msg)
+    {
+        Q_ASSERT(msg != nullptr);
+
+        BUFFER* buf = BufferOf(msg);
+        //        Q_ASSERT(buf->source < chans.size());
+        Q_ASSERT(buf->target < addrLimit);
+
+        uint16_t target = buf->target;
+        uint16_t hop = RouteOf(target);
+        chan_t* chan = ChanOf(hop);
+        if (nullptr == chan) {
+            return POST_ERROR;
+        }
+
+        //  压缩结果(以及为路由尾部准备的拷贝)在确定投递后才替换原消息, 返回 POST_WOULDBLOCK 时调用者的消息不变
+        MESSAGE* wire = Deflate(chan, msg);
+        int32_t tail = (hop != target) ? int32_t(ROUTE_TAIL) : 0;
+        if ((tail > 0) && ((nullptr != BufferOf(wire)->owner) || (wire->Cap() < wire->TotalLength() + tail))) {
+            MESSAGE* copy = allocator->Alloc(wire->PayloadLength() + tail);
+            if (nullptr == copy) {
+                if (wire != msg) {
+                    allocator->Free(wire);
+                }
+                return POST_ERROR;
+            }
+            std::memcpy(copy, wire, wire->TotalLength());
+            copy->TotalLength(wire->TotalLength());
+            copy->Priority(msg->Priority());
+            if (wire != msg) {
+                allocator->Free(wire);
+            }
+            wire = copy;
+        }
+
+        if (!Admit(chan, wire->TotalLength() + tail, msg->Priority())) {
+            if (wire != msg) {
+                allocator->Free(wire);
+            }
+            return POST_WOULDBLOCK;
+        }
+        if (wire != msg) {
+            allocator->Free(msg);
+            msg = wire;
+        }
+
+        if (tail > 0) {
+            AppendRoute(msg, target, hop);
+        }
+        Submit(msg);
+        return POST_OK;
+    }
+
+    //  设置路由: 发往 target 的消息先发给直接连接的 via, 由 via(按它自己的路由)继续转发, 中间节点不拷贝消息,
+    //  也不交给 DISPATCHER; 接收方看到的 Source 是原始的源地址, 因此 Reply 沿路由回复;
+    //  接收方的 DISPATCHER::HandleMessage 收到的 stream 可能为空(与原始的源地址之间没有直接连接时).
+    //  via 等于 target 表示直接发送; via 为 ADDRESS_INVALID 表示删除, 改为按默认路由发送. 可以在与 via 的连接
+    //  建立之前设置, 设置路由不会创建通道.
+    //  target 为 ADDRESS_INVALID 时设置默认路由: 没有单独设置路由的目的地址(via 本身除外)都经过 via 转发,
+    //  这时直接连接的对端需要用 SetRoute(peer, peer) 设置. 路径上的所有节点都需要支持转发.
+    //  Multicast 不使用路由. 可以在任意线程中调用, 已经投递的消息不受影响
+    int SetRoute(uint16_t target, uint16_t via)
+    {
+        if ((via >= addrLimit) && (MESSAGE::ADDRESS_INVALID != via)) {
+            return -1;
+        }
+        if (MESSAGE::ADDRESS_INVALID == target) {
+            __atomic_store_n(&defaultRoute, via, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (target >= addrLimit) {
+            return -1;
+        }
+        __atomic_store_n(routes.Slot(target), via, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    //  把 msg 同时发给 targets 中的所有目的地址: 消息只有一份, 每个目的地址只增加一个很小的引用节点,
+    //  最后一个目的地址发送完成后释放消息. 可以在任意线程中调用.
+    //  消息总是归传输层所有; 目的地址没有通道(从未连接或投递过)或者发送队列已满时跳过该目的地址(skipped 非空时记录在其中),
+    //  返回实际投递的目的地址个数. 压缩按第一个目的地址的通道设置进行一次. msg 不能是在共享内存环中构造的消息
+    int Multicast(MESSAGE* msg, const uint16_t* targets, int32_t count, std::vector<uint16_t>* skipped = nullptr)
+    {
+        Q_ASSERT(msg != nullptr);
+        Q_ASSERT(nullptr == BufferOf(msg)->owner);
+
+        chan_t* first = (count > 0) ? FindChan(targets[0]) : nullptr;
+        if (nullptr != first) {
+            MESSAGE* wire = Deflate(first, msg);
+            if (wire != msg) {
+                allocator->Free(msg);
+                msg = wire;
+            }
+        }
+
+        //  调用者持有一个引用, 投递完所有目的地址后释放, 避免消息在投递过程中被提前释放
+        mcast_t* shared = new mcast_t();
+        shared->refs.store(1, std::memory_order_relaxed);
+        shared->msg = msg;
+
+        int posted = 0;
+        for (int32_t i = 0; i < count; i++) {
+            chan_t* chan = FindChan(targets[i]);
+            if ((nullptr == chan) || !Admit(chan, msg->TotalLength(), msg->Priority())) {
+                if (nullptr != skipped) {
+                    skipped->push_back(targets[i]);
+                }
+                continue;
+            }
+
+            MESSAGE* ref = allocator->Alloc(sizeof(mcast_t*));
+            if (nullptr == ref) {
+                Unadmit(chan, msg->TotalLength());
+                if (nullptr != skipped) {
+                    skipped->push_back(targets[i]);
+                }
+                continue;
+            }
+            *PayloadOf<mcast_t**>(ref) = shared;
+            ref->PayloadLength(sizeof(mcast_t*));
+            ref->Target(targets[i]);
+            ref->Source(msg->Source());
+            ref->Priority(msg->Priority());
+            BufferOf(ref)->owner = &mcastOwner;
+            shared->refs.fetch_add(1, std::memory_order_relaxed);
+
+            Submit(ref);
+            posted++;
+        }
+
+        Unref(shared);
+        return posted;
+    }
+
+    int Multicast(MESSAGE* msg, const std::vector<uint16_t>& targets, std::vector<uint16_t>* skipped = nullptr)
+    {
+        return Multicast(msg, targets.data(), int32_t(targets.size()), skipped);
+    }
+
+    //  定义(或者替换)组播组, targets 为空时删除. 可以在任意线程中调用, 正在进行的 MulticastGroup 不受影响
+    void SetGroup(uint32_t group, const std::vector<uint16_t>& targets)
+    {
+        std::shared_ptr<const std::vector<uint16_t>> list;
+        if (!targets.empty()) {
+            list = std::make_shared<const std::vector<uint16_t>>(targets);
+        }
+
+        std::lock_guard<std::mutex> guard(groupsLock);
+        if (list) {
+            groups[group] = list;
+        } else {
+            groups.erase(group);
+        }
+    }
+
+    //  发给组播组中的所有目的地址, 组不存在时释放消息并返回 -1
+    int MulticastGroup(MESSAGE* msg, uint32_t group, std::vector<uint16_t>* skipped = nullptr)
+    {
+        std::shared_ptr<const std::vector<uint16_t>> list;
+        {
+            std::lock_guard<std::mutex> guard(groupsLock);
+            auto it = groups.find(group);
+            if (it != groups.end()) {
+                list = it->second;
+            }
+        }
+
+        if (!list) {
+            allocator->Free(msg);
+            return -1;
+        }
+        return Multicast(msg, *list, skipped);
+    }
+
+    //  发往 target 的消息的下一跳, 直接发送时就是 target
+    inline uint16_t RouteOf(uint16_t target) const
+    {
+        const uint16_t* slot = routes.Find(target);
+        uint16_t via = (nullptr != slot) ? __atomic_load_n(slot, __ATOMIC_RELAXED) : uint16_t(MESSAGE::ADDRESS_INVALID);
+        if (MESSAGE::ADDRESS_INVALID == via) {
+            via = __atomic_load_n(&defaultRoute, __ATOMIC_RELAXED);
+        }
+        return (MESSAGE::ADDRESS_INVALID == via) ? target : via;
+    }
+
+    //  在消息末尾追加路由尾部, 改为发往下一跳 hop; 调用者保证容量足够
+    void AppendRoute(MESSAGE* msg, uint16_t target, uint16_t hop)
+    {
+        ROUTETAIL tail;
+        tail.source = this->source;
+        tail.target = target;
+        tail.hops = ROUTE_HOPS_MAX;
+        tail.prio = msg->Priority();
+        std::memset(tail.reserved, 0, sizeof(tail.reserved));
+        std::memcpy((uint8_t*)msg + msg->TotalLength(), &tail, sizeof(tail));
+        msg->TotalLength(msg->TotalLength() + ROUTE_TAIL);
+        msg->Flags(msg->Flags() | MESSAGE::FLAGS_ROUTED);
+        msg->Target(hop);
+    }
+
+    //  把已经占用了发送队列容量的消息交给通道所属的事件循环
+    void Submit(MESSAGE* msg)
+    {
+        BUFFER* buf = BufferOf(msg);
+
+        //  通道只能在其所属的事件循环中访问
+        loop_t* loop = LoopOf(buf->target);
+        if (loop->context.get_executor().running_in_this_thread()) {
+            PostLocal(msg);
+            return;
+        }
+
+        if (loop->qsubmit.Push(buf)) {
+            //  与 SpinLoop 准备睡眠时的检查配对: 要么这里看到它已经不再轮询, 要么它看到这条消息
+            if (LOOP_BLOCK != spinMicros) {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (loop->spinning.load(std::memory_order_relaxed)) {
+                    return;
+                }
+            }
+            Bump(loop->wakeups);
+            asio::post(loop->context, [this, loop]() { DrainSubmit(loop); });
+        }
+    }
+
+    void Unref(mcast_t* shared)
+    {
+        if (1 == shared->refs.fetch_sub(1, std::memory_order_acq_rel)) {
+            allocator->Free(shared->msg);
+            delete shared;
+        }
+    }
+
+    //  发送队列中的节点实际要发送的消息: 组播的引用节点对应共享的消息, 其他节点就是消息本身
+    inline MESSAGE* WireOf(BUFFER* buf)
+    {
+        if (&mcastOwner == buf->owner) {
+            return (*PayloadOf<mcast_t**>(MessageOf(buf)))->msg;
+        }
+        return MessageOf(buf);
+    }
+
+    //  同 Post, 但发送队列已满时最多等待 timeoutMs 毫秒(小于 0 表示一直等待), 超时返回 POST_WOULDBLOCK.
+    //  不能在事件循环线程中等待(会挡住排空发送队列的事件循环), 此时不等待直接返回
+    int PostWait(MESSAGE* msg, int32_t timeoutMs)
+    {
+        int ret = Post(msg);
+        if (POST_WOULDBLOCK != ret) {
+            return ret;
+        }
+
+        for (auto loop : loops) {
+            if (loop->context.get_executor().running_in_this_thread()) {
+                return POST_WOULDBLOCK;
+            }
+        }
+
+        chan_t* chan = FindChan(RouteOf(BufferOf(msg)->target));
+        if (nullptr == chan) {
+            return ret;
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        std::unique_lock<std::mutex> guard(waitLock);
+        __atomic_add_fetch(&(chan->waiters), 1, __ATOMIC_SEQ_CST);
+        while (POST_WOULDBLOCK == (ret = Post(msg))) {
+            if (timeoutMs < 0) {
+                waitCond.wait(guard);
+            } else if (std::cv_status::timeout == waitCond.wait_until(guard, deadline)) {
+                ret = Post(msg);
+                break;
+            }
+        }
+        __atomic_sub_fetch(&(chan->waiters), 1, __ATOMIC_SEQ_CST);
+        return ret;
+    }
+
+    //  RPC 调用: 为 req 分配 session 后投递, 对端用 Reply 发回的回复不经过 DISPATCHER, 而是交给 callback.
+    //  callback 在收到回复的事件循环中执行; 超过 timeoutMs 毫秒没有回复时在第一个事件循环中以 RPC_TIMEOUT
+    //  执行(精度为 RPC_TICK_MS), 之后到达的回复被丢弃. 可以在任意线程中调用.
+    //  返回 POST_OK 时 req 归传输层所有, callback 之后恰好执行一次; 否则 req 仍归调用者所有, callback 不会执行.
+    //  等待回复的调用数达到上限时返回 POST_WOULDBLOCK
+    int Call(MESSAGE* req, int32_t timeoutMs, RpcCallback callback)
+    {
+        Q_ASSERT(nullptr != req);
+        uint32_t session = rpc->Acquire(int64_t(NowNanos()) + int64_t(timeoutMs) * 1000000, std::move(callback));
+        if (0 == session) {
+            return POST_WOULDBLOCK;
+        }
+
+        if (!rpcSweep.exchange(true)) {
+            asio::post(loops[0]->context, [this]() { SweepRpc(); });
+        }
+
+        req->session = session;
+        req->Flags(req->Flags() & ~MESSAGE::FLAGS_REPLY);
+        int ret = Post(req);
+        if (POST_OK != ret) {
+            RpcCallback dropped;
+            if (!rpc->Finish(session, &dropped)) {
+                //  超时已经先一步结束了这个调用(callback 已经执行), 只能当作投递成功
+                allocator->Free(req);
+                return POST_OK;
+            }
+        }
+        return ret;
+    }
+
+    //  同步的 RPC 调用: 返回 RPC_OK 时 *reply 是回复消息(归调用者所有), 返回 RPC_TIMEOUT/RPC_CANCELED 时 req
+    //  已经归传输层所有; 投递失败时返回 POST_ERROR/POST_WOULDBLOCK, req 仍归调用者所有.
+    //  不能在事件循环线程中调用(会挡住回复的处理), 此时直接返回 POST_WOULDBLOCK
+    int CallWait(MESSAGE* req, int32_t timeoutMs, MESSAGE** reply)
+    {
+        Q_ASSERT(nullptr != reply);
+        for (auto loop : loops) {
+            if (loop->context.get_executor().running_in_this_thread()) {
+                return POST_WOULDBLOCK;
+            }
+        }
+
+        auto done = std::make_shared<std::promise<std::pair<int32_t, MESSAGE*>>>();
+        std::future<std::pair<int32_t, MESSAGE*>> result = done->get_future();
+        int ret = Call(req, timeoutMs,
+                       [done](int32_t status, MESSAGE* msg) { done->set_value(std::make_pair(status, msg)); });
+        if (POST_OK != ret) {
+            return ret;
+        }
+
+        std::pair<int32_t, MESSAGE*> status = result.get();
+        *reply = status.second;
+        return status.first;
+    }
+
+    //  回复 req: reply 发往 req 的来源并带上 req 的 session, reply 可以就是 req 本身. 返回值同 Post
+    int Reply(const MESSAGE* req, MESSAGE* reply)
+    {
+        Q_ASSERT((nullptr != req) && (0 != req->session));
+        uint32_t session = req->session;
+        uint16_t target = req->Source();
+        reply->session = session;
+        reply->Target(target);
+        reply->Flags(reply->Flags() | MESSAGE::FLAGS_REPLY);
+        return Post(reply);
+    }
+
+    //  收到 RPC 回复: 交给发起调用的回调; 调用已经超时(或者 session 不存在)时丢弃
+    int32_t HandleReply(SMQStream* stream, MESSAGE* msg)
+    {
+        RpcCallback callback;
+        if (!rpc->Finish(msg->session, &callback)) {
+            allocator->Free(msg);
+            return ACTION_NONE;
+        }
+
+        msg->Flags(msg->Flags() & ~MESSAGE::FLAGS_REPLY);
+        callback(RPC_OK, msg);
+        return ACTION_NONE;
+    }
+
+    //  收到带路由尾部的消息: 目的地址是本节点时去掉尾部, 在 origin 中返回原始的源地址并返回 true;
+    //  这时如果原始的源地址属于另一个事件循环, 消息转到那里交给 DISPATCHER(同一个来源的消息总是在它所属的
+    //  事件循环中处理, 与直接连接时一样; 此时交给 DISPATCHER 的是 from 的通道的流(没有时为空),
+    //  转发消息的流属于另一个事件循环, 不能带过去; 忽略 DISPATCHER 返回的动作), 返回 false.
+    //  否则原地更新尾部, 把消息直接放入下一跳通道的发送队列(不经过 DISPATCHER), 返回 false; 共享内存环中的消息
+    //  先拷贝出来, 不让下一跳的发送占住环. 跳数用完、尾部非法、下一跳没有通道或者发送队列已满时丢弃消息
+    bool Unroute(void* s, MESSAGE* msg, uint16_t* origin)
+    {
+        stream_t* stream = (stream_t*)s;
+        ROUTETAIL tail;
+        std::memset(&tail, 0, sizeof(tail));
+        tail.target = MESSAGE::ADDRESS_INVALID;
+        uint8_t* at = (uint8_t*)msg + msg->TotalLength() - ROUTE_TAIL;
+        if (msg->PayloadLength() >= int32_t(ROUTE_TAIL)) {
+            std::memcpy(&tail, at, sizeof(tail));
+        }
+
+        if (this->source == tail.target) {
+            msg->TotalLength(msg->TotalLength() - ROUTE_TAIL);
+            msg->Flags(msg->Flags() & ~MESSAGE::FLAGS_ROUTED);
+            *origin = tail.source;
+            loop_t* home = LoopOf(tail.source);
+            if (home == stream->loop) {
+                return true;
+            }
+            uint16_t from = tail.source;
+            asio::post(home->context, [this, msg, from]() {
+                chan_t* chan = FindChan(from);
+                this->HandleUser((nullptr != chan) ? chan->stream : nullptr, msg, from);
+            });
+            return false;
+        }
+
+        //  只转发给已经有通道的下一跳, 不为对端给出的任意地址创建通道
+        uint16_t hop = RouteOf(tail.target);
+        chan_t* chan = FindChan(hop);
+        uint8_t prio = (tail.prio < MESSAGE::PRIORITY_COUNT) ? tail.prio : uint8_t(MESSAGE::PRIORITY_NORMAL);
+        if ((0 == tail.hops) || (nullptr == chan) || !Admit(chan, msg->TotalLength(), prio)) {
+            TRACE_WARN(TRACE_ROUTE_DROP, stream, stream->target, tail.target, tail.hops);
+            SeqCounter<STREAM_COUNTER_MAX>::Update u(stream->stats);
+            u.Add(STREAM_ROUTE_DROPS, 1);
+            allocator->Free(msg);
+            return false;
+        }
+
+        if (nullptr != BufferOf(msg)->owner) {
+            MESSAGE* copy = allocator->Alloc(msg->PayloadLength());
+            if (nullptr == copy) {
+                CountAllocFailure(stream);
+                Unadmit(chan, msg->TotalLength());
+                allocator->Free(msg);
+                return false;
+            }
+            std::memcpy(copy, msg, msg->TotalLength());
+            copy->TotalLength(msg->TotalLength());
+            allocator->Free(msg);
+            msg = copy;
+            at = (uint8_t*)msg + msg->TotalLength() - ROUTE_TAIL;
+        }
+
+        tail.hops--;
+        std::memcpy(at, &tail, sizeof(tail));
+        msg->Target(hop);
+        msg->Priority(prio);
+        {
+            SeqCounter<STREAM_COUNTER_MAX>::Update u(stream->stats);
+            u.Add(STREAM_ROUTED, 1);
+        }
+        Submit(msg);
+        return false;
+    }
+
+    //  在 target 所属的事件循环中启动定时器: ms 毫秒后(精度 1 毫秒)在该事件循环中执行 timer->callback;
+    //  已经启动的定时器重新计时. 所有定时器共用每个事件循环的一个时间轮, 启动和取消都是 O(1).
+    //  只能在该事件循环的线程中调用(例如在来自 target 的消息的 HandleMessage 或者定时器回调中),
+    //  其他线程用 Execute 转入. timer 在到期或者 StopTimer 之前不能释放
+    void StartTimer(uint16_t target, TIMER* timer, int32_t ms)
+    {
+        Q_ASSERT(nullptr != timer);
+        ArmTimer(LoopOf(target), timer, ms);
+    }
+
+    //  取消 StartTimer(target, timer, ...) 启动的定时器, 没有启动时什么也不做. 调用线程的要求同 StartTimer
+    void StopTimer(uint16_t target, TIMER* timer)
+    {
+        LoopOf(target)->wheel.Cancel(timer);
+    }
+
+    //  在 target 所属的事件循环中执行 fn, 可以在任意线程中调用
+    void Execute(uint16_t target, std::function<void()> fn)
+    {
+        asio::post(LoopOf(target)->context, std::move(fn));
+    }
+
+    //  发往 target 的已投递但还没有交给流(或者共享内存环)的消息数/字节数, target 还没有通道时返回 -1.
+    //  可以在任意线程中调用
+    int GetSendQueue(uint16_t target, int32_t* msgs, int64_t* bytes)
+    {
+        chan_t* chan = FindChan(target);
+        if (nullptr == chan) {
+            return -1;
+        }
+        if (nullptr != msgs) {
+            *msgs = __atomic_load_n(&(chan->qmsgs), __ATOMIC_RELAXED);
+        }
+        if (nullptr != bytes) {
+            *bytes = __atomic_load_n(&(chan->qbytes), __ATOMIC_RELAXED);
+        }
+        return 0;
+    }
+
+    //  按通道的压缩设置压缩消息: 返回压缩后的新消息, 不压缩或者压缩效果不够时返回原消息
+    MESSAGE* Deflate(chan_t* chan, MESSAGE* msg)
+    {
+        int32_t zmin = __atomic_load_n(&(chan->zmin), __ATOMIC_RELAXED);
+        if ((0 == zmin) || (msg->PayloadLength() < zmin) || (MESSAGE::TYPE_USER != msg->Type()) ||
+            (0 != (msg->Flags() & MESSAGE::FLAGS_COMPRESSED)) || (nullptr != BufferOf(msg)->owner) ||
+            (nullptr != __atomic_load_n(&(chan->shmtx), __ATOMIC_RELAXED))) {
+            return msg;
+        }
+
+        int32_t ratio = __atomic_load_n(&(chan->zratio), __ATOMIC_RELAXED);
+        int32_t avg = __atomic_load_n(&(chan->zavg), __ATOMIC_RELAXED);
+        if ((avg > ratio) && (0 != (__atomic_add_fetch(&(chan->zprobe), 1, __ATOMIC_RELAXED) % ZPROBE_INTERVAL))) {
+            return msg;
+        }
+
+        //  只分配允许的最大压缩结果, 压缩结果超过时压缩提前失败
+        uint32_t length = uint32_t(msg->PayloadLength());
+        int32_t cap = int32_t(uint64_t(length) * ratio / 100);
+        MESSAGE* out = allocator->Alloc(int32_t(sizeof(length)) + cap);
+        int32_t n = -1;
+        if (nullptr != out) {
+            n = LzCodec::Compress(msg->payload, int32_t(length), out->payload + sizeof(length), cap);
+        }
+
+        int32_t percent = (n < 0) ? 100 : int32_t(uint64_t(n) * 100 / length);
+        __atomic_store_n(&(chan->zavg), (avg * 7 + percent) / 8, __ATOMIC_RELAXED);
+        if (n < 0) {
+            if (nullptr != out) {
+                allocator->Free(out);
+            }
+            return msg;
+        }
+
+        std::memcpy(out->payload, &length, sizeof(length));
+        out->Type(msg->Type());
+        out->Flags(msg->Flags() | MESSAGE::FLAGS_COMPRESSED);
+        out->session = msg->session;
+        out->PayloadLength(sizeof(length) + n);
+        out->Source(msg->Source());
+        out->Target(msg->Target());
+        out->Priority(msg->Priority());
+        return out;
+    }
+
+    //  为一个将要投递的消息占用发送队列的容量, 超过上限时不占用并返回 false.
+    //  PRIORITY_CONTROL 的消息只占用容量、不受上限限制, 不会因为大块数据占满队列而无法发送
+    bool Admit(chan_t* chan, int64_t bytes, uint8_t prio)
+    {
+        int32_t maxMsgs = __atomic_load_n(&(chan->maxMsgs), __ATOMIC_RELAXED);
+        int64_t maxBytes = __atomic_load_n(&(chan->maxBytes), __ATOMIC_RELAXED);
+        int32_t msgs = __atomic_add_fetch(&(chan->qmsgs), 1, __ATOMIC_SEQ_CST);
+        int64_t total = __atomic_add_fetch(&(chan->qbytes), bytes, __ATOMIC_SEQ_CST);
+        if ((msgs > 1) && (MESSAGE::PRIORITY_CONTROL != prio) && (((maxMsgs > 0) && (msgs > maxMsgs)) || ((maxBytes > 0) && (total > maxBytes)))) {
+            Unadmit(chan, bytes);
+            return false;
+        }
+        return true;
+    }
+
+    inline void Unadmit(chan_t* chan, int64_t bytes)
+    {
+        __atomic_sub_fetch(&(chan->qmsgs), 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&(chan->qbytes), bytes, __ATOMIC_SEQ_CST);
+    }
+
+    //  在通道所属的事件循环中将消息加入发送队列
+    void PostLocal(MESSAGE* msg)
+    {
+        chan_t* chan = FindChan(BufferOf(msg)->target);
+        Enqueue(chan, BufferOf(msg));
+        KickChan(chan);
+    }
+
+    void Enqueue(chan_t* chan, BUFFER* buf)
+    {
+        stream_t* pinned = PinnedStream(chan, buf);
+        if (nullptr != pinned) {
+            pinned->wlarge.push_back(buf);
+        } else {
+            chan->qsend[buf->prio].push_back(buf);
+        }
+        chan->size++;
+
+        int64_t bytes = __atomic_load_n(&(chan->qbytes), __ATOMIC_RELAXED);
+        {
+            SeqCounter<CHAN_COUNTER_MAX>::Update u(chan->stats);
+            u.Set(CHAN_QUEUE_DEPTH, chan->size);
+            u.Max(CHAN_QUEUE_HIGH, chan->size);
+            u.Set(CHAN_QUEUE_BYTES, bytes);
+        }
+
+        if ((0 == chan->above) && (chan->highBytes > 0) && (bytes >= chan->highBytes)) {
+            chan->above = 1;
+            NotifyWatermark(chan->target, true, std::integral_constant<bool, HasHandleWatermark<DISPATCHER>::value>());
+        }
+    }
+
+    inline bool SendEmpty(const chan_t* chan) const
+    {
+        for (int32_t i = 0; i < MESSAGE::PRIORITY_COUNT; i++) {
+            if (!chan->qsend[i].empty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //  下一个要发送的消息(不取出): 严格优先的队列按优先级顺序先发送; 其余队列按配额轮转(deficit round robin),
+    //  轮到的队列加一次配额, 队首消息不超过累积的配额时发送, 否则轮到下一个队列.
+    //  只有一个按权重调度的队列不空时直接发送它的队首
+    //  STRIPE_ORDERED 时按 session 分配到第一个流以外的流的消息直接放入该流的 wlarge, 其他消息返回空
+    stream_t* PinnedStream(chan_t* chan, BUFFER* buf)
+    {
+        if ((STRIPE_ORDERED != stripeMode) || (0 == chan->nstripes) || (nullptr != chan->shmtx) ||
+            (MESSAGE::PRIORITY_CONTROL == buf->prio)) {
+            return nullptr;
+        }
+        uint32_t session = WireOf(buf)->session;
+        if (0 == session) {
+            return nullptr;
+        }
+        int32_t index = int32_t(session % uint32_t(StreamsOf(chan)));
+        return (0 == index) ? nullptr : chan->stripes[index - 1];
+    }
+
+    //  通道已经认证的流数, StreamOf(chan, 0) 是 chan->stream
+    static inline int32_t StreamsOf(const chan_t* chan)
+    {
+        return (nullptr == chan->stream) ? 0 : (1 + chan->nstripes);
+    }
+
+    static inline stream_t* StreamOf(const chan_t* chan, int32_t index)
+    {
+        return (0 == index) ? chan->stream : chan->stripes[index - 1];
+    }
+
+    BUFFER* NextSend(chan_t* chan)
+    {
+        int32_t active = 0;
+        int32_t last = 0;
+        for (int32_t i = 0; i < MESSAGE::PRIORITY_COUNT; i++) {
+            if (chan->qsend[i].empty()) {
+                continue;
+            }
+            if (0 == quantum[i]) {
+                return (BUFFER*)(chan->qsend[i].next);
+            }
+            active++;
+            last = i;
+        }
+
+        if (active <= 1) {
+            return (active > 0) ? (BUFFER*)(chan->qsend[last].next) : nullptr;
+        }
+
+        for (;;) {
+            int32_t lane = chan->drr;
+            if ((0 != quantum[lane]) && !chan->qsend[lane].empty()) {
+                if (0 == chan->credited) {
+                    chan->deficit[lane] += quantum[lane];
+                    chan->credited = 1;
+                }
+                BUFFER* buf = (BUFFER*)(chan->qsend[lane].next);
+                if (SendSize(chan, buf) <= chan->deficit[lane]) {
+                    return buf;
+                }
+            } else {
+                chan->deficit[lane] = 0;
+            }
+            chan->drr = (lane + 1) % MESSAGE::PRIORITY_COUNT;
+            chan->credited = 0;
+        }
+    }
+
+    //  队首消息下一次写出的字节数: 大消息按一个分片计算
+    inline int32_t SendSize(const chan_t* chan, BUFFER* buf)
+    {
+        int32_t total = WireOf(buf)->TotalLength();
+        if (total <= fragBytes) {
+            return total;
+        }
+        return FRAG_HEAD + std::min(fragBytes, total - chan->fsent[buf->prio]);
+    }
+
+    //  从队列 lane 的配额中扣除已经写出的字节数
+    inline void Charge(chan_t* chan, int32_t lane, int32_t bytes)
+    {
+        if (0 != quantum[lane]) {
+            chan->deficit[lane] = std::max(0, chan->deficit[lane] - bytes);
+        }
+    }
+
+    //  从发送队列中取出 NextSend 返回的消息
+    void PopSend(chan_t* chan, BUFFER* buf)
+    {
+        int32_t lane = buf->prio;
+        Q_ASSERT(chan->qsend[lane].next == buf);
+        chan->qsend[lane].pop_front();
+        chan->fsent[lane] = 0;
+        if (chan->qsend[lane].empty()) {
+            chan->deficit[lane] = 0;
+            if (chan->drr == lane) {
+                chan->drr = (lane + 1) % MESSAGE::PRIORITY_COUNT;
+                chan->credited = 0;
+            }
+        }
+    }
+
+    //  消息已经从通道发送队列中取出, 交给了流或者共享内存环: 释放它占用的发送队列容量
+    void Dequeued(chan_t* chan, MESSAGE* msg)
+    {
+        chan->size--;
+
+        __atomic_sub_fetch(&(chan->qmsgs), 1, __ATOMIC_SEQ_CST);
+        int64_t bytes = __atomic_sub_fetch(&(chan->qbytes), int64_t(msg->TotalLength()), __ATOMIC_SEQ_CST);
+        {
+            SeqCounter<CHAN_COUNTER_MAX>::Update u(chan->stats);
+            u.Add(CHAN_MSGS_OUT, 1);
+            u.Add(CHAN_BYTES_OUT, msg->TotalLength());
+            u.Set(CHAN_QUEUE_DEPTH, chan->size);
+            u.Set(CHAN_QUEUE_BYTES, bytes);
+        }
+
+        //  加锁后再通知, 避免错过正在检查容量、还没有开始等待的线程
+        if (0 != __atomic_load_n(&(chan->waiters), __ATOMIC_SEQ_CST)) {
+            std::lock_guard<std::mutex> guard(waitLock);
+            waitCond.notify_all();
+        }
+
+        if ((0 != chan->above) && (bytes <= chan->lowBytes)) {
+            chan->above = 0;
+            NotifyWatermark(chan->target, false, std::integral_constant<bool, HasHandleWatermark<DISPATCHER>::value>());
+        }
+    }
+
+    void NotifyWatermark(uint16_t target, bool high, std::true_type)
+    {
+        this->dispatcher->HandleWatermark(target, high);
+    }
+
+    void NotifyWatermark(uint16_t, bool, std::false_type)
+    {
+    }
+
+    //  通道发送队列中有了新消息: 写入共享内存环, 或者在写丢失状态时重启写操作
+    void KickChan(chan_t* chan)
+    {
+        if (nullptr != chan->shmtx) {
+            FlushShm(chan);
+            return;
+        }
+
+        for (int32_t i = 0; i < StreamsOf(chan); i++) {
+            stream_t* stream = StreamOf(chan, i);
+            if (stream->wloss) {
+                async_write(stream, nullptr);
+            }
+        }
+    }
+
+    //  处理提交队列: 先把整批消息放入各自通道的发送队列, 再统一重启写操作,
+    //  这样一批消息可以合并到同一次聚合写中
+    void DrainSubmit(loop_t* loop)
+    {
+        NODE list;
+        loop->qsubmit.PopAll(&list);
+
+        NODE* node = nullptr;
+        while (nullptr != (node = list.pop_front())) {
+            BUFFER* buf = (BUFFER*)node;
+            chan_t* chan = FindChan(buf->target);
+            Enqueue(chan, buf);
+            if (chan->empty()) {
+                loop->kicks.push_back(chan);
+            }
+        }
+
+        while (nullptr != (node = loop->kicks.pop_front())) {
+            chan_t* chan = (chan_t*)node;
+            chan->next = chan;
+            chan->prev = chan;
+            KickChan(chan);
+        }
+    }
+
+    //  所有有过流量的通道的计数器快照, 可以在任意线程中调用
+    void SnapshotChans(std::vector<SMQChanStats>& out) const
+    {
+        out.clear();
+        chans.ForEach([&out](uint16_t target, chan_t* const* slot) {
+            const chan_t* chan = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+            if (nullptr == chan) {
+                return;
+            }
+            SMQChanStats stats;
+            stats.target = target;
+            chan->stats.Snapshot(stats.counters);
+            if ((0 != stats.counters[CHAN_MSGS_OUT]) || (0 != stats.counters[CHAN_MSGS_IN]) ||
+                (0 != stats.counters[CHAN_QUEUE_HIGH])) {
+                out.push_back(stats);
+            }
+        });
+    }
+
+    //  所有流的计数器快照, 可以在任意线程中调用
+    void SnapshotStreams(std::vector<SMQStreamStats>& out) const
+    {
+        out.clear();
+        std::lock_guard<std::mutex> guard(streamsLock);
+        for (auto stream : streams) {
+            SMQStreamStats stats;
+            stats.stream = stream;
+            stream->stats.Snapshot(stats.counters);
+            out.push_back(stats);
+        }
+    }
+
+    //  为处理提交队列唤醒事件循环的总次数
+    uint64_t GetWakeups() const
+    {
+        uint64_t wakeups = 0;
+        for (auto loop : loops) {
+            wakeups += loop->wakeups.load(std::memory_order_relaxed);
+        }
+        return wakeups;
+    }
+
+    //  运行所有事件循环: 第一个事件循环在调用者线程中运行, 其余的各自启动一个线程.
+    //  其余的事件循环在第一个事件循环结束之前一直保持运行(流随时可能迁移过来);
+    //  第一个事件循环没有事情可做而返回后, 它们在处理完各自剩下的事件后也返回, 之后 Loop 返回.
+    //  需要立即结束时调用 Stop
+    void Loop()
+    {
+        loops[0]->work.reset();
+        for (size_t i = 1; i < loops.size(); i++) {
+            loop_t* loop = loops[i];
+            loop->thread = std::thread([this, loop]() { RunLoop(loop); });
+        }
+
+        RunLoop(loops[0]);
+
+        for (size_t i = 1; i < loops.size(); i++) {
+            loops[i]->work.reset();
+        }
+        for (size_t i = 1; i < loops.size(); i++) {
+            if (loops[i]->thread.joinable()) {
+                loops[i]->thread.join();
+            }
+        }
+    }
+
+    //  停止所有事件循环, 还在等待回复的 RPC 调用以 RPC_CANCELED 结束
+    void Stop()
+    {
+        for (auto loop : loops) {
+            loop->work.reset();
+            loop->context.stop();
+        }
+        ExpireRpc(INT64_MAX, RPC_CANCELED);
+    }
+
+public:
+    void HandleConnectResult(stream_t* stream, const system::error_code& err, asio::ip::tcp::endpoint ep)
+    {
+        if (err) {
+            TRACE_WARN(TRACE_CONNECT_FAILED, stream, err.value());
+            ArmTimer(stream->loop, &(stream->retry), RECONNECT_MS);
+            return;
+        }
+        TRACE_INFO(TRACE_CONNECTED, stream);
+
+        stream->loop->wheel.Cancel(&(stream->retry));
+
+        SetSocketOptions(stream);
+        UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_CONNECTED);
+
+        ResetRead(stream);
+        stream->conn = ++connSeq;
+        stream->wfrag = 0;
+        async_read(stream);
+    }
+
+    void HandleAcceptResult(asio::ip::tcp::acceptor* a, const system::error_code& err, asio::ip::tcp::socket sock)
+    {
+        if (err) {
+            TRACE_ERROR(TRACE_ACCEPT_FAILED, err.value());
+            return;
+        }
+
+        std::string saddr;
+        system::error_code ec;
+        auto endpoint = sock.remote_endpoint(ec);
+        if (!ec) {
+            saddr = str_of(endpoint);
+        }
+
+        auto stream = new stream_t(this, loops[0], std::move(sock), saddr, ATTR_STREAM_TYPE_PASSIVES);
+        TRACE_INFO(TRACE_ACCEPTED, stream);
+
+        SetSocketOptions(stream);
+        padding.push_back(stream);
+        this->HandleEvent(stream, EVENT_CONN_INITED, 0, 0);
+
+        async_read(stream);
+
+        //  accept others connections
         acceptor->async_accept([this](const system::error_code& ec, asio::ip::tcp::socket sock) {
             HandleAcceptResult(this->acceptor, ec, std::move(sock));
         });
     }
 
-    void HandleReadResult(stream_t* stream, const system::error_code& err, std::size_t length)
+    void HandleReadResult(stream_t* stream, const system::error_code& err, std::size_t length)
+    {
+        if ((asio::error::eof == err) || (asio::error::connection_reset == err)) {
+            TRACE_INFO(TRACE_READ_FAILED, stream, stream->target, err.value());
+            UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_DISCONNECTED);
+            return;
+        }
+
+        if (err) {
+            TRACE_INFO(TRACE_READ_FAILED, stream, stream->target, err.value());
+            UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_DISCONNECTED);
+            return;
+        }
+        TRACE_DEBUG(TRACE_READ_DONE, stream, stream->target, length);
+        stream->ridle = 0;
+
+        {
+            SeqCounter<STREAM_COUNTER_MAX>::Update u(stream->stats);
+            u.Add(STREAM_BYTES_IN, length);
+            u.Add(STREAM_READS, 1);
+        }
+
+        //  分片的剩余数据已经直接读入重组的消息
+        if (nullptr != stream->rdst) {
+            stream->rdst = nullptr;
+            stream->rdstLen = 0;
+            if (!EndFrag(stream)) {
+                return;
+            }
+            async_read(stream);
+            return;
+        }
+
+        //  超大消息的剩余部分已经直接读入消息体
+        if (nullptr != stream->rcur) {
+            MESSAGE* msg = stream->rcur;
+            stream->rcur = nullptr;
+            stream->rcurLen = 0;
+            if (!DispatchMessage(stream, msg)) {
+                return;
+            }
+            async_read(stream);
+            return;
+        }
+
+        stream->rend += length;
+        ParseRead(stream);
+    }
+
+    //  解析出接收缓冲区中所有完整的消息, 然后继续接收
+    void ParseRead(stream_t* stream)
+    {
+        while ((stream->rend - stream->rbegin) >= int32_t(sizeof(MESSAGE))) {
+            MESSAGE head;
+            std::memcpy(&head, stream->rring + stream->rbegin, sizeof(head));
+            int32_t total = head.FrameLength();
+            int32_t avail = stream->rend - stream->rbegin;
+            if ((total < int32_t(sizeof(MESSAGE))) || (total >= int32_t(MESSAGE::TOTAL_LENGTH_MAX))) {
+                TRACE_ERROR(TRACE_INVALID_LENGTH, stream, stream->target, total);
+                CloseSocket(stream);
+                return;
+            }
+
+            if (MESSAGE::TYPE_FRAG == head.Type()) {
+                int32_t ret = ParseFrag(stream, total, avail);
+                if (ret < 0) {
+                    return;
+                }
+                if (0 == ret) {
+                    break;
+                }
+                continue;
+            }
+
+            if (total > maxMessage) {
+                TRACE_ERROR(TRACE_INVALID_LENGTH, stream, stream->target, total);
+                CloseSocket(stream);
+                return;
+            }
+
+            if (total > avail) {
+                //  消息比接收缓冲区还大: 拷贝已收到的部分, 剩余部分直接读入消息体
+                if (total > stream->rsize) {
+                    MESSAGE* msg = allocator->Alloc(total - sizeof(MESSAGE));
+                    if (nullptr == msg) {
+                        //  无法跳过剩余的数据, 只能断开连接
+                        CountAllocFailure(stream);
+                        CloseSocket(stream);
+                        return;
+                    }
+                    std::memcpy(msg, stream->rring + stream->rbegin, avail);
+                    stream->rcur = msg;
+                    stream->rcurLen = avail;
+                    stream->rbegin = 0;
+                    stream->rend = 0;
+                }
+                break;
+            }
+
+            MESSAGE* msg = allocator->Alloc(total - sizeof(MESSAGE));
+            if (nullptr == msg) {
+                //  丢弃这条消息
+                CountAllocFailure(stream);
+                stream->rbegin += total;
+                continue;
+            }
+            std::memcpy(msg, stream->rring + stream->rbegin, total);
+            stream->rbegin += total;
+            if (!DispatchMessage(stream, msg)) {
+                return;
+            }
+        }
+
+        async_read(stream);
+    }
+
+    //  处理接收缓冲区头部的一个分片: 数据拷贝到重组的消息中, 完整时交给协议层处理.
+    //  返回 1 表示继续解析, 0 表示需要接收更多数据, -1 表示停止读取
+    int32_t ParseFrag(stream_t* stream, int32_t total, int32_t avail)
+    {
+        const uint8_t* frame = stream->rring + stream->rbegin;
+        if (total < int32_t(FRAG_HEAD)) {
+            TRACE_ERROR(TRACE_INVALID_LENGTH, stream, stream->target, total);
+            CloseSocket(stream);
+            return -1;
+        }
+
+        if (total > avail) {
+            if ((total <= stream->rsize) || (avail < int32_t(FRAG_HEAD))) {
+                return 0;
+            }
+            //  分片比接收缓冲区还大: 已收到的数据拷贝进重组的消息, 剩余数据直接读入
+            uint8_t* dst = BeginFrag(stream, frame, total);
+            if (nullptr == dst) {
+                CloseSocket(stream);
+                return -1;
+            }
+            std::memcpy(dst, frame + FRAG_HEAD, avail - FRAG_HEAD);
+            stream->rdst = dst + (avail - FRAG_HEAD);
+            stream->rdstLen = total - avail;
+            stream->rbegin = 0;
+            stream->rend = 0;
+            return 0;
+        }
+
+        uint8_t* dst = BeginFrag(stream, frame, total);
+        if (nullptr == dst) {
+            CloseSocket(stream);
+            return -1;
+        }
+        std::memcpy(dst, frame + FRAG_HEAD, total - FRAG_HEAD);
+        stream->rbegin += total;
+        return EndFrag(stream) ? 1 : -1;
+    }
+
+    //  校验分片头, 返回分片数据在重组的消息中的位置; 分片不合法或者分配失败时返回空
+    uint8_t* BeginFrag(stream_t* stream, const uint8_t* frame, int32_t total)
+    {
+        FRAGHEAD frag;
+        std::memcpy(&frag, frame + sizeof(MESSAGE), sizeof(frag));
+        uint32_t len = uint32_t(total - FRAG_HEAD);
+        if ((frag.slot >= FRAG_SLOTS) || (frag.total < sizeof(MESSAGE)) || (frag.total > uint32_t(maxMessage)) ||
+            (frag.offset > frag.total) || (len > frag.total - frag.offset)) {
+            TRACE_ERROR(TRACE_INVALID_FRAG, stream, stream->target, frag.total, frag.offset);
+            return nullptr;
+        }
+
+        int32_t slot = frag.slot;
+        if (0 == frag.offset) {
+            //  发送方从头重新发送(例如改为通过共享内存通道发送时), 丢弃没有完成的消息
+            if (nullptr != stream->rfrag[slot]) {
+                allocator->Free(stream->rfrag[slot]);
+            }
+            stream->rfrag[slot] = allocator->Alloc(int32_t(frag.total - sizeof(MESSAGE)));
+            if (nullptr == stream->rfrag[slot]) {
+                CountAllocFailure(stream);
+                return nullptr;
+            }
+            stream->rfragTotal[slot] = int32_t(frag.total);
+            stream->rfragNext[slot] = 0;
+        } else if ((nullptr == stream->rfrag[slot]) || (int32_t(frag.total) != stream->rfragTotal[slot]) ||
+                   (int32_t(frag.offset) != stream->rfragNext[slot])) {
+            TRACE_ERROR(TRACE_INVALID_FRAG, stream, stream->target, frag.total, frag.offset);
+            return nullptr;
+        }
+
+        stream->rfragNext[slot] += int32_t(len);
+        stream->rslot = slot;
+        return (uint8_t*)(stream->rfrag[slot]) + frag.offset;
+    }
+
+    //  最近一个分片的数据已经全部收到: 消息完整时交给协议层处理, 返回是否继续读取
+    bool EndFrag(stream_t* stream)
+    {
+        int32_t slot = stream->rslot;
+        if (stream->rfragNext[slot] < stream->rfragTotal[slot]) {
+            return true;
+        }
+
+        MESSAGE* msg = stream->rfrag[slot];
+        stream->rfrag[slot] = nullptr;
+        //  消息头来自第一个分片, 长度以分片头为准
+        msg->TotalLength(stream->rfragTotal[slot]);
+        if (MESSAGE::TYPE_FRAG == msg->Type()) {
+            TRACE_ERROR(TRACE_INVALID_FRAG, stream, stream->target, stream->rfragTotal[slot], 0);
+            allocator->Free(msg);
+            CloseSocket(stream);
+            return false;
+        }
+        return DispatchMessage(stream, msg);
+    }
+
+    //  将收到的完整消息交给协议层处理, 返回是否继续读取
+    bool DispatchMessage(stream_t* stream, MESSAGE* msg)
+    {
+        if (nullptr != stream->chan) {
+            SeqCounter<CHAN_COUNTER_MAX>::Update u(stream->chan->stats);
+            u.Add(CHAN_MSGS_IN, 1);
+            u.Add(CHAN_BYTES_IN, msg->TotalLength());
+        }
+
+        int32_t action = this->HandleMessage((void*)stream, msg);
+        switch (action) {
+            case ACTION_NONE:
+                return true;
+            case ACTION_DISCONNECT:
+                CloseSocket(stream);
+                return false;
+            case ACTION_RECONNECT:
+                CloseSocket(stream);
+                async_connect(stream);
+                return false;
+            case ACTION_MIGRATE:
+                stream->rpend = msg;
+                if (stream->wloss) {
+                    MigrateStream(stream);
+                }
+                //  否则等待当前写操作完成后再迁移
+                return false;
+        }
+        return true;
+    }
+
+    //  将流迁移到 stream->rehome 所指的事件循环: 调用时流上不能有未完成的异步操作
+    void MigrateStream(stream_t* stream)
+    {
+        loop_t* loop = stream->rehome;
+        Q_ASSERT(nullptr != loop);
+
+        system::error_code ec;
+        auto protocol = stream->socket.local_endpoint(ec).protocol();
+        auto fd = stream->socket.release(ec);
+        if (ec) {
+            TRACE_ERROR(TRACE_MIGRATE_FAILED, stream, stream->target, ec.value());
+            CancelMigrate(stream);
+            UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_DISCONNECTED);
+            return;
+        }
+
+        //  定时器属于原来的事件循环的时间轮
+        stream->loop->wheel.Cancel(&(stream->retry));
+        stream->loop->wheel.Cancel(&(stream->heartbeat));
+
+        stream->rehome = nullptr;
+        stream->loop = loop;
+        asio::post(loop->context, [this, stream, protocol, fd]() {
+            stream->socket = asio::ip::tcp::socket(stream->loop->context, protocol, fd);
+
+            //  在新的事件循环中重新处理触发迁移的消息, 然后继续收发
+            MESSAGE* msg = stream->rpend;
+            stream->rpend = nullptr;
+            if (!DispatchMessage(stream, msg)) {
+                return;
+            }
+            ParseRead(stream);
+            async_write(stream, nullptr);
+        });
+    }
+
+    void CancelMigrate(stream_t* stream)
+    {
+        stream->rehome = nullptr;
+        if (nullptr != stream->rpend) {
+            allocator->Free(stream->rpend);
+            stream->rpend = nullptr;
+        }
+    }
+
+    void HandleWriteResult(stream_t* stream, const system::error_code& err, std::size_t length)
+    {
+        if ((asio::error::eof == err) || (asio::error::connection_reset == err)) {
+            TRACE_INFO(TRACE_WRITE_FAILED, stream, stream->target, err.value());
+            //  先释放这一批消息并结束写操作, 重新连接后才能继续发送
+            FreeSent(stream);
+            CancelMigrate(stream);
+            stream->wloss = true;
+            UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_DISCONNECTED);
+            return;
+        }
+
+        if (err) {
+            TRACE_INFO(TRACE_WRITE_FAILED, stream, stream->target, err.value());
+            CloseSocket(stream);
+            FreeSent(stream);
+            CancelMigrate(stream);
+            stream->wloss = true;
+            return;
+        }
+        TRACE_DEBUG(TRACE_WRITE_DONE, stream, stream->target, length);
+
+        {
+            uint64_t elapsed = NowNanos() - stream->wstart;
+            SeqCounter<STREAM_COUNTER_MAX>::Update u(stream->stats);
+            u.Add(STREAM_BYTES_OUT, length);
+            u.Add(STREAM_WRITES, 1);
+            u.Add(STREAM_WRITE_NANOS, elapsed);
+            u.Max(STREAM_WRITE_MAX_NANOS, elapsed);
+        }
+
+        //  释放已经发送完成的这一批消息, 然后继续发送后续消息
+        FreeSent(stream);
+        stream->wloss = true;
+        if (nullptr != stream->rehome) {
+            MigrateStream(stream);
+            return;
+        }
+        async_write(stream, nullptr);
+    }
+
+    //  启动异步发送: newmsg 非空时先加入流的协议消息队列;
+    //  如果当前没有正在进行的写操作, 就尽可能多地从队列中取出消息合并为一次写
+    void async_write(void* s, MESSAGE* newmsg)
+    {
+        stream_t* stream = (stream_t*)s;
+        if (nullptr != newmsg) {
+            stream->wctrl.push_back(BufferOf(newmsg));
+        }
+
+        //  已经有写操作在进行, 完成后会继续发送
+        if (!stream->wloss) {
+            return;
+        }
+
+        if (0 == GatherWrite(stream)) {
+            return;
+        }
+
+        stream->wloss = false;
+        stream->wstart = NowNanos();
+        if (0 == RingWrite(stream)) {
+            return;
+        }
+        asio::async_write(
+            stream->socket, stream->wbufs,
+            [this, stream](system::error_code ec, std::size_t len) { HandleWriteResult(stream, ec, len); });
+    }
+
+    //  从协议消息队列和通道发送队列中取出不超过写预算的消息, 返回缓冲区个数.
+    //  协议消息总是最先发送, 通道发送队列按 NextSend 的顺序. 大消息每次只取一个分片,
+    //  写出最后一个分片后才从队列中取出
+    int32_t GatherWrite(stream_t* stream)
+    {
+        Q_ASSERT(stream->wsent.empty());
+        stream->wbufs.clear();
+
+        int32_t bytes = 0;
+        while (!stream->wctrl.empty()) {
+            if (!Gather(stream, (BUFFER*)(stream->wctrl.next), &bytes)) {
+                return stream->wbufs.size();
+            }
+            stream->wsent.push_back(stream->wctrl.pop_front());
+        }
+
+        if (!GatherLarge(stream, &bytes)) {
+            return stream->wbufs.size();
+        }
+
+        //  STRIPE_ORDERED 时只有第一个流从发送队列取消息, 其他流只发送分配给它的消息
+        chan_t* chan = stream->chan;
+        if ((nullptr == chan) || (nullptr != chan->shmtx) ||
+            ((STRIPE_ORDERED == stripeMode) && (stream != chan->stream))) {
+            return stream->wbufs.size();
+        }
+
+        BUFFER* buf = nullptr;
+        while (nullptr != (buf = NextSend(chan))) {
+            int32_t lane = buf->prio;
+            MESSAGE* msg = WireOf(buf);
+            if (msg->TotalLength() > fragBytes) {
+                //  多个流同时取消息时, 大消息整个交给取到它的流, 分片不会分散到多个流上.
+                //  (增加流之前已经开始发送的大消息仍然由原来的流在发送队列中发送完)
+                bool started = (0 != chan->fsent[lane]) && (nullptr != StreamOfConn(chan, chan->fconn[lane]));
+                if ((chan->nstripes > 0) && !(started && (chan->fconn[lane] == stream->conn))) {
+                    if (started) {
+                        break;
+                    }
+                    Charge(chan, lane, msg->TotalLength());
+                    PopSend(chan, buf);
+                    stream->wlarge.push_back(buf);
+                    if (!GatherLarge(stream, &bytes)) {
+                        break;
+                    }
+                    continue;
+                }
+
+                //  上一个连接上已经发送的分片作废, 从头发送
+                if (chan->fconn[lane] != stream->conn) {
+                    chan->fsent[lane] = 0;
+                    chan->fconn[lane] = stream->conn;
+                }
+                int32_t before = bytes;
+                bool last = false;
+                if (!GatherFrag(stream, buf, &(chan->fsent[lane]), lane, &bytes, &last)) {
+                    break;
+                }
+                Charge(chan, lane, bytes - before);
+                if (!last) {
+                    continue;
+                }
+            } else {
+                if (!Gather(stream, buf, &bytes)) {
+                    break;
+                }
+                Charge(chan, lane, msg->TotalLength());
+            }
+            PopSend(chan, buf);
+            stream->wsent.push_back(buf);
+            Dequeued(chan, msg);
+        }
+
+        return stream->wbufs.size();
+    }
+
+    //  把流的 wlarge 中的消息加入本次写, 超过写预算时返回 false.
+    //  这些消息写出后才释放发送队列的容量, 否则发送方不受发送队列上限的限制
+    bool GatherLarge(stream_t* stream, int32_t* bytes)
+    {
+        while (!stream->wlarge.empty()) {
+            BUFFER* buf = (BUFFER*)(stream->wlarge.next);
+            MESSAGE* msg = WireOf(buf);
+            if (msg->TotalLength() > fragBytes) {
+                bool last = false;
+                if (!GatherFrag(stream, buf, &(stream->wfrag), FRAG_SLOT_LARGE, bytes, &last)) {
+                    return false;
+                }
+                if (!last) {
+                    continue;
+                }
+                stream->wfrag = 0;
+            } else if (!Gather(stream, buf, bytes)) {
+                return false;
+            }
+            stream->wsent.push_back(stream->wlarge.pop_front());
+            Dequeued(FindChan(buf->target), msg);
+        }
+        return true;
+    }
+
+    //  通道中连接编号为 conn 的流
+    static stream_t* StreamOfConn(const chan_t* chan, uint64_t conn)
+    {
+        for (int32_t i = 0; i < StreamsOf(chan); i++) {
+            if (StreamOf(chan, i)->conn == conn) {
+                return StreamOf(chan, i);
+            }
+        }
+        return nullptr;
+    }
+
+    //  把大消息从 *offset 开始的一个分片加入本次写: 分片头单独分配, 数据直接引用原消息.
+    //  超过写预算时返回 false; last 表示这是最后一个分片
+    bool GatherFrag(stream_t* stream, BUFFER* buf, int32_t* offset, int32_t slot, int32_t* bytes, bool* last)
+    {
+        if (int32_t(stream->wbufs.size()) + 2 > writeIovecs) {
+            return false;
+        }
+
+        MESSAGE* msg = WireOf(buf);
+        int32_t len = std::min(fragBytes, msg->TotalLength() - *offset);
+        if ((*bytes > 0) && (*bytes + FRAG_HEAD + len > writeBytes)) {
+            return false;
+        }
+
+        MESSAGE* head = allocator->Alloc(sizeof(FRAGHEAD));
+        if (nullptr == head) {
+            return false;
+        }
+        head->Type(MESSAGE::TYPE_FRAG);
+        head->session = 0;
+        head->TotalLength(FRAG_HEAD + len);
+        FRAGHEAD* frag = PayloadOf<FRAGHEAD*>(head);
+        frag->total = uint32_t(msg->TotalLength());
+        frag->offset = uint32_t(*offset);
+        frag->slot = uint8_t(slot);
+        std::memset(frag->reserved, 0, sizeof(frag->reserved));
+
+        stream->wsent.push_back(BufferOf(head));
+        stream->wbufs.push_back(asio::buffer(head, FRAG_HEAD));
+        stream->wbufs.push_back(asio::buffer((uint8_t*)msg + *offset, len));
+        *offset += len;
+        *bytes += FRAG_HEAD + len;
+        *last = (*offset == msg->TotalLength());
+        return true;
+    }
+
+    //  把一个消息加入本次写, 超过写预算时返回 false
+    bool Gather(stream_t* stream, BUFFER* buf, int32_t* bytes)
+    {
+        if (int32_t(stream->wbufs.size()) >= writeIovecs) {
+            return false;
+        }
+
+        MESSAGE* msg = WireOf(buf);
+        if ((*bytes > 0) && (*bytes + msg->TotalLength() > writeBytes)) {
+            return false;
+        }
+
+        stream->wbufs.push_back(asio::buffer(msg, msg->TotalLength()));
+        *bytes += msg->TotalLength();
+        return true;
+    }
+
+    //  释放当前这一批已发送(或发送失败)的消息
+    void FreeSent(stream_t* stream)
+    {
+        NODE* node = nullptr;
+        while (nullptr != (node = stream->wsent.pop_front())) {
+            allocator->Free(MessageOf((BUFFER*)node));
+        }
+        stream->wbufs.clear();
+    }
+
+    //  启动异步接收
+    void async_read(stream_t* stream)
+    {
+        if (nullptr != stream->rdst) {
+            if (0 == RingRead(stream, stream->rdst, stream->rdstLen, true)) {
+                return;
+            }
+            asio::async_read(stream->socket, asio::buffer(stream->rdst, stream->rdstLen),
+                             [this, stream](const system::error_code& ec, std::size_t length) {
+                                 HandleReadResult(stream, ec, length);
+                             });
+            return;
+        }
+
+        if (nullptr != stream->rcur) {
+            MESSAGE* msg = stream->rcur;
+            if (0 == RingRead(stream, (uint8_t*)msg + stream->rcurLen, msg->TotalLength() - stream->rcurLen, true)) {
+                return;
+            }
+            asio::async_read(stream->socket,
+                             asio::buffer((uint8_t*)msg + stream->rcurLen, msg->TotalLength() - stream->rcurLen),
+                             [this, stream](const system::error_code& ec, std::size_t length) {
+                                 HandleReadResult(stream, ec, length);
+                             });
+            return;
+        }
+
+        //  把不完整的消息挪到缓冲区头部, 以便腾出尽可能大的连续空间
+        if (stream->rbegin > 0) {
+            int32_t avail = stream->rend - stream->rbegin;
+            if (avail > 0) {
+                std::memmove(stream->rring, stream->rring + stream->rbegin, avail);
+            }
+            stream->rbegin = 0;
+            stream->rend = avail;
+        }
+
+        if (0 == RingRead(stream, stream->rring + stream->rend, stream->rsize - stream->rend, false)) {
+            return;
+        }
+        stream->socket.async_read_some(asio::buffer(stream->rring + stream->rend, stream->rsize - stream->rend),
+                                       [this, stream](const system::error_code& ec, std::size_t length) {
+                                           HandleReadResult(stream, ec, length);
+                                       });
+    }
+
+    //  重新建立连接后丢弃上一个连接残留的接收数据和没有重组完成的消息
+    void ResetRead(stream_t* stream)
+    {
+        if (nullptr != stream->rcur) {
+            allocator->Free(stream->rcur);
+            stream->rcur = nullptr;
+        }
+        stream->rcurLen = 0;
+        for (int32_t i = 0; i < FRAG_SLOTS; i++) {
+            if (nullptr != stream->rfrag[i]) {
+                allocator->Free(stream->rfrag[i]);
+                stream->rfrag[i] = nullptr;
+            }
+        }
+        stream->rdst = nullptr;
+        stream->rdstLen = 0;
+        stream->rbegin = 0;
+        stream->rend = 0;
+    }
+
+    //  关闭流的 socket. io_uring 上没有完成的读写持有 socket 的引用, 只关闭描述符不会使它们结束,
+    //  所以先 shutdown: 读立即以对端关闭结束, 写以 EPIPE 结束, 之后都不会再访问缓冲区
+    void CloseSocket(stream_t* stream)
+    {
+        if ((IO_URING == ioBackend) && stream->socket.is_open()) {
+            ::shutdown(stream->socket.native_handle(), SHUT_RDWR);
+        }
+        system::error_code ec;
+        stream->socket.close(ec);
+    }
+
+    enum : uint64_t {
+        URING_READ = 1,  //  user_data 的低 2 位: 操作类型, 其余是 stream_t 的地址
+        URING_WRITE = 2,
+        URING_OP_MASK = 3,
+    };
+
+    //  IO_URING 时事件循环的 io_uring, 第一次用到时在事件循环中创建; 使用 asio 收发时返回空
+    UringQueue* RingOf(loop_t* loop)
+    {
+        if ((IO_URING != ioBackend) || loop->ufailed) {
+            return nullptr;
+        }
+        if (nullptr != loop->uring) {
+            return loop->uring;
+        }
+
+        UringQueue* ring = new UringQueue();
+        int efd = -1;
+        if ((0 != ring->Init(URING_ENTRIES)) || ((efd = ring->Notify()) < 0)) {
+            delete ring;
+            loop->ufailed = true;
+            return nullptr;
+        }
+        loop->uring = ring;
+        loop->unotify = new asio::posix::stream_descriptor(loop->context, efd);
+        WaitRing(loop);
+        return ring;
+    }
+
+    void WaitRing(loop_t* loop)
+    {
+        loop->unotify->async_wait(asio::posix::stream_descriptor::wait_read, [this, loop](const system::error_code& ec) {
+            if (!ec) {
+                ReapRing(loop);
+            }
+        });
+    }
+
+    //  处理 uring 的所有完成事件, 其间发起的读写最后一次提交. 忙轮询时直接调用 DrainRing
+    void ReapRing(loop_t* loop)
+    {
+        //  先重新等待再处理, 处理期间产生的完成事件不会丢失
+        WaitRing(loop);
+        uint64_t signaled = 0;
+        if (::read(loop->unotify->native_handle(), &signaled, sizeof(signaled)) < 0) {
+            signaled = 0;
+        }
+
+        DrainRing(loop);
+    }
+
+    void DrainRing(loop_t* loop)
+    {
+        bool scheduled = loop->uflush;
+        loop->uflush = true;
+        loop->uring->Reap([this](uint64_t data, int32_t res) {
+            stream_t* stream = (stream_t*)uintptr_t(data & ~uint64_t(URING_OP_MASK));
+            if (URING_READ == (data & URING_OP_MASK)) {
+                HandleRingRead(stream, res);
+            } else {
+                HandleRingWrite(stream, res);
+            }
+        });
+        if (!scheduled) {
+            loop->uflush = false;
+        }
+        loop->uring->Submit();
+    }
+
+    //  准备好的请求在当前这批事件处理完之后一起提交, 多个流的读写合并为一次系统调用
+    void FlushRing(loop_t* loop)
+    {
+        if (loop->uflush) {
+            return;
+        }
+        loop->uflush = true;
+        asio::post(loop->context, [loop]() {
+            loop->uflush = false;
+            loop->uring->Submit();
+        });
+    }
+
+    //  通过 io_uring 读入 buf: all 为真时读满 len 字节才完成, 否则读到一些就完成, 结果都交给 HandleReadResult.
+    //  不使用 io_uring 时返回 -1, 由调用者使用 asio
+    int RingRead(stream_t* stream, uint8_t* buf, int32_t len, bool all)
+    {
+        UringQueue* ring = RingOf(stream->loop);
+        if (nullptr == ring) {
+            return -1;
+        }
+
+        stream->ubuf = buf;
+        stream->ulen = len;
+        stream->ugot = 0;
+        stream->uall = all;
+        if (!ring->PrepRecv(stream->socket.native_handle(), buf, uint32_t(len), uint64_t(uintptr_t(stream)) | URING_READ)) {
+            return -1;
+        }
+        stream->uread++;
+        FlushRing(stream->loop);
+        return 0;
+    }
+
+    void HandleRingRead(stream_t* stream, int32_t res)
+    {
+        //  重新连接之前发起的读(关闭 socket 时已经结束), 缓冲区已经交给了之后的读操作
+        if (stream->uread > 1) {
+            stream->uread--;
+            return;
+        }
+        stream->uread = 0;
+
+        if (res <= 0) {
+            HandleReadResult(stream, ErrorOf(res), stream->ugot);
+            return;
+        }
+
+        stream->ugot += res;
+        if (stream->uall && (stream->ugot < stream->ulen)) {
+            UringQueue* ring = stream->loop->uring;
+            if (!ring->PrepRecv(stream->socket.native_handle(), stream->ubuf + stream->ugot,
+                                uint32_t(stream->ulen - stream->ugot), uint64_t(uintptr_t(stream)) | URING_READ)) {
+                HandleReadResult(stream, asio::error::no_buffer_space, stream->ugot);
+                return;
+            }
+            stream->uread = 1;
+            return;
+        }
+        HandleReadResult(stream, system::error_code(), stream->ugot);
+    }
+
+    //  通过 io_uring 发送 wbufs, 一次 sendmsg 写出整批消息, 写完后交给 HandleWriteResult.
+    //  不使用 io_uring 时返回 -1, 由调用者使用 asio
+    int RingWrite(stream_t* stream)
+    {
+        UringQueue* ring = RingOf(stream->loop);
+        if (nullptr == ring) {
+            return -1;
+        }
+
+        size_t count = stream->wbufs.size();
+        stream->uiov.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            stream->uiov[i].iov_base = const_cast<void*>(stream->wbufs[i].data());
+            stream->uiov[i].iov_len = stream->wbufs[i].size();
+        }
+        std::memset(&(stream->umsg), 0, sizeof(stream->umsg));
+        stream->umsg.msg_iov = stream->uiov.data();
+        stream->umsg.msg_iovlen = count;
+        stream->usent = 0;
+        if (!ring->PrepSendmsg(stream->socket.native_handle(), &(stream->umsg), uint64_t(uintptr_t(stream)) | URING_WRITE)) {
+            return -1;
+        }
+        FlushRing(stream->loop);
+        return 0;
+    }
+
+    void HandleRingWrite(stream_t* stream, int32_t res)
+    {
+        if (res <= 0) {
+            HandleWriteResult(stream, ErrorOf(res), stream->usent);
+            return;
+        }
+
+        //  只写出了一部分: 跳过已经写出的缓冲区, 继续发送剩余的部分
+        stream->usent += res;
+        struct msghdr* msg = &(stream->umsg);
+        size_t done = size_t(res);
+        while ((msg->msg_iovlen > 0) && (done >= msg->msg_iov->iov_len)) {
+            done -= msg->msg_iov->iov_len;
+            msg->msg_iov++;
+            msg->msg_iovlen--;
+        }
+        if (0 == msg->msg_iovlen) {
+            HandleWriteResult(stream, system::error_code(), stream->usent);
+            return;
+        }
+
+        msg->msg_iov->iov_base = (uint8_t*)(msg->msg_iov->iov_base) + done;
+        msg->msg_iov->iov_len -= done;
+        if (!stream->loop->uring->PrepSendmsg(stream->socket.native_handle(), msg,
+                                             uint64_t(uintptr_t(stream)) | URING_WRITE)) {
+            HandleWriteResult(stream, asio::error::no_buffer_space, stream->usent);
+        }
+    }
+
+    //  io_uring 完成事件的结果转换为 asio 的错误码: 0 字节表示对端已经关闭, 负数是 -errno
+    static system::error_code ErrorOf(int32_t res)
+    {
+        if (0 == res) {
+            return asio::error::eof;
+        }
+        return system::error_code(-res, asio::error::get_system_category());
+    }
+
+    void async_connect(stream_t* stream)
+    {
+        {
+            SeqCounter<STREAM_COUNTER_MAX>::Update u(stream->stats);
+            u.Add(STREAM_RECONNECTS, 1);
+        }
+
+        system::error_code ec;
+        auto endpoints = resolve_of(stream->loop->context, stream->targetAddr, ec);
+
+        this->HandleEvent(stream, EVENT_CONN_INITED, 0, 0);
+
+        UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_CONNECTING);
+        //  暂时无法解析(例如 DNS 不可用)时按连接失败处理, 稍后重试
+        if (ec) {
+            HandleConnectResult(stream, ec, asio::ip::tcp::endpoint());
+            return;
+        }
+
+        asio::async_connect(stream->socket, endpoints,
+                            [this, stream](const system::error_code& ec, asio::ip::tcp::endpoint ep) {
+                                HandleConnectResult(stream, ec, ep);
+                            });
+    }
+
+    void CountAllocFailure(stream_t* stream)
     {
-        if ((asio::error::eof == err) || (asio::error::connection_reset == err)) {
-            debug(stream, "HandleReadResult failed:%d: %s", err.value(), err.message().c_str());  // TODO 错误码是啥
-            UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_DISCONNECTED);
+        SeqCounter<STREAM_COUNTER_MAX>::Update u(stream->stats);
+        u.Add(STREAM_ALLOC_FAILURES, 1);
+    }
+
+    static inline uint64_t NowNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static inline uint64_t NowMillis()
+    {
+        return NowNanos() / 1000000;
+    }
+
+    void AddStream(stream_t* stream)
+    {
+        std::lock_guard<std::mutex> guard(streamsLock);
+        streams.push_back(stream);
+    }
+
+    void RemoveStream(stream_t* stream)
+    {
+        std::lock_guard<std::mutex> guard(streamsLock);
+        for (size_t i = 0; i < streams.size(); i++) {
+            if (streams[i] == stream) {
+                streams[i] = streams.back();
+                streams.pop_back();
+                break;
+            }
+        }
+    }
+
+    //  发送路径已经自行合并消息, 关闭 Nagle 以免小消息(如共享内存通知)被延迟.
+    //  同时按 SetPolling 设置 SO_BUSY_POLL(没有权限或者内核不支持时忽略)
+    void SetSocketOptions(stream_t* stream)
+    {
+        system::error_code ec;
+        stream->socket.set_option(asio::ip::tcp::no_delay(true), ec);
+#if defined(SO_BUSY_POLL)
+        if (busyPollMicros > 0) {
+            int value = busyPollMicros;
+            ::setsockopt(stream->socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value));
+        }
+#endif
+    }
+
+    static int32_t SlotsOfShm(int32_t bytes)
+    {
+        if (bytes <= 0) {
+            return 0;
+        }
+
+        int32_t slots = 1024;
+        while ((slots * 2) <= (bytes / ShmRing::SLOT_SIZE)) {
+            slots *= 2;
+        }
+        return slots;
+    }
+
+    //  [发起方] 认证完成后, 如果对端在本机, 创建共享内存并请求对端映射
+    void OfferShm(void* s)
+    {
+        stream_t* stream = (stream_t*)s;
+        chan_t* chan = stream->chan;
+        if ((0 == shmSlots) || (nullptr == chan) || (nullptr != chan->shm)) {
             return;
         }
 
-        if (err) {
-            debug(stream, "HandleReadResult failed:%d: %s", err.value(), err.message().c_str());  // TODO 错误码是啥
-            UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_DISCONNECTED);
+        if (!IsLocalPeer(stream)) {
             return;
         }
-        debug(stream, "HandleReadResult success");
 
-        if (stream->rhead) {
-            uint32_t rcurLen = stream->rbuf.TotalLength();
-            auto oldrcur = stream->rcur;
-            auto newrcur = allocator->Alloc(rcurLen);
-            newrcur->FillHeader(stream->rbuf);
-            stream->rcur = newrcur;
+        char name[48] = {0};
+        snprintf(name, sizeof(name), "%s%d-%u-%u-%u", ShmPrefix(), int(getpid()), this->source, stream->target,
+                 shmSeq.fetch_add(1));
 
-            stream->rhead = false;
-            async_read(stream);
+        shm_t* shm = new shm_t();
+        shm->name = name;
+        if (0 != shm->region.Create(shm->name, 2 * ShmRing::Footprint(shmSlots))) {
+            TRACE_WARN(TRACE_SHM_CREATE_FAILED, stream, stream->target, errno);
+            delete shm;
+            return;
+        }
 
-        } else {
-            int32_t action = this->HandleMessage((void*)stream, stream->rcur);
-            switch (action) {
-                case ACTION_NONE:
-                    stream->rcur = nullptr;
-                    stream->rhead = true;
-                    async_read(stream);
-                    break;
-                case ACTION_DISCONNECT:
-                    stream->socket.close();
-                    break;
-                case ACTION_RECONNECT:
-                    stream->socket.close();
-                    async_connect(stream);
-                    break;
-            }
+        uint8_t* base = (uint8_t*)(shm->region.base);
+        shm->tx.Attach(base, shmSlots, true, true);
+        shm->rx.Attach(base + ShmRing::Footprint(shmSlots), shmSlots, true, false);
+        AttachShm(chan, shm, stream->target);
+        this->PostShm(stream, shmSlots, shm->name);
+    }
+
+    //  [接收方] 映射发起方创建的共享内存, 返回 0 表示成功.
+    //  名字和大小来自对端, 只接受本机对端发来的、按 OfferShm 的规则命名的请求, 并且映射前检查实际大小
+    int32_t AcceptShm(void* s, const char* name, int32_t slots)
+    {
+        stream_t* stream = (stream_t*)s;
+        chan_t* chan = stream->chan;
+        if ((0 == shmSlots) || (nullptr == chan) || (nullptr != chan->shm) || (slots <= 0) ||
+            (slots > int32_t(SHM_SLOTS_MAX))) {
+            return -1;
+        }
+        size_t prefix = strlen(ShmPrefix());
+        if ((0 != strncmp(name, ShmPrefix(), prefix)) || (nullptr != strchr(name + 1, '/')) || !IsLocalPeer(stream)) {
+            TRACE_WARN(TRACE_SHM_OPEN_FAILED, stream, stream->target, EPERM);
+            return -1;
+        }
+
+        shm_t* shm = new shm_t();
+        shm->name = name;
+        if (0 != shm->region.Open(shm->name, 2 * ShmRing::Footprint(slots))) {
+            TRACE_WARN(TRACE_SHM_OPEN_FAILED, stream, stream->target, errno);
+            delete shm;
+            return -1;
         }
+        shm_unlink(name);
+
+        uint8_t* base = (uint8_t*)(shm->region.base);
+        shm->rx.Attach(base, slots, false, false);
+        shm->tx.Attach(base + ShmRing::Footprint(slots), slots, false, true);
+        if (!shm->rx.Valid() || !shm->tx.Valid()) {
+            FreeShm(shm);
+            return -1;
+        }
+
+        AttachShm(chan, shm, stream->target);
+        return 0;
     }
 
-    void HandleWriteResult(stream_t* stream, const system::error_code& err, std::size_t length)
+    void AttachShm(chan_t* chan, shm_t* shm, uint16_t target)
     {
-        if ((asio::error::eof == err) || (asio::error::connection_reset == err)) {
-            debug(stream, "HandleWriteResult failed:%d: %s", err.value(), err.message().c_str());  // TODO 错误码是啥
-            UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_DISCONNECTED);
+        //  接收方释放出空间而发送方正在等待时, 通过流通知发送方
+        shm->rx.notify = [this, target]() {
+            asio::post(LoopOf(target)->context, [this, target]() {
+                chan_t* chan = FindChan(target);
+                if (nullptr != chan->stream) {
+                    this->PostShmKick(chan->stream);
+                }
+            });
+        };
+        chan->shm = shm;
+    }
+
+    //  共享内存通道建立完成(status 为 0)后, 通道的后续消息都通过共享内存环发送
+    void EnableShm(void* s, int32_t status)
+    {
+        stream_t* stream = (stream_t*)s;
+        chan_t* chan = stream->chan;
+        if ((nullptr == chan) || (nullptr == chan->shm)) {
             return;
         }
 
-        if (err) {
-            debug(stream, "HandleWriteResult failed:%d: %s", err.value(), err.message().c_str());  // TODO 错误码是啥
-            stream->socket.close();
-            stream->wloss = true;
-            return;
+        if (ATTR_STREAM_TYPE_ACTIVATE == stream->get_attr(ATTR_STREAM_TYPE_MASK)) {
+            shm_unlink(chan->shm->name.c_str());
         }
-        debug(stream, "HandleWriteResult success");
 
-        //  确定流所绑定的索引
-        if (stream->target == MESSAGE::ADDRESS_INVALID) {
-            stream->wloss = true;
+        if (0 != status) {
+            shm_t* shm = chan->shm;
+            chan->shm = nullptr;
+            FreeShm(shm);
             return;
         }
 
-        //  找到传送通道
-        auto chan = ChanOf(stream->target);
-        Q_ASSERT(nullptr != chan);
+        __atomic_store_n(&(chan->shmtx), &(chan->shm->tx), __ATOMIC_RELEASE);
+        FlushShm(chan);
+    }
+
+    //  连接断开后回到通过流发送, 重新建立连接后再协商新的共享内存.
+    //  环中的消息可能还被业务线程引用着(取出后还没有释放, 或者预留后还没有投递), 所以先放入 shmRetired,
+    //  不再被引用后才解除映射
+    void DisableShm(chan_t* chan)
+    {
+        __atomic_store_n(&(chan->shmtx), (ShmRing*)nullptr, __ATOMIC_SEQ_CST);
+        shm_t* shm = chan->shm;
+        chan->shm = nullptr;
+        if (nullptr == shm) {
+            return;
+        }
 
-        //  保存前一个消息
-        auto oldwcur = stream->wcur;
+        //  对端还没有确认时名字还没有删除
+        shm_unlink(shm->name.c_str());
+        chan->shmRetired.push_back(shm);
+        ArmTimer(LoopOf(chan->target), &(chan->shmSweep), SHM_RETIRE_MS);
+    }
 
-        //  直接覆盖前一个消息的地址
-        stream->wcur = (BUFFER*)(chan->qsend.pop_front());
-        if (nullptr == stream->wcur) {
-            stream->wloss = true;
+    //  释放 shmRetired 中不再被引用的共享内存: 没有业务线程正在 Alloc 中使用发送环(shmusers 为 0),
+    //  并且两个方向的环都不再被引用. shmtx 已经先清空, 之后登记的 Alloc 不会再取得这些环
+    void SweepShm(chan_t* chan)
+    {
+        std::vector<shm_t*>& retired = chan->shmRetired;
+        if (0 != __atomic_load_n(&(chan->shmusers), __ATOMIC_SEQ_CST)) {
+            ArmTimer(LoopOf(chan->target), &(chan->shmSweep), SHM_RETIRE_MS);
             return;
         }
+        for (size_t i = 0; i < retired.size();) {
+            shm_t* shm = retired[i];
+            shm->rx.Advance();
+            if (!shm->tx.Drained() || !shm->rx.Drained()) {
+                i++;
+                continue;
+            }
+            FreeShm(shm);
+            retired[i] = retired.back();
+            retired.pop_back();
+        }
 
-        //  启动异步发送
-        async_write(stream, MessageOf(stream->wcur));
+        if (!retired.empty()) {
+            ArmTimer(LoopOf(chan->target), &(chan->shmSweep), SHM_RETIRE_MS);
+        }
+    }
 
-        //  释放前一个消息
-        allocator->Free(MessageOf(oldwcur));
+    void FreeShm(shm_t* shm)
+    {
+        if (nullptr != shm->region.base) {
+            munmap(shm->region.base, shm->region.length);
+        }
+        delete shm;
     }
 
-    //  启动异步发送
-    void async_write(void* s, MESSAGE* newmsg)
+    static const char* ShmPrefix()
     {
-        stream_t* stream = (stream_t*)s;
-        if (nullptr != newmsg) {
-            stream->wcur = BufferOf(newmsg);
+        return "/we-comm-";
+    }
+
+    //  对端是否在本机: 回环地址, 或者与本端使用同一个地址
+    bool IsLocalPeer(stream_t* stream)
+    {
+        system::error_code ec1;
+        system::error_code ec2;
+        auto remote = stream->socket.remote_endpoint(ec1);
+        auto local = stream->socket.local_endpoint(ec2);
+        return !ec1 && !ec2 && (remote.address().is_loopback() || (remote.address() == local.address()));
+    }
+
+    //  将通道发送队列中的消息写入共享内存环: 已经在环中构造的消息只需要提交, 其他消息拷贝进环;
+    //  放不进环的大消息仍然通过流发送
+    void FlushShm(chan_t* chan)
+    {
+        ShmRing* ring = chan->shmtx;
+        bool kick = false;
+        BUFFER* buf = nullptr;
+        while (nullptr != (buf = NextSend(chan))) {
+            MESSAGE* msg = WireOf(buf);
+            if ((buf->owner == ring) && (0 == chan->fsent[buf->prio])) {
+                Charge(chan, buf->prio, msg->TotalLength());
+                PopSend(chan, buf);
+                Dequeued(chan, msg);
+                kick = ring->Commit(msg) || kick;
+                continue;
+            }
+
+            //  已经通过流发送了一部分分片的消息也改为从头通过流发送(数据可能还在被写, 不能释放)
+            if ((msg->PayloadLength() > ring->PayloadMax()) || (0 != chan->fsent[buf->prio])) {
+                if (nullptr == chan->stream) {
+                    break;
+                }
+                Charge(chan, buf->prio, msg->TotalLength());
+                PopSend(chan, buf);
+                chan->stream->wlarge.push_back(buf);
+                async_write(chan->stream, nullptr);
+                continue;
+            }
+
+            MESSAGE* copy = ring->Reserve(msg->PayloadLength());
+            if (nullptr == copy) {
+                //  空间不足: 等待接收方释放空间后通知
+                if (ring->Wait(msg->PayloadLength())) {
+                    continue;
+                }
+                kick = SpillShm(chan, ring) || kick;
+                break;
+            }
+
+            Charge(chan, buf->prio, msg->TotalLength());
+            PopSend(chan, buf);
+            Dequeued(chan, msg);
+            std::memcpy(copy, msg, msg->TotalLength());
+            copy->TotalLength(msg->TotalLength());
+            kick = ring->Commit(copy) || kick;
+            allocator->Free(MessageOf(buf));
         }
 
-        if (stream->wcur) {
-            stream->wloss = true;
+        __atomic_store_n(&(chan->shmbusy), SendEmpty(chan) ? 0 : 1, __ATOMIC_RELAXED);
+        if (kick && (nullptr != chan->stream)) {
+            this->PostShmKick(chan->stream);
         }
+    }
 
-        stream->wloss = false;
-        Q_ASSERT(nullptr != stream->wcur);
-        MESSAGE* msg = MessageOf(stream->wcur);
-        asio::async_write(
-            stream->socket, asio::buffer(msg, msg->TotalLength()),
-            [this, stream](system::error_code ec, std::size_t len) { HandleWriteResult(stream, ec, len); });
+    //  队首的消息等待空间时, 排在它后面、已经在环中预留的消息会挡住接收方, 环可能永远腾不出空间:
+    //  把这些消息拷贝出环, 并把原来的预留作废为填充记录, 消息在发送队列中的顺序不变
+    bool SpillShm(chan_t* chan, ShmRing* ring)
+    {
+        bool spilled = false;
+        for (int32_t i = 0; i < MESSAGE::PRIORITY_COUNT; i++) {
+            spilled = SpillShm(&(chan->qsend[i]), ring, 0 != chan->fsent[i]) || spilled;
+        }
+        return spilled;
     }
 
-    //  启动异步发送
-    void async_read(stream_t* stream)
+    //  busyHead 为真时队首消息正在通过流分片发送, 不能移动
+    bool SpillShm(NODE* queue, ShmRing* ring, bool busyHead)
     {
-        if (true == stream->rhead) {
-            asio::async_read(stream->socket, asio::buffer(&(stream->rbuf), sizeof(stream->rbuf)),
-                             [this, stream](const system::error_code& ec, std::size_t length) {
-                                 HandleReadResult(stream, ec, length);
-                             });
-        } else {
-            asio::async_read(stream->socket,
-                             asio::buffer(stream->rcur->payload, (stream->rcur->TotalLength() - sizeof(MESSAGE))),
-                             [this, stream](const system::error_code& ec, std::size_t length) {
-                                 HandleReadResult(stream, ec, length);
-                             });
+        bool spilled = false;
+        for (NODE* node = queue->next; node != queue; node = node->next) {
+            BUFFER* buf = (BUFFER*)node;
+            if ((buf->owner != ring) || (busyHead && (node == queue->next))) {
+                continue;
+            }
+
+            MESSAGE* msg = MessageOf(buf);
+            MESSAGE* copy = allocator->Alloc(msg->PayloadLength());
+            if (nullptr == copy) {
+                break;
+            }
+            std::memcpy(copy, msg, msg->TotalLength());
+            copy->TotalLength(msg->TotalLength());
+            copy->Source(msg->Source());
+            copy->Target(msg->Target());
+            copy->Priority(msg->Priority());
+
+            NODE::insert(BufferOf(copy), node->prev, node->next);
+            node = BufferOf(copy);
+            ring->Release(buf);
+            spilled = true;
         }
+        return spilled;
     }
 
-    void async_connect(stream_t* stream)
+    //  对端通知: 处理共享内存环中的新消息, 并继续发送因空间不足而等待的消息
+    void HandleShmKick(void* s)
+    {
+        stream_t* stream = (stream_t*)s;
+        chan_t* chan = stream->chan;
+        if ((nullptr == chan) || (nullptr == chan->shm)) {
+            return;
+        }
+
+        DrainShm(stream, chan->shm);
+        if (nullptr != chan->shmtx) {
+            FlushShm(chan);
+        }
+    }
+
+    void DrainShm(stream_t* stream, shm_t* shm)
     {
-        asio::ip::tcp::resolver resolver(context);
-        //        asio::ip::tcp::endpoint ep = addr_of(stream->targetAddr);
+        ShmRing* ring = &(shm->rx);
+        for (;;) {
+            int32_t count = 0;
+            MESSAGE* msg = nullptr;
+            while (count < SHM_DRAIN_MAX) {
+                if (0 != ring->Pop(&msg)) {
+                    //  对端写坏了共享内存(或者不可信), 不再使用这个环
+                    TRACE_ERROR(TRACE_SHM_INVALID, stream, stream->target);
+                    if (nullptr != stream->chan) {
+                        DisableShm(stream->chan);
+                    }
+                    CloseSocket(stream);
+                    return;
+                }
+                if (nullptr == msg) {
+                    break;
+                }
+                count++;
+                if (!DispatchMessage(stream, msg)) {
+                    return;
+                }
+            }
+            ring->Advance();
+
+            //  一次处理的消息太多时让出事件循环, 稍后继续
+            if (count >= SHM_DRAIN_MAX) {
+                asio::post(stream->loop->context, [this, stream, shm]() {
+                    if ((nullptr != stream->chan) && (shm == stream->chan->shm)) {
+                        DrainShm(stream, shm);
+                    }
+                });
+                return;
+            }
 
-        auto endpoints = resolver.resolve(std::string("localhost"), std::string("9090"));
+            if (ring->Sleep()) {
+                return;
+            }
+        }
+    }
 
-        padding.push_back(stream);
-        this->HandleEvent(stream, EVENT_CONN_INITED, 0, 0);
+    //  目的地址 id 的通道, 第一次用到时创建; 地址超出 Init 指定的范围时返回空. 可以在任意线程中调用
+    inline chan_t* ChanOf(uint16_t id)
+    {
+        if (id >= addrLimit) {
+            return nullptr;
+        }
 
-        UpdateStatus(stream, STATUS_CONN_MASK, STATUS_CONN_CONNECTING);
+        chan_t* chan = FindChan(id);
+        return (nullptr != chan) ? chan : NewChan(id);
+    }
 
-        asio::async_connect(stream->socket, endpoints,
-                            [this, stream](const system::error_code& ec, asio::ip::tcp::endpoint ep) {
-                                HandleConnectResult(stream, ec, ep);
-                            });
+    //  目的地址 id 已经存在的通道, 没有时返回空(不创建). 用于不应该为任意地址创建通道的查询和转发,
+    //  只有投递消息(Post/Submit)和流加入通道时才用 ChanOf 创建. 可以在任意线程中调用
+    inline chan_t* FindChan(uint16_t id) const
+    {
+        if (id >= addrLimit) {
+            return nullptr;
+        }
+
+        chan_t* const* slot = chans.Find(id);
+        return (nullptr != slot) ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : nullptr;
+    }
+
+    //  创建通道: 按 proto 中(对所有通道)的设置初始化, 与 ForChans 互斥, 不会错过同时进行的设置
+    chan_t* NewChan(uint16_t id)
+    {
+        std::lock_guard<std::mutex> guard(chansLock);
+        chan_t** slot = chans.Slot(id);
+        if (nullptr != *slot) {
+            return *slot;
+        }
+
+        chan_t* chan = new chan_t();
+        chan->target = id;
+        chan->maxMsgs = proto.maxMsgs;
+        chan->maxBytes = proto.maxBytes;
+        chan->highBytes = proto.highBytes;
+        chan->lowBytes = proto.lowBytes;
+        chan->zmin = proto.zmin;
+        chan->zratio = proto.zratio;
+        chan->shmSweep.callback = [this, chan]() { SweepShm(chan); };
+        __atomic_store_n(slot, chan, __ATOMIC_RELEASE);
+        return chan;
     }
 
-    int debug(stream_t* stream, const char* format, ...)
+    //  对 target 的通道执行 fn(设置通道参数), 通道还不存在时创建, 使设置在连接建立之前就生效;
+    //  target 为 ADDRESS_INVALID 时对所有已经创建的通道执行,
+    //  并记录在 proto 中, 以后创建的通道也使用这些设置
+    template <typename F>
+    int ForChans(uint16_t target, F fn)
     {
-        // std::printf("[%p][%d-%d]", stream, source, stream->target);
-        if (nullptr != stream) {
-            std::printf("[%p][??-%d]", stream, stream->target);
+        if (MESSAGE::ADDRESS_INVALID != target) {
+            chan_t* chan = ChanOf(target);
+            if (nullptr == chan) {
+                return -1;
+            }
+            fn(chan);
+            return 0;
         }
-        va_list valist;
-        va_start(valist, format);
-        std::vprintf(format, valist);
-        va_end(valist);
-        std::printf("\n");
 
+        std::lock_guard<std::mutex> guard(chansLock);
+        fn(&proto);
+        chans.ForEach([&fn](uint16_t, chan_t** slot) {
+            if (nullptr != *slot) {
+                fn(*slot);
+            }
+        });
         return 0;
     }
 
-    inline chan_t* ChanOf(int16_t id)
+    static inline void Bump(std::atomic<uint64_t>& counter)
     {
-        if ((id < 0) || (id > chans.size())) {
-            return nullptr;
+        counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline loop_t* LoopOf(uint16_t target)
+    {
+        return loops[target % loops.size()];
+    }
+
+    //  心跳检查: 一个间隔内没有读到数据时发送心跳, 累计超过 hbTimeout 时关闭连接,
+    //  未完成的读操作因此失败, 按连接断开处理
+    void CheckHeartbeat(stream_t* stream)
+    {
+        uint32_t idle = ++(stream->ridle);
+        if (int64_t(idle - 1) * hbInterval >= hbTimeout) {
+            TRACE_WARN(TRACE_PEER_TIMEOUT, stream, stream->target, int64_t(idle - 1) * hbInterval);
+            {
+                SeqCounter<STREAM_COUNTER_MAX>::Update u(stream->stats);
+                u.Add(STREAM_PEER_TIMEOUTS, 1);
+            }
+            CloseSocket(stream);
+            return;
+        }
+
+        if (idle > 1) {
+            {
+                SeqCounter<STREAM_COUNTER_MAX>::Update u(stream->stats);
+                u.Add(STREAM_HEARTBEATS, 1);
+            }
+            this->PostHeartbeat(stream, PARENT::CONNPING);
+        }
+        ArmTimer(stream->loop, &(stream->heartbeat), hbInterval);
+    }
+
+    //  在 loop 的线程中调用: 启动定时器, 需要时让 ticker 提前唤醒事件循环
+    void ArmTimer(loop_t* loop, TIMER* timer, int32_t ms)
+    {
+        loop->wheel.Add(timer, NowMillis() + uint64_t((ms > 0) ? ms : 0));
+        ScheduleTicker(loop);
+    }
+
+    //  所有定时器共用一个 asio 定时器: 只在时间轮下一次需要推进的时间比已经等待的更早时重新设置
+    void ScheduleTicker(loop_t* loop)
+    {
+        uint64_t next = loop->wheel.NextTick();
+        if (next >= loop->tickAt) {
+            return;
+        }
+
+        uint64_t now = NowMillis();
+        loop->tickAt = next;
+        loop->ticker.expires_from_now(posix_time::milliseconds((next > now) ? int64_t(next - now) : 0));
+        loop->ticker.async_wait([this, loop](const system::error_code& ec) {
+            //  被重新设置的等待以 operation_aborted 结束, 由新的等待负责推进
+            if (ec) {
+                return;
+            }
+            loop->tickAt = UINT64_MAX;
+            loop->wheel.Advance(NowMillis());
+            ScheduleTicker(loop);
+        });
+    }
+
+    void RunLoop(loop_t* loop)
+    {
+#if defined(__linux__)
+        if (loop->core >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(loop->core, &cpus);
+            int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            if (0 != ret) {
+                TRACE_ERROR(TRACE_PIN_FAILED, loop->index, loop->core, ret);
+            }
+        }
+#endif
+        if (LOOP_BLOCK == spinMicros) {
+            loop->context.run();
+            return;
+        }
+        SpinLoop(loop);
+    }
+
+    //  忙轮询: 反复处理就绪的 asio 事件、提交队列和 io_uring 的完成事件, 不在 epoll 中睡眠.
+    //  spinMicros 大于 0 时连续空闲这么久之后退回到睡眠等待, 处理完下一个事件后重新开始轮询
+    void SpinLoop(loop_t* loop)
+    {
+        uint64_t idleSince = 0;
+        loop->spinning.store(true);
+        while (!loop->context.stopped()) {
+            size_t count = loop->context.poll();
+            if (!loop->qsubmit.empty()) {
+                DrainSubmit(loop);
+                count++;
+            }
+            if ((nullptr != loop->uring) && loop->uring->Ready()) {
+                DrainRing(loop);
+                count++;
+            }
+            if (count > 0) {
+                idleSince = 0;
+                continue;
+            }
+
+            uint64_t now = NowNanos();
+            if (0 == idleSince) {
+                idleSince = now;
+            }
+            if ((LOOP_SPIN == spinMicros) || ((now - idleSince) < uint64_t(spinMicros) * 1000)) {
+                CpuRelax();
+                continue;
+            }
+
+            //  先声明不再轮询再检查提交队列, 与 Submit 配对, 消息不会在两者之间漏掉
+            loop->spinning.store(false);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (loop->qsubmit.empty()) {
+                loop->context.run_one();
+            }
+            loop->spinning.store(true);
+            idleSince = 0;
         }
+        loop->spinning.store(false);
+    }
+
+    static inline void CpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
 
-        return &chans[id];
+    //  在第一个事件循环中执行: 结束已经超时的 RPC 调用, 之后每 RPC_TICK_MS 检查一次
+    void SweepRpc()
+    {
+        ExpireRpc(int64_t(NowNanos()), RPC_TIMEOUT);
+        ArmTimer(loops[0], &rpcTick, RPC_TICK_MS);
+    }
+
+    void ExpireRpc(int64_t now, int32_t status)
+    {
+        std::vector<RpcCallback> expired;
+        rpc->Expire(now, &expired);
+        for (auto& callback : expired) {
+            callback(status, nullptr);
+        }
     }
 
 public:
-    int BindStreamChan(void* s, uint16_t target)
+    //  检查流是否已经在目的地址 target 对应通道所属的事件循环中, 不在时记录需要迁移到的事件循环
+    bool CheckHomeLoop(void* s, uint16_t target)
+    {
+        stream_t* stream = (stream_t*)s;
+        loop_t* loop = LoopOf(target);
+        if (stream->loop == loop) {
+            return true;
+        }
+
+        stream->rehome = loop;
+        return false;
+    }
+
+    //  流认证完成, 加入目的地址 target 的通道, 成为通道的第 stripe 个流
+    int BindStreamChan(void* s, uint16_t target, uint16_t stripe)
     {
         stream_t* stream = (stream_t*)s;
         chan_t* chan = ChanOf(target);
-        if (nullptr != chan->stream) {
-            return -1;
+
+        //  通道中已经有同一个编号的流时, 它还连接着就拒绝新的流(例如两个对端使用了同一个地址);
+        //  否则是对端重新连接: 原来的流已经断开(例如心跳超时), 由新的流接替.
+        //  第一个流断开后还没有其他流时它仍然留在通道中, 也由新的流接替
+        int32_t index = -1;
+        for (int32_t i = 0; i < StreamsOf(chan); i++) {
+            stream_t* old = StreamOf(chan, i);
+            if ((old == stream) || (old->stripe == stripe)) {
+                index = i;
+                break;
+            }
+        }
+        if ((index < 0) && (nullptr != chan->stream) &&
+            (STATUS_CONN_CONNECTED != (chan->stream->status & STATUS_CONN_MASK))) {
+            index = 0;
+        }
+
+        if (index < 0) {
+            if (nullptr == chan->stream) {
+                index = 0;
+            } else if (chan->nstripes < int32_t(STRIPES_MAX) - 1) {
+                index = ++(chan->nstripes);
+            } else {
+                return -1;
+            }
+        } else {
+            stream_t* old = StreamOf(chan, index);
+            if (old != stream) {
+                if (STATUS_CONN_CONNECTED == (old->status & STATUS_CONN_MASK)) {
+                    return -1;
+                }
+                //  原来的流上没有发出的大消息转到新的流
+                while (!old->wlarge.empty()) {
+                    stream->wlarge.push_back(old->wlarge.pop_front());
+                }
+                old->wfrag = 0;
+                old->chan = nullptr;
+            }
         }
 
         stream->target = target;
+        stream->stripe = stripe;
+        {
+            SeqCounter<STREAM_COUNTER_MAX>::Update u(stream->stats);
+            u.Set(STREAM_TARGET, target);
+        }
 
         stream->chan = chan;
-        chan->stream = stream;
+        if (0 == index) {
+            chan->stream = stream;
+        } else {
+            chan->stripes[index - 1] = stream;
+        }
+
+        //  认证完成(流已经在通道所属的事件循环中)后开始心跳
+        if (hbInterval > 0) {
+            stream->ridle = 0;
+            ArmTimer(stream->loop, &(stream->heartbeat), hbInterval);
+        }
         return 0;
     }
 
+    //  通道的多个流中的一个断开: 从通道中移除, 还没有发出的大消息转到第一个流, 其他流继续发送.
+    //  通道只有这一个流时保持不变, 等它重新连接(或者由对端新建立的流接替)
+    void UnbindStripe(stream_t* stream)
+    {
+        chan_t* chan = stream->chan;
+        if (0 == chan->nstripes) {
+            return;
+        }
+
+        //  wlarge 队首的大消息可能还被没有完成的写引用着, 先关闭 socket 使写操作不再访问它
+        CloseSocket(stream);
+
+        int32_t last = chan->nstripes;
+        for (int32_t i = 0; i < last; i++) {
+            if (StreamOf(chan, i) == stream) {
+                if (0 == i) {
+                    chan->stream = chan->stripes[last - 1];
+                } else {
+                    chan->stripes[i - 1] = chan->stripes[last - 1];
+                }
+                break;
+            }
+        }
+        chan->stripes[last - 1] = nullptr;
+        chan->nstripes--;
+
+        while (!stream->wlarge.empty()) {
+            chan->stream->wlarge.push_back(stream->wlarge.pop_front());
+        }
+        stream->wfrag = 0;
+        stream->chan = nullptr;
+        KickChan(chan);
+    }
+
     virtual void UpdateStatus(void* s, uint16_t mask, uint16_t val)
     {
         stream_t* stream = (stream_t*)s;
@@ -697,13 +3724,21 @@ public:
         uint16_t newstatus = stream->status;
 
         if (oldstatus != newstatus) {
+            if (STATUS_CONN_DISCONNECTED == (newstatus & STATUS_CONN_MASK)) {
+                stream->loop->wheel.Cancel(&(stream->heartbeat));
+                if (nullptr != stream->chan) {
+                    DisableShm(stream->chan);
+                    UnbindStripe(stream);
+                }
+            }
+
             int32_t action = this->HandleEvent(stream, EVENT_STATUS_CHANGED, oldstatus, newstatus);
             if (action == ACTION_DISCONNECT) {
-                stream->socket.close();
+                CloseSocket(stream);
                 return;
             }
             if (action == ACTION_RECONNECT) {
-                stream->socket.close();
+                CloseSocket(stream);
                 async_connect(stream);
                 return;
             }
@@ -712,11 +3747,42 @@ public:
 
 
 protected:
-    asio::io_context context;           //  网络IO上下文, asio::io_context
+    std::vector<loop_t*> loops;         //  事件循环, 第一个事件循环负责监听和发起连接
     ALLOCATOR* allocator;               //  消息对象分配器
     asio::ip::tcp::acceptor* acceptor;  //  连接器
-    std::vector<chan_t> chans;          //  所有可能的流对象列表
+    PagedTable<chan_t*> chans;          //  按目的地址索引的通道, 第一次用到时创建
+    chan_t proto;                       //  对所有通道的设置, 新建的通道从这里复制
+    std::mutex chansLock;               //  创建通道与设置所有通道互斥
+    uint32_t addrLimit;                 //  目的地址的范围(不含), 见 Init
     NODE padding;                       //  处于待命状态的连接
+    int32_t writeBytes;                 //  单次聚合写的字节数上限
+    int32_t writeIovecs;                //  单次聚合写的缓冲区个数上限
+    int32_t readBytes;                  //  每个流接收缓冲区的大小
+    int32_t maxMessage;                 //  接收的消息的最大总长度, 见 SetMaxMessage
+    int32_t shmSlots;                   //  共享内存通道每个方向的槽数, 0 表示不使用
+    int32_t quantum[MESSAGE::PRIORITY_COUNT];  //  每个优先级每轮的配额, 0 表示严格优先
+    std::vector<stream_t*> streams;     //  所有的流, 用于计数器快照
+    mutable std::mutex streamsLock;     //  保护 streams
+    std::atomic<uint32_t> shmSeq;       //  用于生成共享内存的名字
+    std::atomic<uint64_t> connSeq;      //  用于生成连接编号
+    int32_t fragBytes;                  //  总长度超过该值的消息分片发送
+    RpcTable* rpc;                      //  等待回复的 RPC 调用
+    TIMER rpcTick;                      //  在第一个事件循环中定时检查 RPC 调用超时
+    int32_t hbInterval;                 //  心跳检查的间隔(毫秒), 0 表示不使用心跳
+    int32_t hbTimeout;                  //  多长时间(毫秒)没有读到数据判定对端失效
+    int32_t stripeCount;                //  发起连接时每个通道建立的流数
+    int32_t stripeMode;                 //  消息在通道的多个流之间的分配方式, STRIPE_XXX
+    int32_t ioBackend;                  //  套接字收发的方式, IO_ASIO 或者 IO_URING
+    int32_t spinMicros;                 //  事件循环空闲多久(微秒)之后才睡眠, 见 SetPolling
+    int32_t busyPollMicros;             //  流的 SO_BUSY_POLL(微秒), 0 表示不设置
+    PagedTable<uint16_t> routes;        //  每个目的地址的下一跳, ADDRESS_INVALID 表示按默认路由
+    uint16_t defaultRoute;              //  默认路由的下一跳, ADDRESS_INVALID 表示直接发送
+    std::atomic<bool> rpcSweep;         //  是否已经开始检查超时(第一次 Call 时开始)
+    std::mutex waitLock;                //  PostWait 等待发送队列腾出空间
+    std::condition_variable waitCond;   //  发送队列有消息取出且有线程在等待时通知
+    mcast_owner_t mcastOwner;           //  组播引用节点的 owner
+    std::map<uint32_t, std::shared_ptr<const std::vector<uint16_t>>> groups;  //  组播组
+    std::mutex groupsLock;                                                    //  保护 groups
 
     //    DISPATCHER* dispatcher;             //  消息分发器
     //    uint16_t source;                    //  源地址
@@ -0,0 +1,99 @@
+#ifndef SEQCOUNTER_H
+#define SEQCOUNTER_H
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+//  单写者的一组计数器: 写者(所属的事件循环)不加锁更新, 其他线程通过 Snapshot 读到一致的副本
+//
+//  写者每次更新前后各把序号加一(更新期间为奇数), 读者在序号为偶数且前后一致时才接受读到的值.
+//  所有字段都是 relaxed 原子变量, 写者一侧只有普通的读写, 没有原子的读改写操作
+template <int32_t N>
+class SeqCounter
+{
+public:
+    //  在作用域内批量更新, 读者看到的要么是全部更新之前的值, 要么是全部更新之后的值
+    class Update
+    {
+    public:
+        explicit Update(SeqCounter& c) : counter(c)
+        {
+            uint64_t seq = counter.seq.load(std::memory_order_relaxed);
+            counter.seq.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        ~Update()
+        {
+            uint64_t seq = counter.seq.load(std::memory_order_relaxed);
+            counter.seq.store(seq + 1, std::memory_order_release);
+        }
+
+        inline void Add(int32_t id, uint64_t n)
+        {
+            counter.values[id].store(counter.values[id].load(std::memory_order_relaxed) + n,
+                                     std::memory_order_relaxed);
+        }
+
+        inline void Set(int32_t id, uint64_t v)
+        {
+            counter.values[id].store(v, std::memory_order_relaxed);
+        }
+
+        inline void Max(int32_t id, uint64_t v)
+        {
+            if (v > counter.values[id].load(std::memory_order_relaxed)) {
+                counter.values[id].store(v, std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        SeqCounter& counter;
+    };
+
+public:
+    SeqCounter() : seq(0)
+    {
+        for (int32_t i = 0; i < N; i++) {
+            values[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    //  只在还没有并发访问时使用(例如放入 std::vector 时)
+    SeqCounter(const SeqCounter& other) : seq(0)
+    {
+        uint64_t copy[N];
+        other.Snapshot(copy);
+        for (int32_t i = 0; i < N; i++) {
+            values[i].store(copy[i], std::memory_order_relaxed);
+        }
+    }
+
+    //  任意线程调用
+    void Snapshot(uint64_t* out) const
+    {
+        for (;;) {
+            uint64_t before = seq.load(std::memory_order_acquire);
+            if (0 != (before & 1)) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            for (int32_t i = 0; i < N; i++) {
+                out[i] = values[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (before == seq.load(std::memory_order_relaxed)) {
+                return;
+            }
+        }
+    }
+
+private:
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> values[N];
+};
+
+#endif  // SEQCOUNTER_H
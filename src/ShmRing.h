@@ -0,0 +1,393 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "MESSAGE.h"
+
+//  位于共享内存中的消息环, 用于同一台机器上两个进程之间单向传递消息
+//
+//  - 环由固定大小(SLOT_SIZE)的槽组成, 一条消息占用连续的若干个槽, 槽中依次存放
+//    记录头(rec_t)、BUFFER 和 MESSAGE, 因此 MessageOf/BufferOf 对环中的消息同样有效,
+//    发送方直接在环中构造消息, 接收方直接在环中处理消息, 中间没有任何拷贝
+//  - 每个槽在独立的序号数组中有一个序号, 发送方提交消息时把首槽的序号设置为
+//    "绝对槽号 + 1", 消息内容永远不会覆盖序号, 所以不需要清理已经用过的槽
+//  - 多个线程可以同时预留空间(Reserve), 提交(Commit)可以乱序, 接收方按顺序处理
+//  - 接收方处理完的消息可以在任意线程中乱序释放(通过 BUFFER::owner 回到 Release),
+//    释放位置只会越过连续的已释放消息
+//  - 接收方空闲时设置 sleeping 标志, 发送方提交后发现该标志就需要通知接收方;
+//    发送方空间不足时设置 waiting 标志, 接收方释放空间后就需要通知发送方.
+//    通知本身不在这里实现, 由使用者通过已有的连接传递
+class ShmRing : public BufferOwner
+{
+public:
+    enum : int32_t {
+        SLOT_SIZE = 64,
+        MAGIC = 0x534D5152,  //  'SMQR'
+    };
+
+    //  共享内存区域: 由发起方创建, 对端按名字打开
+    struct Region {
+        void* base;
+        size_t length;
+
+        Region() : base(nullptr), length(0)
+        {
+        }
+
+        int Create(const std::string& name, size_t len)
+        {
+            int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0) {
+                return -1;
+            }
+            if (0 != ftruncate(fd, len)) {
+                close(fd);
+                shm_unlink(name.c_str());
+                return -1;
+            }
+            return Map(fd, len);
+        }
+
+        //  打开对端创建的共享内存: 实际大小不足 len 时失败, 以免访问超出文件末尾的映射(SIGBUS)
+        int Open(const std::string& name, size_t len)
+        {
+            int fd = shm_open(name.c_str(), O_RDWR, 0600);
+            if (fd < 0) {
+                return -1;
+            }
+            struct stat st;
+            if ((0 != fstat(fd, &st)) || (st.st_size < off_t(len))) {
+                close(fd);
+                errno = EINVAL;
+                return -1;
+            }
+            return Map(fd, len);
+        }
+
+        int Map(int fd, size_t len)
+        {
+            void* addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (MAP_FAILED == addr) {
+                return -1;
+            }
+            base = addr;
+            length = len;
+            return 0;
+        }
+    };
+
+public:
+    ShmRing()
+        : hdr(nullptr), seqs(nullptr), data(nullptr), slots(0), producer(false), read(0), advancing(false),
+          outstanding(0)
+    {
+    }
+
+    //  一个方向的环在共享内存中占用的字节数
+    static size_t Footprint(int32_t slots)
+    {
+        return sizeof(hdr_t) + sizeof(std::atomic<uint64_t>) * slots + size_t(SLOT_SIZE) * slots;
+    }
+
+    //  绑定到共享内存中的环: create 为 true 时初始化环头; producer 表示本进程是发送方
+    void Attach(void* mem, int32_t slotCount, bool create, bool isProducer)
+    {
+        hdr = (hdr_t*)mem;
+        seqs = (std::atomic<uint64_t>*)((uint8_t*)mem + sizeof(hdr_t));
+        data = (uint8_t*)(seqs + slotCount);
+        slots = slotCount;
+        producer = isProducer;
+        if (create) {
+            hdr->magic = MAGIC;
+            hdr->slots = slotCount;
+            hdr->reserve.store(0);
+            hdr->head.store(0);
+            hdr->sleeping.store(1);
+            hdr->waiting.store(0);
+            for (int32_t i = 0; i < slotCount; i++) {
+                seqs[i].store(0);
+            }
+        }
+    }
+
+    bool Valid() const
+    {
+        return (nullptr != hdr) && (MAGIC == hdr->magic) && (uint32_t(slots) == hdr->slots);
+    }
+
+    int32_t Slots() const
+    {
+        return slots;
+    }
+
+    //  能放入环中的最大 payload 长度
+    //  业务线程直接在环中预留的消息最多占用一半的槽(见 Reserve), 加上填充记录,
+    //  剩下的空间总能放下一条这么大的消息, 所以按顺序提交不会因为后面的预留而死锁
+    int32_t PayloadMax() const
+    {
+        return (slots / 4) * SLOT_SIZE - int32_t(sizeof(rec_t) + sizeof(BUFFER) + sizeof(MESSAGE));
+    }
+
+    //  [发送方, 任意线程] 在环中预留一条消息, 预留后占用的槽数不能超过 budget(0 表示整个环),
+    //  空间不足或者消息太大时返回 nullptr
+    MESSAGE* Reserve(int32_t payloadSize, int32_t budget = 0)
+    {
+        if (payloadSize > PayloadMax()) {
+            return nullptr;
+        }
+
+        uint64_t limit = (budget > 0) ? uint64_t(budget) : uint64_t(slots);
+        uint32_t count = SlotsOf(payloadSize);
+        uint64_t pos = hdr->reserve.load(std::memory_order_relaxed);
+        uint32_t pad = 0;
+        do {
+            uint32_t offset = pos % slots;
+            pad = (offset + count > uint32_t(slots)) ? (slots - offset) : 0;
+            if (pos + pad + count - hdr->head.load(std::memory_order_acquire) > limit) {
+                return nullptr;
+            }
+        } while (!hdr->reserve.compare_exchange_weak(pos, pos + pad + count, std::memory_order_relaxed));
+
+        //  环尾部剩余的槽不够时, 用一个填充记录占满
+        if (pad > 0) {
+            rec_t* rec = RecAt(pos);
+            rec->pos = pos;
+            rec->count = pad;
+            rec->kind = KIND_PAD;
+            rec->done.store(1, std::memory_order_relaxed);
+            seqs[pos % slots].store(pos + 1, std::memory_order_release);
+            pos += pad;
+        }
+
+        rec_t* rec = RecAt(pos);
+        rec->pos = pos;
+        rec->count = count;
+        rec->kind = KIND_DATA;
+        rec->done.store(0, std::memory_order_relaxed);
+
+        BUFFER* buf = BufferOfRec(rec);
+        buf->owner = this;
+        buf->cap = count * SLOT_SIZE - sizeof(rec_t) - sizeof(BUFFER);
+
+        MESSAGE* msg = MessageOf(buf);
+        msg->Reset();
+        outstanding.fetch_add(1, std::memory_order_relaxed);
+        return msg;
+    }
+
+    //  [发送方] 发布一条预留的消息, 返回是否需要通知接收方
+    bool Commit(MESSAGE* msg)
+    {
+        rec_t* rec = RecOf(BufferOf(msg));
+        seqs[rec->pos % slots].store(rec->pos + 1, std::memory_order_seq_cst);
+        outstanding.fetch_sub(1, std::memory_order_release);
+        if (0 == hdr->sleeping.load(std::memory_order_seq_cst)) {
+            return false;
+        }
+        return (0 != hdr->sleeping.exchange(0));
+    }
+
+    //  [发送方] 空间不足时调用: 设置等待标志后如果空间已经足够, 返回 true
+    bool Wait(int32_t payloadSize)
+    {
+        hdr->waiting.store(1, std::memory_order_seq_cst);
+        uint64_t pos = hdr->reserve.load(std::memory_order_seq_cst);
+        return (pos + 2 * SlotsOf(payloadSize) - hdr->head.load(std::memory_order_seq_cst) <= uint64_t(slots));
+    }
+
+    //  [接收方, 单线程] 取出下一条已提交的消息到 *msg, 没有时 *msg 为空, 返回 0.
+    //  记录头和消息长度由对端写入, 不可信: 槽数越界、类型未知或者消息超出记录时返回 -1,
+    //  环不再前进, 调用者应当停止使用这个环并断开连接
+    int Pop(MESSAGE** msg)
+    {
+        *msg = nullptr;
+        for (;;) {
+            uint64_t pos = read.load(std::memory_order_relaxed);
+            if (seqs[pos % slots].load(std::memory_order_acquire) != pos + 1) {
+                return 0;
+            }
+
+            //  只读取一次, 对端之后再修改也不影响这里的检查
+            rec_t* rec = RecAt(pos);
+            uint64_t recPos = __atomic_load_n(&(rec->pos), __ATOMIC_RELAXED);
+            uint32_t count = __atomic_load_n(&(rec->count), __ATOMIC_RELAXED);
+            uint16_t kind = __atomic_load_n(&(rec->kind), __ATOMIC_RELAXED);
+            if ((recPos != pos) || (0 == count) || (count > uint32_t(slots) - uint32_t(pos % slots)) ||
+                ((KIND_DATA != kind) && (KIND_PAD != kind))) {
+                return -1;
+            }
+            if (KIND_PAD == kind) {
+                read.store(pos + count, std::memory_order_release);
+                continue;
+            }
+
+            int32_t cap = int32_t(count * SLOT_SIZE - sizeof(rec_t) - sizeof(BUFFER));
+            BUFFER* buf = BufferOfRec(rec);
+            buf->owner = this;
+            buf->cap = cap;
+            MESSAGE* out = MessageOf(buf);
+            int32_t total = (cap >= int32_t(sizeof(MESSAGE))) ? out->TotalLength() : -1;
+            if ((total < int32_t(sizeof(MESSAGE))) || (total > cap)) {
+                return -1;
+            }
+
+            read.store(pos + count, std::memory_order_release);
+            *msg = out;
+            return 0;
+        }
+    }
+
+    //  [接收方] 准备进入空闲: 设置空闲标志后如果又有了新消息, 清除标志并返回 false
+    bool Sleep()
+    {
+        hdr->sleeping.store(1, std::memory_order_seq_cst);
+        uint64_t pos = read.load(std::memory_order_relaxed);
+        if (seqs[pos % slots].load(std::memory_order_seq_cst) != pos + 1) {
+            return true;
+        }
+        hdr->sleeping.store(0, std::memory_order_relaxed);
+        return false;
+    }
+
+    //  任意线程: 接收方释放已处理的消息, 或者发送方放弃一条预留但未提交的消息
+    virtual void Release(BUFFER* buf)
+    {
+        rec_t* rec = RecOf(buf);
+        if (producer) {
+            rec->kind = KIND_PAD;
+            rec->done.store(1, std::memory_order_relaxed);
+            seqs[rec->pos % slots].store(rec->pos + 1, std::memory_order_seq_cst);
+            outstanding.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+
+        rec->done.store(1, std::memory_order_release);
+        Advance();
+    }
+
+    //  [接收方] 越过所有连续的已释放消息, 如果发送方在等待空间就调用 notify
+    void Advance()
+    {
+        bool freed = false;
+        bool broken = false;
+        do {
+            if (advancing.exchange(true, std::memory_order_acquire)) {
+                break;
+            }
+
+            uint64_t head = hdr->head.load(std::memory_order_relaxed);
+            uint64_t end = read.load(std::memory_order_acquire);
+            while (head < end) {
+                rec_t* rec = RecAt(head);
+                if (0 == rec->done.load(std::memory_order_acquire)) {
+                    break;
+                }
+                //  Pop 已经检查过槽数, 这里防止对端之后改写
+                uint32_t count = __atomic_load_n(&(rec->count), __ATOMIC_RELAXED);
+                if ((0 == count) || (count > end - head)) {
+                    broken = true;
+                    break;
+                }
+                head += count;
+                freed = true;
+            }
+            hdr->head.store(head, std::memory_order_seq_cst);
+            advancing.store(false, std::memory_order_release);
+        } while (!broken && HeadReleased());
+
+        if (freed && (0 != hdr->waiting.load(std::memory_order_seq_cst)) && (0 != hdr->waiting.exchange(0))) {
+            if (notify) {
+                notify();
+            }
+        }
+    }
+
+    //  本进程是否已经不再引用环中的消息: 发送方预留的消息都已经提交或者放弃, 接收方取出的消息都已经释放.
+    //  之后才能解除共享内存的映射
+    bool Drained() const
+    {
+        if (producer) {
+            return 0 == outstanding.load(std::memory_order_acquire);
+        }
+        return hdr->head.load(std::memory_order_acquire) >= read.load(std::memory_order_acquire);
+    }
+
+public:
+    std::function<void()> notify;  //  [接收方] 释放空间后需要通知发送方时调用
+
+private:
+    enum : uint16_t {
+        KIND_DATA = 0,
+        KIND_PAD = 1,
+    };
+
+    struct hdr_t {
+        uint32_t magic;
+        uint32_t slots;
+        alignas(64) std::atomic<uint64_t> reserve;  //  发送方已预留到的绝对槽号
+        alignas(64) std::atomic<uint64_t> head;     //  接收方已释放到的绝对槽号
+        std::atomic<uint32_t> sleeping;             //  接收方空闲, 提交后需要通知
+        std::atomic<uint32_t> waiting;              //  发送方等待空间, 释放后需要通知
+    };
+
+    struct rec_t {
+        uint64_t pos;                //  首槽的绝对槽号
+        uint32_t count;              //  占用的槽数
+        uint16_t kind;               //  数据或者填充
+        uint16_t reserved;
+        std::atomic<uint32_t> done;  //  是否已经释放
+        uint32_t reserved2;
+    };
+    static_assert((sizeof(rec_t) % sizeof(void*) == 0), "make size align");
+
+    inline uint32_t SlotsOf(int32_t payloadSize) const
+    {
+        return (sizeof(rec_t) + sizeof(BUFFER) + sizeof(MESSAGE) + payloadSize + SLOT_SIZE - 1) / SLOT_SIZE;
+    }
+
+    inline rec_t* RecAt(uint64_t pos) const
+    {
+        return (rec_t*)(data + (pos % slots) * SLOT_SIZE);
+    }
+
+    static inline BUFFER* BufferOfRec(rec_t* rec)
+    {
+        return (BUFFER*)((uint8_t*)rec + sizeof(rec_t));
+    }
+
+    static inline rec_t* RecOf(BUFFER* buf)
+    {
+        return (rec_t*)((uint8_t*)buf - sizeof(rec_t));
+    }
+
+    inline bool HeadReleased() const
+    {
+        uint64_t head = hdr->head.load(std::memory_order_acquire);
+        return (head < read.load(std::memory_order_acquire)) &&
+               (0 != RecAt(head)->done.load(std::memory_order_acquire)) &&
+               !advancing.load(std::memory_order_acquire);
+    }
+
+private:
+    hdr_t* hdr;
+    std::atomic<uint64_t>* seqs;
+    uint8_t* data;
+    int32_t slots;
+    bool producer;
+    std::atomic<uint64_t> read;     //  [接收方] 已经取出到的绝对槽号
+    std::atomic<bool> advancing;    //  [接收方] 是否有线程正在推进释放位置
+    std::atomic<int32_t> outstanding;  //  [发送方] 已经预留还没有提交或者放弃的消息数
+};
+
+#endif  // SHMRING_H
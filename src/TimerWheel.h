@@ -0,0 +1,171 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <cstdint>
+#include <functional>
+
+#include "MESSAGE.h"
+
+//  定时器: 侵入式节点, 由使用者分配, 在到期或者取消之前不能释放
+struct TIMER : public NODE {
+    uint64_t expire;                 //  到期的 tick
+    std::function<void()> callback;  //  到期时在定时器所在的事件循环中执行, 可以在其中重新启动定时器
+
+    TIMER() : expire(0)
+    {
+    }
+
+    //  是否正在等待到期
+    inline bool Armed() const
+    {
+        return !empty();
+    }
+};
+
+//  分层时间轮: LEVELS 层, 每层 SLOTS 个槽, 第 L 层每个槽跨 SLOTS^L 个 tick.
+//  定时器放在到期时间与当前时间第一个不同的那一层, 该层的槽转到时再下放到低层, 在第 0 层到期.
+//  启动和取消都是 O(1) 的链表操作, 推进时直接跳到下一个有定时器到期(或者需要下放)的 tick.
+//  不加锁, 只能在一个线程(一个事件循环)中使用
+class TimerWheel
+{
+public:
+    enum : uint32_t {
+        SLOT_BITS = 8,
+        SLOTS = 1 << SLOT_BITS,
+        LEVELS = 4,  //  4 层覆盖 2^32 个 tick, 更远的定时器在最高层循环下放
+    };
+
+    explicit TimerWheel(uint64_t now) : current(now), count(0)
+    {
+    }
+
+    //  启动(或者重新启动)定时器, 在 expire 时到期; 不晚于当前时间时在下一个 tick 到期
+    void Add(TIMER* timer, uint64_t expire)
+    {
+        if (timer->Armed()) {
+            Cancel(timer);
+        }
+        timer->expire = (expire > current) ? expire : (current + 1);
+        Place(timer);
+        count++;
+    }
+
+    void Cancel(TIMER* timer)
+    {
+        if (!timer->Armed()) {
+            return;
+        }
+        NODE::remove(timer->prev, timer->next);
+        timer->next = timer;
+        timer->prev = timer;
+        count--;
+    }
+
+    //  推进到 now, 执行所有到期的定时器的回调, 返回到期的定时器个数
+    uint32_t Advance(uint64_t now)
+    {
+        uint32_t fired = 0;
+        while (current < now) {
+            //  跳过没有定时器到期(也不需要下放)的 tick
+            uint64_t next = NextTick();
+            if (next > now) {
+                current = now;
+                break;
+            }
+
+            current = next;
+            for (uint32_t level = LEVELS - 1; level > 0; level--) {
+                if (0 == (current & ((uint64_t(1) << (level * SLOT_BITS)) - 1))) {
+                    Cascade(level);
+                }
+            }
+
+            //  回调中可能启动或者取消其他定时器(包括同一批到期的), 所以先把整个槽摘下来再逐个执行
+            NODE due;
+            Splice(&(wheel[0][current & (SLOTS - 1)]), &due);
+            while (!due.empty()) {
+                TIMER* timer = (TIMER*)due.pop_front();
+                timer->next = timer;
+                timer->prev = timer;
+                count--;
+                fired++;
+                timer->callback();
+            }
+        }
+        return fired;
+    }
+
+    //  下一次需要推进的 tick(最近的到期或者下放时间, 不晚于最早的到期时间); 没有定时器时返回 UINT64_MAX
+    uint64_t NextTick() const
+    {
+        if (0 == count) {
+            return UINT64_MAX;
+        }
+
+        for (uint32_t level = 0; level < LEVELS; level++) {
+            uint32_t shift = level * SLOT_BITS;
+            uint32_t index = uint32_t(current >> shift) & (SLOTS - 1);
+            for (uint32_t slot = index + 1; slot < SLOTS; slot++) {
+                if (!wheel[level][slot].empty()) {
+                    uint64_t base = (current >> (shift + SLOT_BITS)) << (shift + SLOT_BITS);
+                    return base + (uint64_t(slot) << shift);
+                }
+            }
+        }
+
+        //  只剩下超出范围的定时器, 等最高层转到下一个槽
+        uint32_t shift = (LEVELS - 1) * SLOT_BITS;
+        return ((current >> shift) + 1) << shift;
+    }
+
+    inline uint64_t Now() const
+    {
+        return current;
+    }
+
+    inline uint32_t Size() const
+    {
+        return count;
+    }
+
+private:
+    void Place(TIMER* timer)
+    {
+        uint64_t diff = timer->expire ^ current;
+        uint32_t level = 0;
+        while ((level < LEVELS - 1) && (0 != (diff >> ((level + 1) * SLOT_BITS)))) {
+            level++;
+        }
+        wheel[level][(timer->expire >> (level * SLOT_BITS)) & (SLOTS - 1)].push_back(timer);
+    }
+
+    //  第 level 层当前的槽转到了: 其中的定时器重新按到期时间放到低层
+    void Cascade(uint32_t level)
+    {
+        NODE moving;
+        Splice(&(wheel[level][(current >> (level * SLOT_BITS)) & (SLOTS - 1)]), &moving);
+        while (!moving.empty()) {
+            Place((TIMER*)moving.pop_front());
+        }
+    }
+
+    //  把 from 中的所有节点移到空链表 to 中
+    static void Splice(NODE* from, NODE* to)
+    {
+        if (from->empty()) {
+            return;
+        }
+        to->next = from->next;
+        to->prev = from->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+        from->next = from;
+        from->prev = from;
+    }
+
+    NODE wheel[LEVELS][SLOTS];
+    uint64_t current;  //  已经推进到的 tick
+    uint32_t count;    //  正在等待到期的定时器个数
+};
+
+#endif  // TIMERWHEEL_H
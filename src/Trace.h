@@ -0,0 +1,300 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//  二进制跟踪日志
+//
+//  - 级别在编译期决定: 高于 WE_TRACE_LEVEL 的 TRACE_XXX 宏展开为空, 参数也不会被求值
+//  - 运行时每个线程写自己的环(定长记录, 写满后覆盖最旧的记录), 写入时不加锁、不格式化
+//  - Trace::Dump 把所有线程的环写入文件, 之后用 Trace::Decode(we-trace 工具)离线解码为文本
+
+#define WE_TRACE_ERROR 1
+#define WE_TRACE_WARN 2
+#define WE_TRACE_INFO 3
+#define WE_TRACE_DEBUG 4
+
+#ifndef WE_TRACE_LEVEL
+#define WE_TRACE_LEVEL WE_TRACE_INFO
+#endif
+
+//  每个线程的环中的记录数, 必须是 2 的幂
+#ifndef WE_TRACE_RING
+#define WE_TRACE_RING 16384
+#endif
+
+#if WE_TRACE_LEVEL >= WE_TRACE_ERROR
+#define TRACE_ERROR(event, ...) Trace::Write(WE_TRACE_ERROR, (event), ##__VA_ARGS__)
+#else
+#define TRACE_ERROR(event, ...) ((void)0)
+#endif
+
+#if WE_TRACE_LEVEL >= WE_TRACE_WARN
+#define TRACE_WARN(event, ...) Trace::Write(WE_TRACE_WARN, (event), ##__VA_ARGS__)
+#else
+#define TRACE_WARN(event, ...) ((void)0)
+#endif
+
+#if WE_TRACE_LEVEL >= WE_TRACE_INFO
+#define TRACE_INFO(event, ...) Trace::Write(WE_TRACE_INFO, (event), ##__VA_ARGS__)
+#else
+#define TRACE_INFO(event, ...) ((void)0)
+#endif
+
+#if WE_TRACE_LEVEL >= WE_TRACE_DEBUG
+#define TRACE_DEBUG(event, ...) Trace::Write(WE_TRACE_DEBUG, (event), ##__VA_ARGS__)
+#else
+#define TRACE_DEBUG(event, ...) ((void)0)
+#endif
+
+//  跟踪事件, 解码时按 TraceEventInfo 中的格式输出(最多 4 个参数)
+enum {
+    TRACE_EVENT = 1,          //  协议层事件
+    TRACE_RECONNECT,          //  断开后重连
+    TRACE_LISTEN_FAILED,      //  监听失败
+    TRACE_CONNECT_FAILED,     //  连接失败
+    TRACE_CONNECT_RETRY,      //  连接失败后定时重试
+    TRACE_CONNECTED,          //  连接成功
+    TRACE_ACCEPT_FAILED,      //  接受连接失败
+    TRACE_ACCEPTED,           //  接受连接成功
+    TRACE_READ_FAILED,        //  读失败
+    TRACE_READ_DONE,          //  读完成
+    TRACE_INVALID_LENGTH,     //  收到的消息长度非法
+    TRACE_WRITE_FAILED,       //  写失败
+    TRACE_WRITE_DONE,         //  写完成
+    TRACE_MIGRATE_FAILED,     //  流迁移失败
+    TRACE_SHM_CREATE_FAILED,  //  创建共享内存失败
+    TRACE_SHM_OPEN_FAILED,    //  打开共享内存失败
+    TRACE_INFLATE_FAILED,     //  解压收到的消息失败
+    TRACE_INVALID_FRAG,       //  收到的分片非法
+    TRACE_PEER_TIMEOUT,       //  长时间没有收到对端的数据, 判定对端失效
+    TRACE_ROUTE_DROP,         //  转发的消息被丢弃(跳数用完、尾部非法或者下一跳的发送队列已满)
+    TRACE_PIN_FAILED,         //  事件循环线程绑定CPU核失败
+    TRACE_SHM_INVALID,        //  共享内存环中对端写入的记录非法
+    TRACE_EVENT_MAX,
+};
+
+struct TraceEventInfo {
+    const char* name;
+    const char* format;
+};
+
+inline const TraceEventInfo& TraceEventOf(uint16_t event)
+{
+    static const TraceEventInfo infos[TRACE_EVENT_MAX] = {
+        {"unknown", "%llx %llx %llx %llx"},
+        {"event", "stream=%llx event=%llu param1=%llx param2=%llx"},
+        {"reconnect", "stream=%llx"},
+        {"listen.failed", "error=%llu"},
+        {"connect.failed", "stream=%llx error=%llu"},
+        {"connect.retry", "stream=%llx"},
+        {"connected", "stream=%llx"},
+        {"accept.failed", "error=%llu"},
+        {"accepted", "stream=%llx"},
+        {"read.failed", "stream=%llx target=%llu error=%llu"},
+        {"read.done", "stream=%llx target=%llu bytes=%llu"},
+        {"read.invalid", "stream=%llx target=%llu length=%llu"},
+        {"write.failed", "stream=%llx target=%llu error=%llu"},
+        {"write.done", "stream=%llx target=%llu bytes=%llu"},
+        {"migrate.failed", "stream=%llx target=%llu error=%llu"},
+        {"shm.create.failed", "stream=%llx target=%llu errno=%llu"},
+        {"shm.open.failed", "stream=%llx target=%llu errno=%llu"},
+        {"inflate.failed", "stream=%llx target=%llu length=%llu"},
+        {"frag.invalid", "stream=%llx target=%llu total=%llu offset=%llu"},
+        {"peer.timeout", "stream=%llx target=%llu silent_ms=%llu"},
+        {"route.drop", "stream=%llx target=%llu dest=%llu hops=%llu"},
+        {"loop.pin_failed", "loop=%llu core=%llu err=%llu"},
+        {"shm.invalid", "stream=%llx target=%llu"},
+    };
+    return infos[(event < TRACE_EVENT_MAX) ? event : 0];
+}
+
+struct TraceRecord {
+    uint64_t nanos;  //  steady_clock 时间
+    uint32_t seq;    //  记录序号, 读者据此判断记录是否正在被改写
+    uint16_t event;
+    uint16_t level;
+    uint64_t args[4];
+};
+static_assert((sizeof(TraceRecord) == 48), "fixed size record");
+
+class Trace
+{
+public:
+    enum : uint32_t {
+        MAGIC = 0x43525457,  //  'WTRC'
+        VERSION = 1,
+    };
+
+    template <typename... Args>
+    static inline void Write(uint16_t level, uint16_t event, Args... args)
+    {
+        static_assert(sizeof...(Args) <= 4, "at most 4 trace arguments");
+        uint64_t values[4 + 1] = {Arg(args)..., 0};
+
+        ring_t* ring = Local();
+        uint32_t seq = ring->head.load(std::memory_order_relaxed);
+        TraceRecord* rec = &(ring->records[seq & (WE_TRACE_RING - 1)]);
+        __atomic_store_n(&(rec->seq), 0, __ATOMIC_RELAXED);
+        std::atomic_thread_fence(std::memory_order_release);
+        rec->nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now().time_since_epoch())
+                         .count();
+        rec->event = event;
+        rec->level = level;
+        for (size_t i = 0; i < 4; i++) {
+            rec->args[i] = (i < sizeof...(Args)) ? values[i] : 0;
+        }
+        __atomic_store_n(&(rec->seq), seq + 1, __ATOMIC_RELEASE);
+        ring->head.store(seq + 1, std::memory_order_release);
+    }
+
+    //  把所有线程的环写入文件, 可以在任意线程中调用, 返回 0 表示成功
+    static int Dump(const char* path)
+    {
+        FILE* out = fopen(path, "wb");
+        if (nullptr == out) {
+            return -1;
+        }
+
+        std::lock_guard<std::mutex> guard(Registry().lock);
+        uint32_t header[3] = {MAGIC, VERSION, uint32_t(Registry().rings.size())};
+        fwrite(header, sizeof(header), 1, out);
+
+        std::vector<TraceRecord> records;
+        for (auto ring : Registry().rings) {
+            records.clear();
+            uint32_t head = ring->head.load(std::memory_order_acquire);
+            uint32_t count = std::min<uint32_t>(head, WE_TRACE_RING);
+            for (uint32_t seq = head - count; seq != head; seq++) {
+                //  顺序锁读: 拷贝前后两次读到的 seq 都是 seq + 1 时, 拷贝的内容才是完整的一条记录,
+                //  否则写者已经绕回来正在(或已经)改写这条记录
+                TraceRecord* src = &(ring->records[seq & (WE_TRACE_RING - 1)]);
+                uint32_t before = __atomic_load_n(&(src->seq), __ATOMIC_ACQUIRE);
+                if (before != seq + 1) {
+                    continue;
+                }
+                TraceRecord rec;
+                std::memcpy(&rec, src, sizeof(rec));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                uint32_t after = __atomic_load_n(&(src->seq), __ATOMIC_RELAXED);
+                if (after != seq + 1) {
+                    continue;
+                }
+                rec.seq = after;
+                records.push_back(rec);
+            }
+
+            uint64_t tid = ring->tid;
+            uint32_t size = uint32_t(records.size());
+            fwrite(&tid, sizeof(tid), 1, out);
+            fwrite(&size, sizeof(size), 1, out);
+            if (size > 0) {
+                fwrite(records.data(), sizeof(TraceRecord), size, out);
+            }
+        }
+
+        return (0 == fclose(out)) ? 0 : -1;
+    }
+
+    //  把 Dump 写出的文件按时间顺序解码为文本, 返回 0 表示成功
+    static int Decode(FILE* in, FILE* out)
+    {
+        uint32_t header[3] = {0};
+        if ((1 != fread(header, sizeof(header), 1, in)) || (MAGIC != header[0]) || (VERSION != header[1])) {
+            return -1;
+        }
+
+        std::vector<std::pair<TraceRecord, uint64_t>> all;
+        for (uint32_t i = 0; i < header[2]; i++) {
+            uint64_t tid = 0;
+            uint32_t size = 0;
+            if ((1 != fread(&tid, sizeof(tid), 1, in)) || (1 != fread(&size, sizeof(size), 1, in))) {
+                return -1;
+            }
+            for (uint32_t n = 0; n < size; n++) {
+                TraceRecord rec;
+                if (1 != fread(&rec, sizeof(rec), 1, in)) {
+                    return -1;
+                }
+                all.push_back(std::make_pair(rec, tid));
+            }
+        }
+
+        std::stable_sort(all.begin(), all.end(),
+                         [](const std::pair<TraceRecord, uint64_t>& a, const std::pair<TraceRecord, uint64_t>& b) {
+                             return a.first.nanos < b.first.nanos;
+                         });
+
+        static const char* levels[] = {"?", "E", "W", "I", "D"};
+        uint64_t start = all.empty() ? 0 : all.front().first.nanos;
+        for (auto& item : all) {
+            const TraceRecord& rec = item.first;
+            const TraceEventInfo& info = TraceEventOf(rec.event);
+            fprintf(out, "%14.3fus %s t%llu %-18s ", (rec.nanos - start) / 1000.0, levels[(rec.level <= 4) ? rec.level : 0],
+                    (unsigned long long)item.second, info.name);
+            fprintf(out, info.format, (unsigned long long)rec.args[0], (unsigned long long)rec.args[1],
+                    (unsigned long long)rec.args[2], (unsigned long long)rec.args[3]);
+            fprintf(out, "\n");
+        }
+        return 0;
+    }
+
+private:
+    struct ring_t {
+        std::atomic<uint32_t> head;  //  下一条记录的序号
+        uint64_t tid;
+        TraceRecord records[WE_TRACE_RING];
+    };
+
+    struct registry_t {
+        std::mutex lock;
+        std::vector<ring_t*> rings;  //  线程退出后环仍然保留, 以便事后 Dump
+        uint64_t nextTid;
+
+        registry_t() : nextTid(0)
+        {
+        }
+    };
+
+    static registry_t& Registry()
+    {
+        static registry_t registry;
+        return registry;
+    }
+
+    static ring_t* Local()
+    {
+        static thread_local ring_t* ring = nullptr;
+        if (nullptr == ring) {
+            ring = new ring_t();
+            ring->head.store(0);
+            std::lock_guard<std::mutex> guard(Registry().lock);
+            ring->tid = ++Registry().nextTid;
+            Registry().rings.push_back(ring);
+        }
+        return ring;
+    }
+
+    template <typename T>
+    static inline uint64_t Arg(T* value)
+    {
+        return uint64_t(uintptr_t(value));
+    }
+
+    template <typename T>
+    static inline uint64_t Arg(T value)
+    {
+        return uint64_t(value);
+    }
+};
+
+#endif  // TRACE_H
@@ -0,0 +1,296 @@
+#ifndef URINGQUEUE_H
+#define URINGQUEUE_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//  io_uring 的提交队列和完成队列, 直接使用系统调用(不依赖 liburing).
+//
+//  - 准备好的请求(PrepRecv/PrepSendmsg)先留在提交队列中, Submit 时一次系统调用全部提交,
+//    提交队列满时自动先提交一次
+//  - 完成事件通过注册的 eventfd 通知(Notify), 使用者在自己的事件循环中等待它可读, 然后 Reap
+//  - 要求内核支持 IORING_FEAT_NODROP(完成队列满时不丢弃完成事件)和 IORING_FEAT_FAST_POLL
+//    (套接字没有数据时由内核等待就绪, 不占用内核线程), 否则 Init 失败
+//  - 不加锁, 只能在一个线程中使用
+class UringQueue
+{
+public:
+    UringQueue()
+        : ringFd(-1), sqMap(nullptr), sqMapLen(0), cqMap(nullptr), cqMapLen(0), sqes(nullptr), sqesLen(0),
+          sqHead(nullptr), sqTail(nullptr), sqFlags(nullptr), sqMask(0), sqEntries(0), cqHead(nullptr),
+          cqTail(nullptr), cqMask(0), cqes(nullptr), tail(0), submitted(0)
+    {
+    }
+
+    ~UringQueue()
+    {
+#if defined(__linux__)
+        if (nullptr != sqes) {
+            munmap(sqes, sqesLen);
+        }
+        if ((nullptr != cqMap) && (cqMap != sqMap)) {
+            munmap(cqMap, cqMapLen);
+        }
+        if (nullptr != sqMap) {
+            munmap(sqMap, sqMapLen);
+        }
+        if (ringFd >= 0) {
+            close(ringFd);
+        }
+#endif
+    }
+
+    UringQueue(const UringQueue&) = delete;
+    UringQueue& operator=(const UringQueue&) = delete;
+
+    //  创建至少 entries 项的队列(完成队列是它的两倍)
+    int Init(uint32_t entries)
+    {
+#if defined(__linux__)
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int fd = int(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) {
+            return -1;
+        }
+        ringFd = fd;
+
+        if ((0 == (params.features & IORING_FEAT_NODROP)) || (0 == (params.features & IORING_FEAT_FAST_POLL))) {
+            return -1;
+        }
+
+        sqMapLen = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cqMapLen = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = (0 != (params.features & IORING_FEAT_SINGLE_MMAP));
+        if (single) {
+            sqMapLen = (cqMapLen > sqMapLen) ? cqMapLen : sqMapLen;
+            cqMapLen = sqMapLen;
+        }
+
+        sqMap = Map(sqMapLen, IORING_OFF_SQ_RING);
+        if (nullptr == sqMap) {
+            return -1;
+        }
+        cqMap = single ? sqMap : Map(cqMapLen, IORING_OFF_CQ_RING);
+        if (nullptr == cqMap) {
+            return -1;
+        }
+        sqesLen = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)Map(sqesLen, IORING_OFF_SQES);
+        if (nullptr == sqes) {
+            return -1;
+        }
+
+        uint8_t* sq = (uint8_t*)sqMap;
+        sqHead = (uint32_t*)(sq + params.sq_off.head);
+        sqTail = (uint32_t*)(sq + params.sq_off.tail);
+        sqFlags = (uint32_t*)(sq + params.sq_off.flags);
+        sqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        //  SQE 按顺序使用, 索引数组固定为恒等映射
+        uint32_t* array = (uint32_t*)(sq + params.sq_off.array);
+        for (uint32_t i = 0; i < sqEntries; i++) {
+            array[i] = i;
+        }
+
+        uint8_t* cq = (uint8_t*)cqMap;
+        cqHead = (uint32_t*)(cq + params.cq_off.head);
+        cqTail = (uint32_t*)(cq + params.cq_off.tail);
+        cqMask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        tail = *sqTail;
+        submitted = tail;
+        return 0;
+#else
+        (void)entries;
+        return -1;
+#endif
+    }
+
+    //  创建并注册一个 eventfd, 之后每次产生完成事件时它都会变为可读. 返回的描述符归调用者所有, 失败时返回 -1
+    int Notify()
+    {
+#if defined(__linux__)
+        int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (efd < 0) {
+            return -1;
+        }
+        if (0 != syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_EVENTFD, &efd, 1)) {
+            close(efd);
+            return -1;
+        }
+        return efd;
+#else
+        return -1;
+#endif
+    }
+
+    //  从 fd 读取最多 len 字节到 buf; 完成时 res 为读到的字节数, 0 表示对端已经关闭, 负数为 -errno.
+    //  提交队列满且无法提交时返回 false
+    bool PrepRecv(int fd, void* buf, uint32_t len, uint64_t data)
+    {
+#if defined(__linux__)
+        io_uring_sqe* sqe = Next();
+        if (nullptr == sqe) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->addr = uint64_t(uintptr_t(buf));
+        sqe->len = len;
+        sqe->user_data = data;
+        Push();
+        return true;
+#else
+        (void)fd, (void)buf, (void)len, (void)data;
+        return false;
+#endif
+    }
+
+    //  在 fd 上发送 msg 描述的数据(不产生 SIGPIPE); 完成时 res 为发送的字节数(可能少于请求的长度), 负数为 -errno.
+    //  msg 及其缓冲区列表在完成之前不能释放
+    bool PrepSendmsg(int fd, const struct msghdr* msg, uint64_t data)
+    {
+#if defined(__linux__)
+        io_uring_sqe* sqe = Next();
+        if (nullptr == sqe) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = uint64_t(uintptr_t(msg));
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = data;
+        Push();
+        return true;
+#else
+        (void)fd, (void)msg, (void)data;
+        return false;
+#endif
+    }
+
+    //  提交所有准备好的请求, 返回提交的个数; 内核暂时无法接受(EAGAIN/EBUSY)时返回 -1, 请求留在队列中下次再提交
+    int Submit()
+    {
+#if defined(__linux__)
+        uint32_t count = tail - submitted;
+        if (0 == count) {
+            return 0;
+        }
+        int ret = int(syscall(__NR_io_uring_enter, ringFd, count, 0, 0, nullptr, 0));
+        if (ret < 0) {
+            return -1;
+        }
+        submitted += uint32_t(ret);
+        return ret;
+#else
+        return -1;
+#endif
+    }
+
+    //  完成队列中是否有还没有处理的完成事件(不进入内核), 用于忙轮询
+    inline bool Ready() const
+    {
+#if defined(__linux__)
+        return *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+#else
+        return false;
+#endif
+    }
+
+    //  对每个完成事件执行 fn(data, res), 返回处理的个数. fn 中可以准备和提交新的请求
+    template <typename F>
+    uint32_t Reap(F fn)
+    {
+        uint32_t count = 0;
+#if defined(__linux__)
+        uint32_t head = *cqHead;
+        for (;;) {
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                //  完成队列曾经满过: 内核暂存的完成事件要进入一次内核才能移到完成队列中
+                if (0 == (__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)) {
+                    break;
+                }
+                syscall(__NR_io_uring_enter, ringFd, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                    break;
+                }
+                continue;
+            }
+
+            //  先归还完成队列中的位置再处理, fn 中提交的请求可以立即使用
+            io_uring_cqe* cqe = &(cqes[head & cqMask]);
+            uint64_t data = cqe->user_data;
+            int32_t res = cqe->res;
+            head++;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            fn(data, res);
+            count++;
+        }
+#else
+        (void)fn;
+#endif
+        return count;
+    }
+
+private:
+#if defined(__linux__)
+    void* Map(size_t len, off_t offset)
+    {
+        void* addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, offset);
+        return (MAP_FAILED == addr) ? nullptr : addr;
+    }
+
+    //  下一个空闲的 SQE(已清零), 提交队列满时先提交
+    io_uring_sqe* Next()
+    {
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            Submit();
+            if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+                return nullptr;
+            }
+        }
+        io_uring_sqe* sqe = &(sqes[tail & sqMask]);
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    inline void Push()
+    {
+        tail++;
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    }
+#endif
+
+    int ringFd;
+    void* sqMap;
+    size_t sqMapLen;
+    void* cqMap;
+    size_t cqMapLen;
+    struct io_uring_sqe* sqes;
+    size_t sqesLen;
+    uint32_t* sqHead;
+    uint32_t* sqTail;
+    uint32_t* sqFlags;
+    uint32_t sqMask;
+    uint32_t sqEntries;
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t cqMask;
+    struct io_uring_cqe* cqes;
+    uint32_t tail;       //  已经准备好的请求数(提交队列的本地尾部)
+    uint32_t submitted;  //  已经提交给内核的请求数
+};
+
+#endif  // URINGQUEUE_H
@@ -0,0 +1,998 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MessagePool.h"
+#include "SMQTransport.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static int64_t NowNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+//  测试消息 payload 的内容(发送时间之后的部分), 为空时不填充
+static std::vector<uint8_t> payloadSample;
+
+//  生成 size 字节的 payload 样本: text 是重复度很高的行情记录(接近实际的跨机房数据), random 不可压缩
+static int MakeSample(const std::string& kind, size_t size)
+{
+    payloadSample.clear();
+    if ("none" == kind) {
+        return 0;
+    }
+
+    srand(1);
+    if ("random" == kind) {
+        payloadSample.resize(size);
+        for (auto& byte : payloadSample) {
+            byte = uint8_t(rand());
+        }
+        return 0;
+    }
+
+    if ("text" == kind) {
+        static const char* symbols[] = {"AAPL", "MSFT", "GOOG", "AMZN", "TSLA", "NVDA", "META", "BABA"};
+        char line[160] = {0};
+        for (uint64_t seq = 0; payloadSample.size() < size; seq++) {
+            int n = snprintf(line, sizeof(line),
+                             "{\"seq\":%llu,\"sym\":\"%s\",\"bid\":%d.%02d,\"ask\":%d.%02d,\"qty\":%d,\"venue\":\"XNAS\"}\n",
+                             (unsigned long long)seq, symbols[rand() % 8], 100 + rand() % 20, rand() % 100,
+                             120 + rand() % 20, rand() % 100, (rand() % 100) * 100);
+            payloadSample.insert(payloadSample.end(), line, line + n);
+        }
+        payloadSample.resize(size);
+        return 0;
+    }
+    return -1;
+}
+
+//  测试消息的 payload 开头 8 字节是发送时间(纳秒), 0 表示预热消息
+static inline int64_t StampOf(MESSAGE* msg)
+{
+    int64_t stamp = 0;
+    std::memcpy(&stamp, PayloadOf<char*>(msg), sizeof(stamp));
+    return stamp;
+}
+
+static inline void Stamp(MESSAGE* msg, int64_t stamp)
+{
+    std::memcpy(PayloadOf<char*>(msg), &stamp, sizeof(stamp));
+}
+
+class BenchProtocol
+{
+public:
+    BenchProtocol(bool isServer)
+        : received(0), warmed(0), allocator(nullptr), server(isServer), echo(false), resend(false), record(false), probe(0),
+          limit(0)
+    {
+    }
+
+    //  服务端: 记录延迟后释放消息; echo 为真时原样回给发送方, 预热消息和 RPC 请求总是原样返回.
+    //  pingpong 的客户端: 记录往返延迟, 没有达到 limit 时立即发送下一条
+    virtual int32_t HandleMessage(void* stream, MESSAGE* msg)
+    {
+        if (0 != msg->session) {
+            answer(msg);
+            return ACTION_NONE;
+        }
+
+        int64_t stamp = StampOf(msg);
+        if (0 == stamp) {
+            if (server) {
+                Reply(msg);
+            } else {
+                warmed.fetch_add(1, std::memory_order_relaxed);
+                allocator->Free(msg);
+            }
+            return ACTION_NONE;
+        }
+
+        if (echo) {
+            Reply(msg);
+            return ACTION_NONE;
+        }
+
+        if ((0 != probe) && (msg->PayloadLength() != probe)) {
+            allocator->Free(msg);
+            return ACTION_NONE;
+        }
+
+        int64_t now = NowNanos();
+        uint64_t n = received.fetch_add(1, std::memory_order_relaxed);
+        if (record && (n < latency.size())) {
+            latency[n] = now - stamp;
+        }
+
+        if (resend && ((n + 1) < limit)) {
+            Stamp(msg, NowNanos());
+            Reply(msg);
+            return ACTION_NONE;
+        }
+
+        allocator->Free(msg);
+        return ACTION_NONE;
+    }
+
+    void Reply(MESSAGE* msg)
+    {
+        msg->Target(msg->Source());
+        post(msg);
+    }
+
+    void Reset(uint64_t count)
+    {
+        received.store(0);
+        warmed.store(0);
+        limit = count;
+        latency.assign(record ? count : 0, 0);
+    }
+
+public:
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> warmed;
+    MessageAllocatorPool* allocator;
+    std::function<void(MESSAGE*)> post;    //  回复消息时使用
+    std::function<void(MESSAGE*)> answer;  //  回复 RPC 请求时使用
+    bool server;  //  服务端总是原样返回预热消息
+    bool echo;    //  服务端原样返回所有消息
+    bool resend;  //  客户端收到回复后发送下一条, 直到 limit 条
+    bool record;  //  记录每条消息的延迟
+    int32_t probe;  //  不为 0 时只统计 payload 为该长度的消息, 其他消息(背景流量)直接释放
+    uint64_t limit;
+    std::vector<int64_t> latency;
+};
+
+typedef SMQTransport<BenchProtocol, MessageAllocatorPool> BenchTransport;
+
+struct BenchOptions {
+    std::vector<int32_t> sizes;
+    int64_t count;
+    int64_t bytes;  //  每个用例最多发送的字节数, 大消息据此减少条数
+    int32_t clients;
+    int32_t loops;
+    int32_t shm;
+    int32_t port;
+    int64_t queue;  //  每个通道发送队列的字节上限, 0 表示不限制
+    int32_t bulk;   //  priority 用例中背景流量的消息大小
+    int32_t frag;   //  分片大小, 小于 0 时使用传输层的默认值
+    int32_t stripes;  //  客户端到服务端每个通道的流数
+    int32_t io;       //  套接字收发的方式, SMQTransport::IO_ASIO 或者 IO_URING
+    int32_t spin;     //  事件循环空闲多久(微秒)之后睡眠, 见 SMQTransport::SetPolling
+    int32_t busyPoll; //  TCP 连接的 SO_BUSY_POLL(微秒)
+    int32_t compress;     //  发送时压缩 payload 不小于该长度的消息, 0 表示不压缩
+    std::string payload;  //  payload 的内容: none/text/random
+    FILE* out;
+    const char* trace;  //  结束时把跟踪日志写入该文件
+
+    BenchOptions() : count(100000), bytes(256LL * 1024 * 1024), clients(4), loops(1), shm(-1), port(9090), queue(0), bulk(300000), frag(-1), stripes(1), io(BenchTransport::IO_ASIO), spin(0), busyPoll(0), compress(0), payload("none"), out(stdout), trace(nullptr)
+    {
+        int32_t defaults[] = {8, 64, 512, 4096, 32768, 262144, 1048576};
+        sizes.assign(defaults, defaults + sizeof(defaults) / sizeof(defaults[0]));
+    }
+
+    int64_t CountOf(int32_t size) const
+    {
+        return std::max<int64_t>(100, std::min<int64_t>(count, bytes / size));
+    }
+};
+
+struct BenchResult {
+    const char* bench;
+    const char* latencyKind;
+    int32_t size;
+    int32_t clients;
+    int64_t count;
+    double seconds;
+    std::vector<int64_t>* latency;
+    bool done;
+    uint64_t wireBytes;  //  客户端写到网络上的字节数
+};
+
+static double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static MESSAGE* NewMessage(BenchTransport* transport, int32_t size, uint16_t target, int64_t stamp)
+{
+    MESSAGE* msg = transport->Alloc(target, size);
+    Q_ASSERT(nullptr != msg);
+    msg->Type(MESSAGE::TYPE_USER);
+    msg->PayloadLength(size);
+    if (!payloadSample.empty()) {
+        std::memcpy(PayloadOf<uint8_t*>(msg), payloadSample.data(), std::min<size_t>(size, payloadSample.size()));
+    }
+    Stamp(msg, stamp);
+    return msg;
+}
+
+static bool WaitCount(std::atomic<uint64_t>& counter, uint64_t count, double timeout)
+{
+    Clock::time_point start = Clock::now();
+    while (counter.load(std::memory_order_relaxed) < count) {
+        if (SecondsSince(start) > timeout) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    return true;
+}
+
+static void Report(const BenchOptions& opts, const BenchResult& result)
+{
+    std::vector<int64_t>& lat = *(result.latency);
+    std::sort(lat.begin(), lat.end());
+
+    double pct[4] = {0, 0, 0, 0};
+    if (!lat.empty()) {
+        double ratios[3] = {0.50, 0.99, 0.999};
+        for (int i = 0; i < 3; i++) {
+            size_t index = std::min(lat.size() - 1, size_t(ratios[i] * lat.size()));
+            pct[i] = lat[index] / 1000.0;
+        }
+        pct[3] = lat.back() / 1000.0;
+    }
+
+    double msgs = result.count / result.seconds;
+    std::fprintf(opts.out,
+                 "{\"bench\":\"%s\",\"size\":%d,\"count\":%lld,\"clients\":%d,\"loops\":%d,\"stripes\":%d,\"io\":\"%s\",\"spin\":%d,"
+                 "\"shm\":%s,"
+                 "\"seconds\":%.6f,\"msgs_per_sec\":%.0f,\"mb_per_sec\":%.2f,\"latency\":\"%s\","
+                 "\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f,\"payload\":\"%s\","
+                 "\"compress\":%d,\"wire_bytes\":%llu,\"ok\":%s}\n",
+                 result.bench, result.size, (long long)result.count, result.clients, opts.loops, opts.stripes,
+                 (BenchTransport::IO_URING == opts.io) ? "uring" : "asio", opts.spin,
+                 (0 != opts.shm) ? "true" : "false", result.seconds, msgs, msgs * result.size / (1024.0 * 1024.0),
+                 result.latencyKind, pct[0], pct[1], pct[2], pct[3], opts.payload.c_str(), opts.compress,
+                 (unsigned long long)result.wireBytes, result.done ? "true" : "false");
+    std::fflush(opts.out);
+}
+
+//  一个用例中的服务端和若干客户端, 都在本进程中通过 loopback 连接
+//  用例结束后停止事件循环并释放传输层, 每个用例使用新的端口, 不受上一个用例残留连接的影响
+static MessageAllocatorPool allocator;
+
+class BenchCase
+{
+public:
+    struct peer_t {
+        BenchTransport* transport;
+        BenchProtocol dispatch;
+        std::thread thread;
+
+        peer_t(bool isServer) : transport(nullptr), dispatch(isServer)
+        {
+        }
+
+        ~peer_t()
+        {
+            delete transport;
+        }
+    };
+
+public:
+    BenchCase(const BenchOptions& opts, int32_t clientCount, bool echo)
+    {
+        static int32_t portSeq = 0;
+        char addr[32] = {0};
+        snprintf(addr, sizeof(addr), "127.0.0.1:%d", opts.port + portSeq++);
+
+        server = NewPeer(opts, 11, true);
+        server->dispatch.echo = echo;
+        if (0 != server->transport->SetupAcceptor(addr)) {
+            exit(1);
+        }
+        for (int32_t i = 0; i < clientCount; i++) {
+            clients.push_back(NewPeer(opts, uint16_t(100 + i), false));
+            clients[i]->transport->SetupConnect(addr);
+        }
+
+        Start(server);
+        for (size_t i = 0; i < clients.size(); i++) {
+            Start(clients[i]);
+        }
+    }
+
+    ~BenchCase()
+    {
+        server->transport->Stop();
+        for (size_t i = 0; i < clients.size(); i++) {
+            clients[i]->transport->Stop();
+        }
+        server->thread.join();
+        delete server;
+        for (size_t i = 0; i < clients.size(); i++) {
+            clients[i]->thread.join();
+            delete clients[i];
+        }
+    }
+
+    //  预热: 每个客户端完成几次往返, 确保连接认证和共享内存协商都已完成
+    bool Warmup(int32_t size)
+    {
+        for (uint64_t round = 1; round <= 3; round++) {
+            for (size_t i = 0; i < clients.size(); i++) {
+                clients[i]->transport->Post(NewMessage(clients[i]->transport, size, 11, 0));
+            }
+            for (size_t i = 0; i < clients.size(); i++) {
+                if (!WaitCount(clients[i]->dispatch.warmed, round, 10.0)) {
+                    return false;
+                }
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return true;
+    }
+
+private:
+    static peer_t* NewPeer(const BenchOptions& opts, uint16_t id, bool isServer)
+    {
+        peer_t* peer = new peer_t(isServer);
+        BenchTransport* transport = new BenchTransport();
+        transport->SetLoops(opts.loops);
+        if (opts.shm >= 0) {
+            transport->SetSharedMemory(opts.shm);
+        }
+        if (0 != transport->Init(id, &(peer->dispatch), &allocator, 256, opts.io)) {
+            std::fprintf(stderr, "init transport failed (io_uring not supported?)\n");
+            std::exit(1);
+        }
+        transport->SetSendLimit(MESSAGE::ADDRESS_INVALID, 0, opts.queue);
+        transport->SetCompression(MESSAGE::ADDRESS_INVALID, opts.compress);
+        if (opts.frag >= 0) {
+            transport->SetFragmentBytes(opts.frag);
+        }
+        transport->SetStripes(opts.stripes);
+        //  接收端按最大的测试消息放宽接收长度限制
+        int64_t largest = int64_t(*std::max_element(opts.sizes.begin(), opts.sizes.end())) + sizeof(MESSAGE);
+        transport->SetMaxMessage(int32_t(std::max<int64_t>(largest, BenchTransport::MESSAGE_BYTES_DEF)));
+        transport->SetPolling(opts.spin, opts.busyPoll);
+        peer->transport = transport;
+        peer->dispatch.allocator = &allocator;
+        peer->dispatch.post = [transport](MESSAGE* msg) {
+            if (POST_OK != transport->Post(msg)) {
+                allocator.Free(msg);
+            }
+        };
+        peer->dispatch.answer = [transport](MESSAGE* msg) {
+            if (POST_OK != transport->Reply(msg, msg)) {
+                allocator.Free(msg);
+            }
+        };
+        return peer;
+    }
+
+    static void Start(peer_t* peer)
+    {
+        BenchTransport* transport = peer->transport;
+        peer->thread = std::thread([transport]() { transport->Loop(); });
+    }
+
+public:
+    peer_t* server;
+    std::vector<peer_t*> clients;
+};
+
+//  写到网络上的字节数(所有流)
+static uint64_t WireBytes(BenchTransport* transport)
+{
+    std::vector<SMQStreamStats> stats;
+    transport->SnapshotStreams(stats);
+    uint64_t bytes = 0;
+    for (auto& stream : stats) {
+        bytes += stream.counters[STREAM_BYTES_OUT];
+    }
+    return bytes;
+}
+
+//  一个客户端发送, 服务端原样返回, 窗口为 1: 统计往返延迟
+static bool BenchPingPong(const BenchOptions& opts, int32_t size)
+{
+    int64_t count = opts.CountOf(size);
+    BenchCase bench(opts, 1, true);
+    BenchProtocol& client = bench.clients[0]->dispatch;
+    client.record = true;
+    client.resend = true;
+    if (!bench.Warmup(size)) {
+        std::fprintf(stderr, "pingpong: connection not ready\n");
+        return false;
+    }
+
+    client.Reset(count);
+    Clock::time_point start = Clock::now();
+    BenchTransport* transport = bench.clients[0]->transport;
+    transport->Post(NewMessage(transport, size, 11, NowNanos()));
+    bool done = WaitCount(client.received, count, 60.0);
+
+    BenchResult result = {"pingpong", "rtt", size, 1, count, SecondsSince(start), &client.latency, done,
+                          WireBytes(transport)};
+    Report(opts, result);
+    return done;
+}
+
+//  若干客户端各自用一个线程持续发送, 服务端接收: 统计吞吐和单向延迟.
+//  clients 为 1 时就是单向流
+static bool BenchOneWay(const BenchOptions& opts, const char* name, int32_t clientCount, int32_t size)
+{
+    int64_t count = opts.CountOf(size);
+    int64_t perClient = std::max<int64_t>(1, count / clientCount);
+    count = perClient * clientCount;
+
+    BenchCase bench(opts, clientCount, false);
+    BenchProtocol& server = bench.server->dispatch;
+    server.record = true;
+    if (!bench.Warmup(size)) {
+        std::fprintf(stderr, "%s: connection not ready\n", name);
+        return false;
+    }
+
+    server.Reset(count);
+    uint64_t wireBefore = 0;
+    for (int32_t i = 0; i < clientCount; i++) {
+        wireBefore += WireBytes(bench.clients[i]->transport);
+    }
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int32_t i = 0; i < clientCount; i++) {
+        BenchTransport* transport = bench.clients[i]->transport;
+        threads.push_back(std::thread([&go, transport, perClient, size]() {
+            while (!go.load(std::memory_order_acquire)) {
+            }
+            //  发送队列满时等待, 内存占用不超过 --queue 的限制
+            for (int64_t n = 0; n < perClient; n++) {
+                transport->PostWait(NewMessage(transport, size, 11, NowNanos()), -1);
+            }
+        }));
+    }
+
+    Clock::time_point start = Clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    bool done = WaitCount(server.received, count, 120.0);
+    double seconds = SecondsSince(start);
+    uint64_t wireAfter = 0;
+    for (int32_t i = 0; i < clientCount; i++) {
+        wireAfter += WireBytes(bench.clients[i]->transport);
+    }
+
+    BenchResult result = {name, "oneway", size, clientCount, count, seconds, &server.latency, done,
+                          wireAfter - wireBefore};
+    Report(opts, result);
+    return done;
+}
+
+//  服务端把每条消息发给所有客户端(行情分发): multicast 为真时用 Multicast 共享一份消息,
+//  否则为每个客户端复制一份再 Post. 统计每条源消息的吞吐和单向延迟.
+//  发送队列有上限(--queue)时, 组播跳过发送队列已满的客户端(慢消费者丢消息), 复制时则等待
+static bool BenchFanOut(const BenchOptions& opts, int32_t clientCount, int32_t size, bool multicast)
+{
+    int64_t count = opts.CountOf(size);
+    const char* name = multicast ? "fanout-mcast" : "fanout-copy";
+    BenchCase bench(opts, clientCount, false);
+    if (!bench.Warmup(size)) {
+        std::fprintf(stderr, "%s: connection not ready\n", name);
+        return false;
+    }
+
+    std::vector<uint16_t> targets;
+    std::vector<uint16_t> skipped;
+    std::vector<uint64_t> expected(clientCount, uint64_t(count));
+    for (int32_t i = 0; i < clientCount; i++) {
+        BenchProtocol& client = bench.clients[i]->dispatch;
+        client.record = true;
+        client.Reset(count);
+        targets.push_back(uint16_t(100 + i));
+    }
+
+    BenchTransport* transport = bench.server->transport;
+    Clock::time_point start = Clock::now();
+    for (int64_t n = 0; n < count; n++) {
+        MESSAGE* msg = allocator.Alloc(size);
+        msg->Type(MESSAGE::TYPE_USER);
+        msg->PayloadLength(size);
+        if (!payloadSample.empty()) {
+            std::memcpy(PayloadOf<uint8_t*>(msg), payloadSample.data(), std::min<size_t>(size, payloadSample.size()));
+        }
+        Stamp(msg, NowNanos());
+
+        if (multicast) {
+            skipped.clear();
+            transport->Multicast(msg, targets, &skipped);
+            for (auto target : skipped) {
+                expected[target - 100]--;
+            }
+            continue;
+        }
+        for (auto target : targets) {
+            MESSAGE* copy = transport->Alloc(target, size);
+            std::memcpy(copy, msg, msg->TotalLength());
+            copy->TotalLength(msg->TotalLength());
+            copy->Target(target);
+            transport->PostWait(copy, -1);
+        }
+        allocator.Free(msg);
+    }
+
+    bool done = true;
+    uint64_t dropped = 0;
+    for (int32_t i = 0; i < clientCount; i++) {
+        done = WaitCount(bench.clients[i]->dispatch.received, expected[i], 120.0) && done;
+        dropped += uint64_t(count) - expected[i];
+    }
+    if (dropped > 0) {
+        std::fprintf(stderr, "%s: %llu deliveries skipped on full send queues\n", name, (unsigned long long)dropped);
+    }
+    double seconds = SecondsSince(start);
+
+    std::vector<int64_t> latency;
+    for (int32_t i = 0; i < clientCount; i++) {
+        std::vector<int64_t>& lat = bench.clients[i]->dispatch.latency;
+        latency.insert(latency.end(), lat.begin(), lat.end());
+    }
+
+    BenchResult result = {name, "oneway", size, clientCount, count, seconds, &latency, done, WireBytes(transport)};
+    Report(opts, result);
+    return done;
+}
+
+//  一个线程持续发送大块数据(--bulk)占满发送队列, 同时每隔 100us 发送一条小消息(探测), 统计探测消息的单向延迟.
+//  lanes 为假时所有消息使用 PRIORITY_NORMAL(同一个队列, 先进先出), 否则探测消息使用 PRIORITY_CONTROL,
+//  大块数据使用 PRIORITY_BULK. 没有指定 --queue 时发送队列限制为 4MB
+static bool BenchPriority(const BenchOptions& opts, int32_t size, bool lanes)
+{
+    const int32_t bulkSize = opts.bulk;
+    int64_t count = std::min<int64_t>(opts.count, 5000);
+    const char* name = lanes ? "priority-lanes" : "priority-fifo";
+    BenchCase bench(opts, 1, false);
+    BenchProtocol& server = bench.server->dispatch;
+    server.record = true;
+    server.probe = size;
+    if (!bench.Warmup(size)) {
+        std::fprintf(stderr, "%s: connection not ready\n", name);
+        return false;
+    }
+
+    BenchTransport* transport = bench.clients[0]->transport;
+    transport->SetSendLimit(MESSAGE::ADDRESS_INVALID, 0, (opts.queue > 0) ? opts.queue : 4 * 1024 * 1024);
+    server.Reset(count);
+
+    std::atomic<bool> stop(false);
+    std::thread bulk([&stop, transport, lanes, bulkSize]() {
+        while (!stop.load(std::memory_order_relaxed)) {
+            MESSAGE* msg = NewMessage(transport, bulkSize, 11, 1);
+            msg->Priority(lanes ? MESSAGE::PRIORITY_BULK : MESSAGE::PRIORITY_NORMAL);
+            if (POST_OK != transport->PostWait(msg, 100)) {
+                allocator.Free(msg);
+            }
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    Clock::time_point start = Clock::now();
+    for (int64_t n = 0; n < count; n++) {
+        MESSAGE* msg = NewMessage(transport, size, 11, NowNanos());
+        msg->Priority(lanes ? MESSAGE::PRIORITY_CONTROL : MESSAGE::PRIORITY_NORMAL);
+        transport->PostWait(msg, -1);
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    bool done = WaitCount(server.received, count, 60.0);
+    double seconds = SecondsSince(start);
+    stop.store(true, std::memory_order_relaxed);
+    bulk.join();
+
+    BenchResult result = {name, "oneway", size, 1, count, seconds, &server.latency, done, WireBytes(transport)};
+    Report(opts, result);
+    return done;
+}
+
+//  一个客户端上的多个业务线程(--clients)各自用 CallWait 同步调用服务端, 服务端原样回复:
+//  统计每次调用的往返延迟和总的调用吞吐
+static bool BenchRpc(const BenchOptions& opts, int32_t size)
+{
+    int32_t threadCount = std::max<int32_t>(1, opts.clients);
+    int64_t perThread = std::max<int64_t>(1, opts.CountOf(size) / threadCount);
+    int64_t count = perThread * threadCount;
+    BenchCase bench(opts, 1, false);
+    if (!bench.Warmup(size)) {
+        std::fprintf(stderr, "rpc: connection not ready\n");
+        return false;
+    }
+
+    BenchTransport* transport = bench.clients[0]->transport;
+    std::vector<std::vector<int64_t>> latencies(threadCount);
+    std::atomic<int64_t> failed(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int32_t i = 0; i < threadCount; i++) {
+        std::vector<int64_t>* lat = &(latencies[i]);
+        threads.push_back(std::thread([&go, &failed, transport, lat, perThread, size]() {
+            lat->reserve(perThread);
+            while (!go.load(std::memory_order_acquire)) {
+            }
+            for (int64_t n = 0; n < perThread; n++) {
+                int64_t stamp = NowNanos();
+                MESSAGE* req = NewMessage(transport, size, 11, stamp);
+                MESSAGE* reply = nullptr;
+                int ret = transport->CallWait(req, 5000, &reply);
+                if (RPC_OK != ret) {
+                    //  投递失败时请求仍归调用者所有
+                    if ((POST_ERROR == ret) || (POST_WOULDBLOCK == ret)) {
+                        allocator.Free(req);
+                    }
+                    failed.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                lat->push_back(NowNanos() - stamp);
+                allocator.Free(reply);
+            }
+        }));
+    }
+
+    Clock::time_point start = Clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = SecondsSince(start);
+
+    std::vector<int64_t> latency;
+    for (auto& lat : latencies) {
+        latency.insert(latency.end(), lat.begin(), lat.end());
+    }
+    if (failed.load() > 0) {
+        std::fprintf(stderr, "rpc: %lld calls failed\n", (long long)failed.load());
+    }
+
+    BenchResult result = {"rpc", "rtt", size, threadCount, count, seconds, &latency, 0 == failed.load(),
+                          WireBytes(transport)};
+    Report(opts, result);
+    return 0 == failed.load();
+}
+
+//  多个业务线程同时调用 Post 向同一个对端发送消息:
+//  统计 Post 本身的吞吐、端到端的吞吐, 以及平均每条消息触发的事件循环唤醒次数
+static int BenchPost(int argc, char* argv[])
+{
+    int32_t producers = (argc > 2) ? atoi(argv[2]) : 4;
+    int64_t count = (argc > 3) ? atoll(argv[3]) : 1000000;
+    int32_t size = (argc > 4) ? atoi(argv[4]) : 16;
+    int32_t loops = (argc > 5) ? atoi(argv[5]) : 1;
+    int32_t spin = (argc > 6) ? atoi(argv[6]) : 0;
+
+    BenchOptions opts;
+    opts.loops = loops;
+    opts.shm = 0;
+    opts.spin = spin;
+    BenchCase bench(opts, 1, false);
+    BenchProtocol& server = bench.server->dispatch;
+    if (!bench.Warmup(size)) {
+        std::fprintf(stderr, "post: connection not ready\n");
+        return 1;
+    }
+
+    BenchTransport* client = bench.clients[0]->transport;
+    uint64_t wakeupsBefore = client->GetWakeups();
+    server.Reset(0);
+
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int32_t i = 0; i < producers; i++) {
+        threads.push_back(std::thread([&]() {
+            while (!go.load(std::memory_order_acquire)) {
+            }
+            for (int64_t n = 0; n < count; n++) {
+                client->Post(NewMessage(client, size, 11, 1));
+            }
+        }));
+    }
+
+    Clock::time_point start = Clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double postSeconds = SecondsSince(start);
+
+    uint64_t total = uint64_t(producers) * count;
+    bool done = WaitCount(server.received, total, 60.0);
+    double totalSeconds = SecondsSince(start);
+    uint64_t wakeups = client->GetWakeups() - wakeupsBefore;
+
+    std::fprintf(stderr,
+                 "post: producers=%d count=%lld size=%d loops=%d spin=%d post=%.0f msgs/s e2e=%.0f msgs/s "
+                 "wakeups=%llu (%.4f per post)%s\n",
+                 producers, (long long)count, size, loops, spin, total / postSeconds, total / totalSeconds,
+                 (unsigned long long)wakeups, double(wakeups) / total, done ? "" : " TIMEOUT");
+    return done ? 0 : 1;
+}
+
+//  在一个事件循环中启动 count 个定时器(到期时间均匀分布在 span~2*span 毫秒, 启动期间不会有定时器到期),
+//  取消其中一半: 统计每次启动/取消的耗时, 以及其余定时器实际到期相对预定时间的延迟
+static int BenchTimers(int argc, char* argv[])
+{
+    int64_t count = (argc > 2) ? atoll(argv[2]) : 1000000;
+    int32_t span = (argc > 3) ? atoi(argv[3]) : 2000;
+
+    BenchOptions opts;
+    opts.shm = 0;
+    BenchCase bench(opts, 1, false);
+    BenchTransport* transport = bench.clients[0]->transport;
+
+    std::vector<TIMER> timers(count);
+    std::vector<int64_t> expected(count, 0);
+    std::vector<int64_t> lateness;
+    lateness.reserve(count / 2 + 1);
+    std::atomic<int64_t> fired(0);
+    for (int64_t i = 0; i < count; i++) {
+        timers[i].callback = [&, i]() {
+            lateness.push_back(NowNanos() - expected[i]);
+            fired.fetch_add(1, std::memory_order_relaxed);
+        };
+    }
+
+    std::atomic<bool> armed(false);
+    double armNanos = 0;
+    double cancelNanos = 0;
+    transport->Execute(11, [&]() {
+        std::mt19937 rng(1);
+        int64_t start = NowNanos();
+        for (int64_t i = 0; i < count; i++) {
+            int32_t ms = span + int32_t(rng() % uint32_t(span));
+            expected[i] = NowNanos() + int64_t(ms) * 1000000;
+            transport->StartTimer(11, &(timers[i]), ms);
+        }
+        int64_t middle = NowNanos();
+        for (int64_t i = 0; i < count; i += 2) {
+            transport->StopTimer(11, &(timers[i]));
+        }
+        armNanos = double(middle - start) / count;
+        cancelNanos = double(NowNanos() - middle) / ((count + 1) / 2);
+        armed.store(true, std::memory_order_release);
+    });
+
+    while (!armed.load(std::memory_order_acquire)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    int64_t remain = count / 2;
+    Clock::time_point start = Clock::now();
+    while ((fired.load() < remain) && (SecondsSince(start) < span * 2 / 1000.0 + 10.0)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    bool done = (fired.load() == remain);
+
+    //  所有定时器都已经到期(或者超时放弃)后才读取延迟
+    std::atomic<bool> drained(false);
+    transport->Execute(11, [&]() { drained.store(true, std::memory_order_release); });
+    while (!drained.load(std::memory_order_acquire)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::sort(lateness.begin(), lateness.end());
+    double p50 = lateness.empty() ? 0 : lateness[lateness.size() / 2] / 1e6;
+    double p99 = lateness.empty() ? 0 : lateness[std::min(lateness.size() - 1, lateness.size() * 99 / 100)] / 1e6;
+    double max = lateness.empty() ? 0 : lateness.back() / 1e6;
+
+    std::fprintf(stderr,
+                 "timers: count=%lld span=%dms arm=%.1fns cancel=%.1fns fired=%lld/%lld "
+                 "late p50=%.2fms p99=%.2fms max=%.2fms%s\n",
+                 (long long)count, span, armNanos, cancelNanos, (long long)fired.load(), (long long)remain, p50, p99,
+                 max, done ? "" : " TIMEOUT");
+    return done ? 0 : 1;
+}
+
+static std::vector<int32_t> SizesOf(const char* str)
+{
+    std::vector<int32_t> sizes;
+    while ('\0' != *str) {
+        char* end = nullptr;
+        long size = strtol(str, &end, 10);
+        if (end == str) {
+            break;
+        }
+        if (('k' == *end) || ('K' == *end)) {
+            size *= 1024;
+            end++;
+        } else if (('m' == *end) || ('M' == *end)) {
+            size *= 1024 * 1024;
+            end++;
+        }
+
+        //  payload 中至少要放下发送时间
+        if (size >= long(sizeof(int64_t))) {
+            sizes.push_back(int32_t(size));
+        }
+        str = (',' == *end) ? (end + 1) : end;
+    }
+    return sizes;
+}
+
+static int ParseOptions(int argc, char* argv[], BenchOptions* opts)
+{
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if (nullptr == value) {
+            std::fprintf(stderr, "missing value for '%s'\n", arg.c_str());
+            return -1;
+        }
+
+        if ("--sizes" == arg) {
+            opts->sizes = SizesOf(value);
+        } else if ("--count" == arg) {
+            opts->count = atoll(value);
+        } else if ("--bytes" == arg) {
+            opts->bytes = atoll(value);
+        } else if ("--clients" == arg) {
+            opts->clients = atoi(value);
+        } else if ("--loops" == arg) {
+            opts->loops = atoi(value);
+        } else if ("--shm" == arg) {
+            opts->shm = atoi(value);
+        } else if ("--port" == arg) {
+            opts->port = atoi(value);
+        } else if ("--compress" == arg) {
+            opts->compress = atoi(value);
+        } else if ("--payload" == arg) {
+            opts->payload = value;
+        } else if ("--queue" == arg) {
+            opts->queue = atoll(value);
+        } else if ("--bulk" == arg) {
+            opts->bulk = atoi(value);
+        } else if ("--frag" == arg) {
+            opts->frag = atoi(value);
+        } else if ("--stripes" == arg) {
+            opts->stripes = atoi(value);
+        } else if ("--io" == arg) {
+            std::string kind = value;
+            if ("asio" == kind) {
+                opts->io = BenchTransport::IO_ASIO;
+            } else if ("uring" == kind) {
+                opts->io = BenchTransport::IO_URING;
+            } else {
+                std::fprintf(stderr, "unknown io backend '%s'\n", value);
+                return -1;
+            }
+        } else if ("--spin" == arg) {
+            opts->spin = atoi(value);
+        } else if ("--busy-poll" == arg) {
+            opts->busyPoll = atoi(value);
+        } else if ("--trace" == arg) {
+            opts->trace = value;
+        } else if ("--out" == arg) {
+            opts->out = fopen(value, "a");
+            if (nullptr == opts->out) {
+                std::fprintf(stderr, "open '%s' failed\n", value);
+                return -1;
+            }
+        } else {
+            std::fprintf(stderr, "unknown option '%s'\n", arg.c_str());
+            return -1;
+        }
+        i++;
+    }
+
+    if (opts->sizes.empty() || (opts->count <= 0) || (opts->clients <= 0) || (opts->loops <= 0) ||
+        (opts->stripes <= 0) || (opts->spin < BenchTransport::LOOP_SPIN) || (opts->busyPoll < 0)) {
+        std::fprintf(stderr, "invalid options\n");
+        return -1;
+    }
+    if (0 != MakeSample(opts->payload, *std::max_element(opts->sizes.begin(), opts->sizes.end()))) {
+        std::fprintf(stderr, "unknown payload '%s'\n", opts->payload.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+static void Usage()
+{
+    printf("we-bench pingpong|stream|fanin|all|compress|fanout|priority|rpc [options]\n");
+    printf("    --sizes 8,64,4k,1m   payload sizes (default 8 to 1m)\n");
+    printf("    --count N            messages per case (default 100000)\n");
+    printf("    --bytes N            max bytes per case, large payloads send fewer messages (default 256m)\n");
+    printf("    --clients N          senders for fanin, receivers for fanout, calling threads for rpc (default 4)\n");
+    printf("    --loops N            event loops per transport (default 1)\n");
+    printf("    --shm BYTES          shared memory ring per direction, 0 to force TCP\n");
+    printf("    --port N             first loopback port, one port per case (default 9090)\n");
+    printf("    --payload KIND       payload content: none, text (repetitive records) or random (default none)\n");
+    printf("    --compress BYTES     compress payloads of at least BYTES when sending, 0 to disable (default 0)\n");
+    printf("    --queue BYTES        send queue limit per channel, senders block when full (default unlimited)\n");
+    printf("    --bulk BYTES         background message size for priority (default 300000)\n");
+    printf("    --frag BYTES         split messages larger than BYTES into fragments, 0 only above 16m\n");
+    printf("    --stripes N          TCP streams per client channel, messages spread over them (default 1)\n");
+    printf("    --io asio|uring      socket I/O backend, uring reads and writes through io_uring (default asio)\n");
+    printf("    --spin US            busy-poll the event loops, sleep after US idle, -1 never sleeps (default 0)\n");
+    printf("    --busy-poll US       SO_BUSY_POLL on TCP connections (default 0)\n");
+    printf("    --out FILE           append JSON lines to FILE instead of stdout\n");
+    printf("    --trace FILE         dump the binary trace to FILE at exit (decode with we-trace)\n");
+    printf("    compress runs stream over TCP with compression off and on (--compress, default 512),\n");
+    printf("    payload defaults to text\n");
+    printf("    fanout sends every message from the server to all clients, copying per client, then by Multicast\n");
+    printf("    priority measures small messages sent behind a bulk stream, in one queue then in priority lanes\n");
+    printf("    rpc runs synchronous calls from --clients threads of one client, the server replies in place\n");
+    printf("we-bench post [producers] [count] [size] [loops] [spin]\n");
+    printf("we-bench timers [count] [span-ms]\n");
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        Usage();
+        return 0;
+    }
+
+    std::string mode = argv[1];
+    if ("post" == mode) {
+        return BenchPost(argc, argv);
+    }
+    if ("timers" == mode) {
+        return BenchTimers(argc, argv);
+    }
+
+    if (("pingpong" != mode) && ("stream" != mode) && ("fanin" != mode) && ("all" != mode) && ("compress" != mode) &&
+        ("fanout" != mode) && ("priority" != mode) && ("rpc" != mode)) {
+        Usage();
+        return 1;
+    }
+
+    BenchOptions opts;
+    if ("compress" == mode) {
+        opts.payload = "text";
+        opts.compress = 512;
+    }
+    if (0 != ParseOptions(argc, argv, &opts)) {
+        return 1;
+    }
+
+    //  每行一个 JSON 对象, 便于跨版本对比
+    bool ok = true;
+    for (size_t i = 0; i < opts.sizes.size(); i++) {
+        int32_t size = opts.sizes[i];
+        if (("pingpong" == mode) || ("all" == mode)) {
+            ok = BenchPingPong(opts, size) && ok;
+        }
+        if (("stream" == mode) || ("all" == mode)) {
+            ok = BenchOneWay(opts, "stream", 1, size) && ok;
+        }
+        if (("fanin" == mode) || ("all" == mode)) {
+            ok = BenchOneWay(opts, "fanin", opts.clients, size) && ok;
+        }
+        if ("fanout" == mode) {
+            ok = BenchFanOut(opts, opts.clients, size, false) && ok;
+            ok = BenchFanOut(opts, opts.clients, size, true) && ok;
+        }
+        if ("priority" == mode) {
+            ok = BenchPriority(opts, size, false) && ok;
+            ok = BenchPriority(opts, size, true) && ok;
+        }
+        if ("rpc" == mode) {
+            ok = BenchRpc(opts, size) && ok;
+        }
+        //  压缩只用于网络连接, 同一组数据先不压缩再压缩
+        if ("compress" == mode) {
+            BenchOptions plain = opts;
+            plain.shm = 0;
+            plain.compress = 0;
+            ok = BenchOneWay(plain, "compress", 1, size) && ok;
+            plain.compress = opts.compress;
+            ok = BenchOneWay(plain, "compress", 1, size) && ok;
+        }
+    }
+
+    if (stdout != opts.out) {
+        fclose(opts.out);
+    }
+    if ((nullptr != opts.trace) && (0 != Trace::Dump(opts.trace))) {
+        std::fprintf(stderr, "dump trace to '%s' failed\n", opts.trace);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "MessagePool.h"
+#include "SMQCoro.h"
+
+//  SMQCoro 的示例和自检(需要 -std=c++20): 同一个进程中的服务端和客户端通过本机连接,
+//  客户端先用 Send/Recv 发送 count 条消息并等待服务端原样发回, 再发起 count 次 Call.
+//  全部成功时返回 0
+
+typedef SMQTransport<CoroMailbox, MessageAllocatorPool> CoroTransport;
+
+enum : uint16_t {
+    SERVER_ID = 11,
+    CLIENT_ID = 22,
+};
+
+static MessageAllocatorPool allocator;
+
+struct CoroResult {
+    std::atomic<bool> done;
+    long echoed;  //  内容正确的回显消息数
+    long called;  //  成功的 RPC 调用数
+    double seconds;
+
+    CoroResult() : done(false), echoed(0), called(0), seconds(0)
+    {
+    }
+};
+
+//  服务端: RPC 请求用 Reply 回复, 其他消息原样发回
+static CoroTask<void> Serve(SMQCoro<CoroTransport>* coro, CoroTransport* transport)
+{
+    for (;;) {
+        MESSAGE* msg = co_await coro->Recv(CLIENT_ID);
+        if (0 != msg->session) {
+            if (POST_OK != transport->Reply(msg, msg)) {
+                allocator.Free(msg);
+            }
+            continue;
+        }
+
+        msg->Target(CLIENT_ID);
+        if (POST_OK != co_await coro->Send(msg)) {
+            allocator.Free(msg);
+        }
+    }
+}
+
+static MESSAGE* NewRequest(CoroTransport* transport, uint32_t seq)
+{
+    MESSAGE* msg = transport->Alloc(SERVER_ID, sizeof(seq));
+    if (nullptr == msg) {
+        return nullptr;
+    }
+    msg->Type(MESSAGE::TYPE_USER);
+    msg->PayloadLength(sizeof(seq));
+    std::memcpy(msg->payload, &seq, sizeof(seq));
+    return msg;
+}
+
+static bool SeqIs(const MESSAGE* msg, uint32_t seq)
+{
+    uint32_t value = 0;
+    if (msg->PayloadLength() != int32_t(sizeof(value))) {
+        return false;
+    }
+    std::memcpy(&value, msg->payload, sizeof(value));
+    return value == seq;
+}
+
+static CoroTask<void> Run(SMQCoro<CoroTransport>* coro, CoroTransport* transport, long count, CoroResult* result)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < count; i++) {
+        MESSAGE* msg = NewRequest(transport, uint32_t(i));
+        if ((nullptr == msg) || (POST_OK != co_await coro->Send(msg))) {
+            allocator.Free(msg);
+            break;
+        }
+
+        MESSAGE* echo = co_await coro->Recv(SERVER_ID);
+        if (SeqIs(echo, uint32_t(i))) {
+            result->echoed++;
+        }
+        allocator.Free(echo);
+    }
+
+    for (long i = 0; i < count; i++) {
+        MESSAGE* req = NewRequest(transport, uint32_t(i));
+        if (nullptr == req) {
+            break;
+        }
+        CoroReply reply = co_await coro->Call(req, 1000);
+        if (RPC_OK != reply.status) {
+            if ((POST_ERROR == reply.status) || (POST_WOULDBLOCK == reply.status)) {
+                allocator.Free(req);
+            }
+            continue;
+        }
+        if (SeqIs(reply.reply, uint32_t(i))) {
+            result->called++;
+        }
+        allocator.Free(reply.reply);
+    }
+
+    result->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result->done.store(true, std::memory_order_release);
+}
+
+int main(int argc, char* argv[])
+{
+    long count = (argc > 1) ? atol(argv[1]) : 10000;
+    std::string saddr = "127.0.0.1:" + std::string((argc > 2) ? argv[2] : "9191");
+    if (count <= 0) {
+        printf("usage: we-coro [COUNT] [PORT]\n");
+        return 1;
+    }
+
+    CoroFrames::Use(&allocator);
+    CoroMailbox serverBox(&allocator, 256);
+    CoroMailbox clientBox(&allocator, 256);
+    CoroTransport* server = new CoroTransport();
+    CoroTransport* client = new CoroTransport();
+    if ((0 != server->Init(SERVER_ID, &serverBox, &allocator, 256)) ||
+        (0 != client->Init(CLIENT_ID, &clientBox, &allocator, 256)) || (0 != server->SetupAcceptor(saddr)) ||
+        (0 != client->SetupConnect(saddr))) {
+        printf("setup transport failed\n");
+        return 1;
+    }
+
+    std::thread serverThread([server]() { server->Loop(); });
+    std::thread clientThread([client]() { client->Loop(); });
+
+    SMQCoro<CoroTransport> serverCoro(server, &serverBox);
+    SMQCoro<CoroTransport> clientCoro(client, &clientBox);
+    CoroResult result;
+    server->Execute(CLIENT_ID, [&]() { CoroSpawn(Serve(&serverCoro, server)); });
+    client->Execute(SERVER_ID, [&]() { CoroSpawn(Run(&clientCoro, client, count, &result)); });
+
+    //  连接建立之前发出的消息在发送队列中等待, 不需要等待连接
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+    while (!result.done.load(std::memory_order_acquire) && (std::chrono::steady_clock::now() < deadline)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    bool ok = result.done.load(std::memory_order_acquire) && (result.echoed == count) && (result.called == count);
+    printf("{\"bench\":\"coro\",\"count\":%ld,\"echoed\":%ld,\"called\":%ld,\"seconds\":%.6f,\"ok\":%s}\n", count,
+           result.echoed, result.called, result.seconds, ok ? "true" : "false");
+
+    //  服务端的协程一直在等待下一条消息, 事件循环停止后不再恢复, 随进程一起结束
+    server->Stop();
+    client->Stop();
+    serverThread.join();
+    clientThread.join();
+    return ok ? 0 : 1;
+}
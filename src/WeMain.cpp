@@ -1,8 +1,14 @@
+#include "Archive.h"
 #include "SMQTransport.h"
 
 
 struct WeHello {
-    char str[10];
+    uint32_t seq;
+    std::string str;
+};
+
+template <>
+struct archive_fields<WeHello> : field_list<ARCHIVE_FIELD(WeHello, seq), ARCHIVE_FIELD(WeHello, str)> {
 };
 
 class WeProtocol
@@ -14,12 +20,20 @@ public:
     //    }
     virtual int32_t HandleMessage(void* stream, MESSAGE* msg)
     {
-        WeHello* hello = PayloadOf<WeHello*>(msg);
-
-        printf("WeDispatch::Handle: '%s'\n", hello->str);
-
+        //  直接读取 payload 中的字段, 不解码
+        ArchiveView<WeHello> hello;
+        if (0 == hello.Bind(msg)) {
+            ArchiveString str = ARCHIVE_GET(hello, WeHello, str);
+            printf("WeDispatch::Handle: %u '%.*s'\n", ARCHIVE_GET(hello, WeHello, seq), int(str.Size()), str.Data());
+        }
+
+        //  消息可能位于共享内存环中, 处理完之后尽快释放
+        allocator->Free(msg);
         return ACTION_NONE;
     }
+
+public:
+    MessageAllocator* allocator = nullptr;
 };
 
 int main(int argc, char* argv[])
@@ -32,6 +46,7 @@ int main(int argc, char* argv[])
 
     WeProtocol dispatch;
     MessageAllocatorDefault allocator;
+    dispatch.allocator = &allocator;
     auto comm = new SMQTransport<WeProtocol, MessageAllocatorDefault>();
     std::thread thread;
     uint16_t target = 0;
@@ -67,12 +82,10 @@ int main(int argc, char* argv[])
         printf("Enter to send test message...\n");
         getchar();
 
-        MESSAGE* msg = allocator.Alloc(sizeof(WeHello));
-        msg->Type(MESSAGE::TYPE_USER);
-        WeHello* hello = PayloadOf<WeHello*>(msg);
-
-        snprintf(hello->str, 6, "he%d", counter++);
-        msg->PayloadLength(sizeof(WeHello));
+        WeHello hello;
+        hello.seq = counter;
+        hello.str = "he" + std::to_string(counter++);
+        MESSAGE* msg = SerializeMessage(&allocator, hello);
         msg->Target(target);
         comm->Post(msg);
     }
@@ -82,17 +95,3 @@ int main(int argc, char* argv[])
     getchar();
     return 0;
 }
-
-//#include "Archive.h"
-//#include "boost/archive/binary_iarchive.hpp"
-//#include "boost/archive/binary_oarchive.hpp"
-//
-// int main(int argc, char* argv[])
-//{
-//    Test t{11, 22};
-//    message_oarchive oar;
-//
-//    oar& t;
-//
-//    return 0;
-//}
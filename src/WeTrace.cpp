@@ -0,0 +1,24 @@
+#include "Trace.h"
+
+//  把 Trace::Dump 写出的二进制跟踪文件解码为文本
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        printf("we-trace <trace-file>\n");
+        return 0;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if (nullptr == in) {
+        printf("open '%s' failed\n", argv[1]);
+        return 1;
+    }
+
+    int ret = Trace::Decode(in, stdout);
+    fclose(in);
+    if (0 != ret) {
+        printf("invalid trace file: %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
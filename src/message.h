@@ -15,6 +15,7 @@
 
 struct MESSAGE;
 struct BUFFER;
+struct BufferOwner;
 
 struct NODE {
     NODE* next;
@@ -63,9 +64,12 @@ struct NODE {
 };
 
 struct BUFFER : public NODE {
+    BufferOwner* owner;  //  为空时缓冲区属于分配器; 否则(例如位于共享内存环中)释放时交还给 owner
     int32_t cap;
     uint16_t source;
     uint16_t target;
+    uint8_t prio;    //  发送优先级, 见 MESSAGE::PRIORITY_XXX
+    int32_t length;  //  大消息(超过 TOTAL_LENGTH_MAX)的总长度, 此时 vtfl 中的长度为 TOTAL_LENGTH_MAX
 };
 static_assert((sizeof(BUFFER) % sizeof(void*) == 0), "make size align");
 
@@ -95,7 +99,7 @@ inline const BUFFER* BufferOf(const MESSAGE* msg)
 
 struct MESSAGE {
     uint32_t vtfl;       //  version(2),type(2),flags(4),length(24)
-    uint32_t session;    //  session id
+    uint32_t session;    //  RPC 调用编号, 0 表示不是 RPC 请求
     uint8_t payload[0];  //  payload header
 
     enum : uint32_t {
@@ -109,21 +113,37 @@ struct MESSAGE {
     };
 
     enum : uint8_t {
-        FLAGS_BYTEORDER = 0,  //  Little-Endian
+        FLAGS_BYTEORDER = 0,      //  Little-Endian
+        FLAGS_COMPRESSED = 0x01,  //  payload 经过压缩: 前 4 字节是压缩前的 payload 长度, 之后是 LzCodec 压缩块
+        FLAGS_REPLY = 0x02,       //  RPC 回复: session 是对应请求的 session, 交给发起调用的回调而不是 DISPATCHER
+        FLAGS_ROUTED = 0x04,      //  经过中间节点转发: payload 之后是路由尾部, 记录端到端的源地址和目的地址
     };
 
     enum : uint16_t {
         ADDRESS_INVALID = 0xFFFF,
     };
 
+    //  线路上一帧的总长度小于 TOTAL_LENGTH_MAX; 更大的消息(不超过 TOTAL_LENGTH_LARGE)只在内存中存在,
+    //  发送时分片, 接收时重组
     enum : uint32_t {
         TOTAL_LENGTH_DEF = 64,
         TOTAL_LENGTH_MAX = 0x00FFFFFF,
+        TOTAL_LENGTH_LARGE = 0x7FFF0000,
     };
 
     enum : uint8_t {
         TYPE_USER = 0x00,
         TYPE_CONN = 0x01,
+        TYPE_FRAG = 0x02,  //  大消息的分片, 只在传输层内部使用
+    };
+
+    //  发送优先级, 只在本端的发送队列中使用, 不上线路; 数值越小越优先
+    enum : uint8_t {
+        PRIORITY_CONTROL = 0,  //  控制消息, 总是最先发送
+        PRIORITY_HIGH = 1,
+        PRIORITY_NORMAL = 2,  //  默认
+        PRIORITY_BULK = 3,    //  大块数据
+        PRIORITY_COUNT = 4,
     };
 
     inline uint8_t Version() const
@@ -156,17 +176,29 @@ struct MESSAGE {
         vtfl = (vtfl & ~VTFL_FLAGS_MASK) | ((uint32_t(flags) << 24) & VTFL_FLAGS_MASK);
     }
 
+    //  大消息的长度保存在 BUFFER 中: 用 memcpy 复制消息(或者 FillHeader)之后需要重新设置 TotalLength
     inline int32_t TotalLength() const
     {
-        return (vtfl & 0x00FFFFFF);
+        uint32_t len = (vtfl & 0x00FFFFFF);
+        return (MESSAGE::TOTAL_LENGTH_MAX != len) ? int32_t(len) : BufferOf(this)->length;
     }
 
     inline void TotalLength(uint32_t len)
     {
-        Q_ASSERT(len < MESSAGE::TOTAL_LENGTH_MAX);
+        Q_ASSERT(len <= MESSAGE::TOTAL_LENGTH_LARGE);
+        if (len >= MESSAGE::TOTAL_LENGTH_MAX) {
+            BufferOf(this)->length = int32_t(len);
+            len = MESSAGE::TOTAL_LENGTH_MAX;
+        }
         vtfl = (vtfl & 0xFF000000) | (len & 0x00FFFFFF);
     }
 
+    //  头部中的长度字段, 用于解析线路上(不在 BUFFER 中)的消息头
+    inline int32_t FrameLength() const
+    {
+        return (vtfl & 0x00FFFFFF);
+    }
+
     inline int32_t PayloadLength() const
     {
         return TotalLength() - sizeof(MESSAGE);
@@ -207,6 +239,19 @@ struct MESSAGE {
         buf->target = s;
     }
 
+    inline uint8_t Priority() const
+    {
+        const BUFFER* buf = BufferOf(this);
+        return buf->prio;
+    }
+
+    inline void Priority(uint8_t prio)
+    {
+        Q_ASSERT(prio < MESSAGE::PRIORITY_COUNT);
+        BUFFER* buf = BufferOf(this);
+        buf->prio = prio;
+    }
+
     inline int32_t Cap() const
     {
         const BUFFER* buf = BufferOf(this);
@@ -217,6 +262,8 @@ struct MESSAGE {
     {
         Version(MESSAGE::VERSION);
         Flags(MESSAGE::FLAGS_BYTEORDER);
+        Priority(MESSAGE::PRIORITY_NORMAL);
+        session = 0;
     }
 };
 
@@ -242,6 +289,12 @@ DEFINE_INTERFACE(Dispatch)
 };
 
 
+DEFINE_INTERFACE(BufferOwner)
+{
+    virtual void Release(BUFFER * buf) = 0;
+};
+
+
 DEFINE_INTERFACE(MessageAllocator)
 {
     virtual MESSAGE* Alloc(int32_t size) = 0;
@@ -257,6 +310,7 @@ public:
 
         BUFFER* buf = (BUFFER*)malloc(sizeof(BUFFER) + cap);
         Q_ASSERT(nullptr != buf);
+        buf->owner = nullptr;
         buf->cap = cap;
 
         MESSAGE* msg = MessageOf(buf);
@@ -269,6 +323,10 @@ public:
     {
         Q_ASSERT(nullptr != msg);
         BUFFER* buf = BufferOf(msg);
+        if (nullptr != buf->owner) {
+            buf->owner->Release(buf);
+            return;
+        }
         free(buf);
     }
 };
@@ -13,6 +13,8 @@ OBJECTS_DIR = "$$PWD/build"
 
 INCLUDEPATH=$$PWD/../boost_1_73_0
 
+unix:!macx: LIBS += -lrt
+
 # You can also make your code fail to compile if it uses deprecated APIs.
 # In order to do so, uncomment the following line.
 # You can also select to disable deprecated APIs only up to a certain version of Qt.
@@ -28,5 +30,16 @@ else: unix:!android: target.path = /opt/$${TARGET}/bin
 
 HEADERS += \
     Archive.h \
+    LzCodec.h \
     MESSAGE.h \
-    SMQTransport.h
+    MessagePool.h \
+    MpscQueue.h \
+    PagedTable.h \
+    RpcTable.h \
+    SMQCoro.h \
+    SMQTransport.h \
+    SeqCounter.h \
+    ShmRing.h \
+    TimerWheel.h \
+    Trace.h \
+    UringQueue.h
@@ -0,0 +1,48 @@
+QT -= gui
+
+CONFIG += c++2a console
+CONFIG -= app_bundle
+DEFINES += QT_DEPRECATED_WARNINGS
+
+QMAKE_CXXFLAGS += -Wno-unused-parameter
+
+# SMQCoro.h 需要协程支持, gcc 10 需要显式打开
+*-g++*: QMAKE_CXXFLAGS += -fcoroutines
+
+
+DESTDIR = "$$PWD"
+OBJECTS_DIR = "$$PWD/build"
+                                                                     ^
+
+INCLUDEPATH=$$PWD/../boost_1_73_0
+
+unix:!macx: LIBS += -lrt
+
+# You can also make your code fail to compile if it uses deprecated APIs.
+# In order to do so, uncomment the following line.
+# You can also select to disable deprecated APIs only up to a certain version of Qt.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+SOURCES += \
+        WeCoro.cpp
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
+
+HEADERS += \
+    Archive.h \
+    LzCodec.h \
+    MESSAGE.h \
+    MessagePool.h \
+    MpscQueue.h \
+    PagedTable.h \
+    RpcTable.h \
+    SMQCoro.h \
+    SMQTransport.h \
+    SeqCounter.h \
+    ShmRing.h \
+    TimerWheel.h \
+    Trace.h \
+    UringQueue.h